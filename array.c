@@ -2,35 +2,49 @@
 #include "value.h"
 #include "vm.h"
 #include "object.h"
+#include "memory.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 static Value ArrayGet(int argCount, Value* args) {
-	if (argCount != 2) return NIL_VAL;
-	ValueArray* val_array = ((ValueArray*)AS_NATIVE_VAL(args[0]));
+	if (argCount != 2 || !IS_ARRAY(args[0])) return NIL_VAL;
+	ValueArray* val_array = &AS_ARRAY(args[0])->values;
 	Value val = val_array->values[(int)AS_NUMBER(args[1])];
 	return val;
 }
 
 static Value ArraySet(int argCount, Value* args) {
-	if (argCount != 3) return NIL_VAL;
-	ValueArray* val_array = ((ValueArray*)AS_NATIVE_VAL(args[0]));
-	val_array->values[(int)AS_NUMBER(args[1])] = args[2];
+	if (argCount != 3 || !IS_ARRAY(args[0])) return NIL_VAL;
+	ValueArray* val_array = &AS_ARRAY(args[0])->values;
+	if (vm.gcPhase == GC_CONCURRENT_MARK) {
+		lockHeap();
+		SATB_BARRIER(val_array->values[(int)AS_NUMBER(args[1])]);
+		val_array->values[(int)AS_NUMBER(args[1])] = args[2];
+		unlockHeap();
+	}
+	else {
+		val_array->values[(int)AS_NUMBER(args[1])] = args[2];
+	}
+	WRITE_BARRIER(AS_OBJ(args[0]), args[2]);
 	return NIL_VAL;
 }
 
 static Value ArrayLength(int argCount, Value* args) {
-	if (argCount != 1) return NIL_VAL;
-	ValueArray* val_array = ((ValueArray*)AS_NATIVE_VAL(args[0]));
+	if (argCount != 1 || !IS_ARRAY(args[0])) return NIL_VAL;
+	ValueArray* val_array = &AS_ARRAY(args[0])->values;
 	Value val = NUMBER_VAL(val_array->count);
 	return val;
 }
 
 static Value ArrayAdd(int argCount, Value* args) {
-	if (argCount != 2) return NIL_VAL;
-	ValueArray* val_array = ((ValueArray*)AS_NATIVE_VAL(args[0]));
+	if (argCount != 2 || !IS_ARRAY(args[0])) return NIL_VAL;
+	ValueArray* val_array = &AS_ARRAY(args[0])->values;
+	// growing moves the values the marker may be reading
+	if (vm.gcPhase == GC_CONCURRENT_MARK) lockHeap();
 	writeValueArray(val_array, args[1]);
+	if (vm.gcPhase == GC_CONCURRENT_MARK) unlockHeap();
+	WRITE_BARRIER(AS_OBJ(args[0]), args[1]);
 	return NIL_VAL;
 }
 
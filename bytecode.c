@@ -0,0 +1,481 @@
+#include "bytecode.h"
+#include "compiler.h"
+#include "memory.h"
+#include "vm.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A .rosec file holds what compile() made of a script, little endian:
+//
+//   "ROSEC" <version:u8> <opcodes:u8> <key:u64> <checksum:u64> <function>
+//
+//   function: <arity:u32> <upvalues:u32> <name:constant> <length:u32>
+//             <code> <count:u32> <constant>...
+//   constant: <tag:u8>, then nothing for nil, true and false, 8 bytes for
+//             a number, <length:u32> <chars> for a string, and a function
+//
+// The key hashes the version and the source. The directories compile()
+// put in the script's first constants are replaced on reading, so moving
+// a project keeps its files. The checksum covers the function, so a
+// damaged file is compiled again rather than run. OP_CALL_NATIVE is
+// linked again by name, as other builds can number the natives
+// differently.
+
+#define BYTECODE_MAGIC "ROSEC"
+#define BYTECODE_MAGIC_LENGTH 5
+#define BYTECODE_HEADER_LENGTH (BYTECODE_MAGIC_LENGTH + 2 + 2 * 8)
+#define FNV_OFFSET 14695981039346656037ULL
+// deeper nesting than any source compiles to, a damaged file could recurse
+#define BYTECODE_MAX_DEPTH 1024
+
+typedef enum {
+	TAG_NIL,
+	TAG_FALSE,
+	TAG_TRUE,
+	TAG_NUMBER,
+	TAG_STRING,
+	TAG_FUNCTION
+} ConstantTag;
+
+typedef struct {
+	uint8_t* bytes;
+	size_t count;
+	size_t capacity;
+} Writer;
+
+typedef struct {
+	const uint8_t* at;
+	const uint8_t* end;
+} Reader;
+
+// FNV-1a
+static uint64_t hashBytes(uint64_t hash, const void* bytes, size_t length) {
+	const uint8_t* byte = (const uint8_t*)bytes;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= byte[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Only the source goes in: the slots compile() fills from the directories
+// are replaced when the file is read.
+static uint64_t sourceKey(const char* source) {
+	uint8_t version = BYTECODE_VERSION;
+	uint64_t hash = hashBytes(FNV_OFFSET, &version, 1);
+	return hashBytes(hash, source, strlen(source) + 1);
+}
+
+// "game.rose" keeps its bytecode in "game.rosec", other names get ".rosec"
+static bool bytecodePath(const char* path, char* bytecode, size_t size) {
+	size_t length = strlen(path);
+	const char* suffix = length >= 5 && strcmp(path + length - 5, ".rose") == 0 ? "c" : ".rosec";
+	if (length + strlen(suffix) + 1 > size) return false;
+
+	memcpy(bytecode, path, length);
+	strcpy(bytecode + length, suffix);
+	return true;
+}
+
+static void writeBytes(Writer* writer, const void* bytes, size_t length) {
+	if (writer->count + length > writer->capacity) {
+		while (writer->count + length > writer->capacity) {
+			writer->capacity = writer->capacity < 256 ? 256 : writer->capacity * 2;
+		}
+		writer->bytes = (uint8_t*)realloc(writer->bytes, writer->capacity);
+		if (writer->bytes == NULL) exit(1);
+	}
+	memcpy(writer->bytes + writer->count, bytes, length);
+	writer->count += length;
+}
+
+static void writeByte(Writer* writer, uint8_t byte) {
+	writeBytes(writer, &byte, 1);
+}
+
+static void writeU32(Writer* writer, uint32_t value) {
+	uint8_t bytes[4];
+	for (int i = 0; i < 4; i++) bytes[i] = (uint8_t)(value >> (8 * i));
+	writeBytes(writer, bytes, 4);
+}
+
+static void writeU64(Writer* writer, uint64_t value) {
+	uint8_t bytes[8];
+	for (int i = 0; i < 8; i++) bytes[i] = (uint8_t)(value >> (8 * i));
+	writeBytes(writer, bytes, 8);
+}
+
+static bool writeFunction(Writer* writer, ObjFunction* function);
+
+// false for a constant the format has no tag for
+static bool writeValue(Writer* writer, Value value) {
+	switch (value.type) {
+	case VAL_NIL:
+		writeByte(writer, TAG_NIL);
+		return true;
+	case VAL_BOOL:
+		writeByte(writer, AS_BOOL(value) ? TAG_TRUE : TAG_FALSE);
+		return true;
+	case VAL_NUMBER: {
+		uint64_t bits;
+		memcpy(&bits, &value.as.number, sizeof(double));
+		writeByte(writer, TAG_NUMBER);
+		writeU64(writer, bits);
+		return true;
+	}
+	case VAL_OBJ:
+		if (IS_STRING(value)) {
+			ObjString* string = AS_STRING(value);
+			writeByte(writer, TAG_STRING);
+			writeU32(writer, (uint32_t)string->length);
+			writeBytes(writer, string->chars, string->length);
+			return true;
+		}
+		if (IS_FUNCTION(value)) {
+			writeByte(writer, TAG_FUNCTION);
+			return writeFunction(writer, AS_FUNCTION(value));
+		}
+		return false;
+	}
+	return false;
+}
+
+static bool writeFunction(Writer* writer, ObjFunction* function) {
+	Chunk* chunk = &function->chunk;
+	writeU32(writer, (uint32_t)function->arity);
+	writeU32(writer, (uint32_t)function->upvalueCount);
+	if (!writeValue(writer, function->name == NULL ? NIL_VAL : OBJ_VAL(function->name))) return false;
+
+	writeU32(writer, (uint32_t)chunk->count);
+	writeBytes(writer, chunk->code, chunk->count);
+	writeU32(writer, (uint32_t)chunk->constants.count);
+	for (int i = 0; i < chunk->constants.count; i++) {
+		if (!writeValue(writer, chunk->constants.values[i])) return false;
+	}
+	return true;
+}
+
+static unsigned long processId() {
+#ifdef _WIN32
+	return (unsigned long)GetCurrentProcessId();
+#else
+	return (unsigned long)getpid();
+#endif
+}
+
+// move 'from' over 'to' in one step, so readers see the old file or the new
+static bool replaceFile(const char* from, const char* to) {
+#ifdef _WIN32
+	return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(from, to) == 0;
+#endif
+}
+
+static bool writeBytecode(ObjFunction* script, uint64_t key, const char* path) {
+	Writer writer = { NULL, 0, 0 };
+	writeBytes(&writer, BYTECODE_MAGIC, BYTECODE_MAGIC_LENGTH);
+	writeByte(&writer, BYTECODE_VERSION);
+	writeByte(&writer, OP_RETURN + 1);
+	writeU64(&writer, key);
+	writeU64(&writer, 0);
+	bool written = writeFunction(&writer, script);
+
+	// the checksum goes in the slot left for it
+	uint64_t checksum = hashBytes(FNV_OFFSET, writer.bytes + BYTECODE_HEADER_LENGTH,
+		writer.count - BYTECODE_HEADER_LENGTH);
+	for (int i = 0; i < 8; i++) {
+		writer.bytes[BYTECODE_HEADER_LENGTH - 8 + i] = (uint8_t)(checksum >> (8 * i));
+	}
+
+	// Truncating the file in place would pull it out from under a process
+	// that has it mapped, so a whole new file is renamed over it.
+	char temporary[FILENAME_MAX];
+	if (written) {
+		written = snprintf(temporary, sizeof(temporary), "%s.%lu.tmp", path, processId()) < (int)sizeof(temporary);
+	}
+	if (written) {
+		FILE* file = fopen(temporary, "wb");
+		written = file != NULL && fwrite(writer.bytes, 1, writer.count, file) == writer.count;
+		if (file != NULL && fclose(file) != 0) written = false;
+		if (written) written = replaceFile(temporary, path);
+		if (file != NULL && !written) remove(temporary);
+	}
+	free(writer.bytes);
+	return written;
+}
+
+// the file at 'path' read-only in memory, NULL if it can't be mapped
+static const uint8_t* mapFile(const char* path, size_t* size) {
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return NULL;
+
+	LARGE_INTEGER length;
+	if (!GetFileSizeEx(file, &length) || length.QuadPart == 0) {
+		CloseHandle(file);
+		return NULL;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (mapping == NULL) return NULL;
+
+	// the view keeps the mapping open
+	const uint8_t* start = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	*size = (size_t)length.QuadPart;
+	return start;
+#else
+	int file = open(path, O_RDONLY);
+	if (file == -1) return NULL;
+
+	struct stat status;
+	if (fstat(file, &status) != 0 || status.st_size == 0) {
+		close(file);
+		return NULL;
+	}
+	void* start = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+	if (start == MAP_FAILED) return NULL;
+
+	*size = (size_t)status.st_size;
+	return (const uint8_t*)start;
+#endif
+}
+
+static void unmapFile(const uint8_t* start, size_t size) {
+#ifdef _WIN32
+	UnmapViewOfFile(start);
+#else
+	munmap((void*)start, size);
+#endif
+}
+
+// the next 'length' bytes, NULL past the end of the file
+static const uint8_t* readBytes(Reader* reader, size_t length) {
+	if ((size_t)(reader->end - reader->at) < length) return NULL;
+	const uint8_t* bytes = reader->at;
+	reader->at += length;
+	return bytes;
+}
+
+static bool readU32(Reader* reader, uint32_t* value) {
+	const uint8_t* bytes = readBytes(reader, 4);
+	if (bytes == NULL) return false;
+	*value = 0;
+	for (int i = 0; i < 4; i++) *value |= (uint32_t)bytes[i] << (8 * i);
+	return true;
+}
+
+static bool readU64(Reader* reader, uint64_t* value) {
+	const uint8_t* bytes = readBytes(reader, 8);
+	if (bytes == NULL) return false;
+	*value = 0;
+	for (int i = 0; i < 8; i++) *value |= (uint64_t)bytes[i] << (8 * i);
+	return true;
+}
+
+static ObjFunction* readFunction(Reader* reader, int depth);
+
+static bool readValue(Reader* reader, int depth, Value* value) {
+	const uint8_t* tag = readBytes(reader, 1);
+	if (tag == NULL) return false;
+
+	switch (*tag) {
+	case TAG_NIL:
+		*value = NIL_VAL;
+		return true;
+	case TAG_FALSE:
+	case TAG_TRUE:
+		*value = BOOL_VAL(*tag == TAG_TRUE);
+		return true;
+	case TAG_NUMBER: {
+		uint64_t bits;
+		if (!readU64(reader, &bits)) return false;
+		*value = NUMBER_VAL(0);
+		memcpy(&value->as.number, &bits, sizeof(double));
+		return true;
+	}
+	case TAG_STRING: {
+		uint32_t length;
+		const uint8_t* chars;
+		if (!readU32(reader, &length) || length > INT32_MAX || (chars = readBytes(reader, length)) == NULL) return false;
+		*value = OBJ_VAL(copyString((const char*)chars, (int)length));
+		return true;
+	}
+	case TAG_FUNCTION: {
+		ObjFunction* function = readFunction(reader, depth + 1);
+		if (function == NULL) return false;
+		*value = OBJ_VAL(function);
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+// the native registered as 'name', the last one if it was registered twice
+static int findNative(ObjString* name) {
+	for (int i = vm.nativeCount - 1; i >= 0; i--) {
+		if (vm.natives[i].name == name) return i;
+	}
+	return -1;
+}
+
+static int readIndex(uint8_t* at) {
+	return at[0] | (at[1] << 8) | (at[2] << 16) | (at[3] << 24);
+}
+
+// Walk the code, making sure each instruction ends inside it, and point
+// each OP_CALL_NATIVE at the native of its name in this build. Only the
+// constants of OP_CLOSURE and OP_CALL_NATIVE are checked here. Other
+// constant indices, jump targets and stack slots are trusted, and the
+// checksum is all that keeps a damaged file from running with them.
+static bool linkCode(ObjFunction* function) {
+	Chunk* chunk = &function->chunk;
+	for (int offset = 0; offset < chunk->count;) {
+		uint8_t op = chunk->code[offset];
+		if (op > OP_RETURN) return false;
+
+		if (op == OP_CLOSURE || op == OP_CALL_NATIVE) {
+			if (offset + 1 + (int)sizeof(int) > chunk->count) return false;
+			int constant = readIndex(&chunk->code[offset + 1]);
+			if (constant < 0 || constant >= chunk->constants.count) return false;
+			Value value = chunk->constants.values[constant];
+
+			if (op == OP_CLOSURE && !IS_FUNCTION(value)) return false;
+			if (op == OP_CALL_NATIVE) {
+				if (offset + 3 + (int)sizeof(int) > chunk->count || !IS_STRING(value)) return false;
+				int native = findNative(AS_STRING(value));
+				if (native == -1 || native > UINT8_MAX) return false;
+				chunk->code[offset + 1 + sizeof(int)] = (uint8_t)native;
+			}
+		}
+
+		int length = instructionLength(chunk, offset);
+		if (offset + length > chunk->count) return false;
+		offset += length;
+	}
+	return true;
+}
+
+static ObjFunction* readFunction(Reader* reader, int depth) {
+	if (depth > BYTECODE_MAX_DEPTH) return NULL;
+
+	uint32_t arity, upvalueCount, length, count;
+	Value name;
+	if (!readU32(reader, &arity) || arity > UINT8_MAX ||
+		!readU32(reader, &upvalueCount) || upvalueCount > UINT8_COUNT ||
+		!readValue(reader, depth, &name) || (!IS_NIL(name) && !IS_STRING(name)) ||
+		!readU32(reader, &length) || length > INT32_MAX) {
+		return NULL;
+	}
+	const uint8_t* code = readBytes(reader, length);
+	if (code == NULL) return NULL;
+
+	// nothing collects before the script is on the stack, see SAFE_POINT
+	ObjFunction* function = newFunction();
+	function->arity = (int)arity;
+	function->upvalueCount = (int)upvalueCount;
+	function->name = IS_NIL(name) ? NULL : AS_STRING(name);
+
+	Chunk* chunk = &function->chunk;
+	if (length > 0) {
+		chunk->code = GROW_ARRAY(uint8_t, chunk->code, 0, length);
+		memcpy(chunk->code, code, length);
+	}
+	chunk->count = chunk->capacity = (int)length;
+
+	if (!readU32(reader, &count) || count > (uint32_t)(reader->end - reader->at)) return NULL;
+	for (uint32_t i = 0; i < count; i++) {
+		Value value;
+		if (!readValue(reader, depth, &value)) return NULL;
+		appendConstant(chunk, value);
+	}
+	return linkCode(function) ? function : NULL;
+}
+
+// Build the script in the file at 'path', NULL if it isn't a .rosec file
+// of this build or, unless 'anyKey', was written under another key. The
+// script's directories become 'exePath' and 'dir'.
+static ObjFunction* readBytecode(const char* path, uint64_t key, bool anyKey,
+	char* exePath, char* dir, bool isPackage) {
+	size_t size;
+	const uint8_t* start = mapFile(path, &size);
+	if (start == NULL) return NULL;
+
+	Reader reader = { start, start + size };
+	const uint8_t* magic = readBytes(&reader, BYTECODE_MAGIC_LENGTH);
+	const uint8_t* versions = readBytes(&reader, 2);
+	uint64_t fileKey, checksum;
+	ObjFunction* script = NULL;
+
+	if (magic != NULL && memcmp(magic, BYTECODE_MAGIC, BYTECODE_MAGIC_LENGTH) == 0 &&
+		versions != NULL && versions[0] == BYTECODE_VERSION && versions[1] == OP_RETURN + 1 &&
+		readU64(&reader, &fileKey) && (anyKey || fileKey == key) && readU64(&reader, &checksum) &&
+		hashBytes(FNV_OFFSET, reader.at, reader.end - reader.at) == checksum) {
+		script = readFunction(&reader, 0);
+	}
+
+	// slots 0 to 2, as compile() would have filled them here
+	if (script != NULL && (reader.at != reader.end || script->chunk.constants.count < 3)) script = NULL;
+	if (script != NULL) {
+		Value* constants = script->chunk.constants.values;
+		constants[0] = BOOL_VAL(isPackage);
+		constants[1] = OBJ_VAL(copyString(exePath, (int)strlen(exePath)));
+		constants[2] = OBJ_VAL(copyString(dir, (int)strlen(dir)));
+		script->chunk.sharedFrom = 3;
+	}
+
+	unmapFile(start, size);
+	return script;
+}
+
+ObjFunction* compileCached(const char* source, const char* path, char* exePath, char* dir, bool isPackage) {
+	char bytecode[FILENAME_MAX];
+	if (!vm.caching || !bytecodePath(path, bytecode, sizeof(bytecode))) {
+		return compile(source, exePath, dir, isPackage);
+	}
+
+	uint64_t key = sourceKey(source);
+	ObjFunction* function = readBytecode(bytecode, key, false, exePath, dir, isPackage);
+	if (function != NULL) return function;
+
+	function = compile(source, exePath, dir, isPackage);
+	// a directory that can't be written to only costs the next run a compile
+	if (function != NULL) writeBytecode(function, key, bytecode);
+	return function;
+}
+
+bool compileBytecode(const char* source, const char* path, char* exePath, char* dir) {
+	char bytecode[FILENAME_MAX];
+	if (!bytecodePath(path, bytecode, sizeof(bytecode))) {
+		fprintf(stderr, "Path \"%s\" is too long.\n", path);
+		return false;
+	}
+
+	ObjFunction* function = compile(source, exePath, dir, false);
+	if (function == NULL) return false;
+
+	if (!writeBytecode(function, sourceKey(source), bytecode)) {
+		fprintf(stderr, "Could not write \"%s\".\n", bytecode);
+		return false;
+	}
+	return true;
+}
+
+ObjFunction* loadBytecode(const char* path, char* exePath, char* dir) {
+	return readBytecode(path, 0, true, exePath, dir, false);
+}
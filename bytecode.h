@@ -0,0 +1,20 @@
+#ifndef ROSE_BYTECODE_H
+#define ROSE_BYTECODE_H
+#include "object.h"
+
+// bump when the format or an instruction changes
+#define BYTECODE_VERSION 2
+
+// Build the script compiled from 'source', read from 'path', out of the
+// .rosec file next to it when that was written for the same source.
+// Otherwise compile() it and write the file for next time.
+ObjFunction* compileCached(const char* source, const char* path, char* exePath, char* dir, bool isPackage);
+
+// compile 'source' to the .rosec file of 'path', for --compile
+bool compileBytecode(const char* source, const char* path, char* exePath, char* dir);
+
+// build the script in a .rosec file whatever source it came from, NULL if
+// it is not one this build can run
+ObjFunction* loadBytecode(const char* path, char* exePath, char* dir);
+
+#endif
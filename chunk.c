@@ -1,10 +1,14 @@
 #include <stdint.h>
+#include <string.h>
 #include "chunk.h"
 #include "memory.h"
 #include "vm.h"
 
 void initChunk(Chunk* chunk){
     initValueArray(&chunk->constants);
+    chunk->constantIndex = NULL;
+    chunk->indexCapacity = 0;
+    chunk->sharedFrom = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
     chunk->count = 0;
@@ -128,16 +132,175 @@ void freeChunk(Chunk* chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
   //FREE_ARRAY(int, chunk->lines, chunk->capacity);
   freeValueArray(&chunk->constants);
+  FREE_ARRAY(int, chunk->constantIndex, chunk->indexCapacity);
   initChunk(chunk);
 }
 
-int addConstant(Chunk* chunk, Value value) {
+// a slot of its own, for constants the VM reads by index
+int appendConstant(Chunk* chunk, Value value) {
   push(value); // to protect object from the garbage collection monster
   writeValueArray(&chunk->constants, value);
   pop();
   return chunk->constants.count - 1;
 }
 
+// Numbers, strings, booleans and nil are shared. Numbers are compared by
+// their bits: 0 and -0 differ, and a NaN matches itself.
+static bool isShared(Value value) {
+    return !IS_OBJ(value) || IS_STRING(value);
+}
+
+static bool sameConstant(Value a, Value b) {
+    if (a.type != b.type) return false;
+    switch (a.type) {
+    case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
+    case VAL_NIL:    return true;
+    case VAL_NUMBER: return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+    case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+    }
+    return false;
+}
+
+static uint32_t hashConstant(Value value) {
+    switch (value.type) {
+    case VAL_BOOL: return AS_BOOL(value) ? 1 : 2;
+    case VAL_NIL:  return 3;
+    case VAL_NUMBER: {
+        uint64_t bits;
+        memcpy(&bits, &value.as.number, sizeof(double));
+        bits ^= bits >> 33;
+        bits *= 0xff51afd7ed558ccdULL;
+        bits ^= bits >> 33;
+        return (uint32_t)bits;
+    }
+    case VAL_OBJ: return AS_STRING(value)->hash;
+    }
+    return 0;
+}
+
+// entry of the slot holding 'value', or the empty one it would go in
+static int* findConstant(Chunk* chunk, Value value) {
+    uint32_t mask = (uint32_t)chunk->indexCapacity - 1;
+    for (uint32_t i = hashConstant(value) & mask;; i = (i + 1) & mask) {
+        int* entry = &chunk->constantIndex[i];
+        if (*entry == -1) return entry;
+        if (sameConstant(chunk->constants.values[*entry], value)) return entry;
+    }
+}
+
+static void growConstantIndex(Chunk* chunk) {
+    FREE_ARRAY(int, chunk->constantIndex, chunk->indexCapacity);
+    // slots appended without the index, as a loaded chunk's are, may need
+    // more than one step
+    int capacity = GROW_CAPACITY(chunk->indexCapacity);
+    while (chunk->constants.count + 1 > capacity / 2) capacity = GROW_CAPACITY(capacity);
+    chunk->indexCapacity = capacity;
+    chunk->constantIndex = ALLOCATE(int, chunk->indexCapacity);
+    for (int i = 0; i < chunk->indexCapacity; i++) chunk->constantIndex[i] = -1;
+
+    // the first of equal slots wins
+    for (int i = chunk->sharedFrom; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+        if (!isShared(constant)) continue;
+        int* entry = findConstant(chunk, constant);
+        if (*entry == -1) *entry = i;
+    }
+}
+
+int addConstant(Chunk* chunk, Value value) {
+    if (!isShared(value)) return appendConstant(chunk, value);
+
+    if (chunk->constants.count + 1 > chunk->indexCapacity / 2) growConstantIndex(chunk);
+    int* entry = findConstant(chunk, value);
+    if (*entry != -1) return *entry;
+
+    *entry = appendConstant(chunk, value);
+    return *entry;
+}
+
+// take 'slot' out of the index, moving the entries probed past it back
+static void unindexConstant(Chunk* chunk, int slot) {
+    int* index = chunk->constantIndex;
+    uint32_t mask = (uint32_t)chunk->indexCapacity - 1;
+
+    uint32_t hole = hashConstant(chunk->constants.values[slot]) & mask;
+    while (index[hole] != slot) {
+        // an equal slot before it is the indexed one
+        if (index[hole] == -1) return;
+        hole = (hole + 1) & mask;
+    }
+
+    for (uint32_t i = (hole + 1) & mask; index[i] != -1; i = (i + 1) & mask) {
+        uint32_t home = hashConstant(chunk->constants.values[index[i]]) & mask;
+        bool reachable = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+        if (reachable) continue;
+
+        index[hole] = index[i];
+        hole = i;
+    }
+    index[hole] = -1;
+}
+
+// Give back the slots from 'count' on, which only code the compiler
+// dropped used
+void truncateConstants(Chunk* chunk, int count) {
+    while (chunk->constants.count > count) {
+        int slot = chunk->constants.count - 1;
+        if (chunk->indexCapacity > 0 && isShared(chunk->constants.values[slot])) {
+            unindexConstant(chunk, slot);
+        }
+        chunk->constants.count--;
+    }
+}
+
+// bytes in the instruction at 'offset', operands included
+int instructionLength(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+        return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_LOOP:
+        return 3;
+    // counter slot, limit slot and flags, then the jump
+    case OP_FOR_PREP:
+        return 6;
+    // the step constant comes before the jump
+    case OP_FOR_LOOP:
+        return 6 + sizeof(int);
+    case OP_CONSTANT_LONG:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_CLASS:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+        return 1 + sizeof(int);
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+        return 2 + sizeof(int);
+    // the name, then the native's index and the argument count
+    case OP_CALL_NATIVE:
+        return 3 + sizeof(int);
+    case OP_CLOSURE: {
+        // a pair of bytes for each upvalue follows the function
+        uint8_t* operand = &chunk->code[offset + 1];
+        int index = operand[0] | (operand[1] << 8) | (operand[2] << 16) | (operand[3] << 24);
+        Value function = chunk->constants.values[index];
+        return 1 + sizeof(int) + 2 * AS_FUNCTION(function)->upvalueCount;
+    }
+    default:
+        return 1;
+    }
+}
+
 int getLine(Chunk* chunk, int offset){
     /*int counter = 0;
     for(int i = 0; i < *chunk->lines; i++){
@@ -31,9 +31,15 @@ typedef enum{
     OP_GET_LOCAL,
     OP_SET_LOCAL,
     OP_JUMP_IF_FALSE,
+    OP_POP_JUMP_IF_FALSE,
     OP_JUMP,
     OP_LOOP,
+    // counted loops, see forStatement
+    OP_FOR_PREP,
+    OP_FOR_LOOP,
     OP_CALL,
+    // a call to a native the name held at compile time, see nativeIndex
+    OP_CALL_NATIVE,
     OP_CLOSURE,
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
@@ -51,6 +57,18 @@ typedef enum{
     OP_RETURN
 } OpCode;
 
+// The flags operand of OP_FOR_PREP and OP_FOR_LOOP: the comparison the
+// loop's condition made between the counter and the limit, and whether
+// its step subtracts.
+typedef enum {
+    FOR_LESS,
+    FOR_LESS_EQUAL,
+    FOR_GREATER,
+    FOR_GREATER_EQUAL,
+    FOR_TEST = 3,
+    FOR_SUBTRACT = 4
+} ForFlags;
+
 typedef struct {
     uint8_t* code;
     int count;
@@ -59,6 +77,12 @@ typedef struct {
     int lineCount;
     int lineCapacity;
     ValueArray constants;
+    // open addressing over the constant slots, -1 for an empty entry, so
+    // identical numbers, strings and names share one slot
+    int* constantIndex;
+    int indexCapacity;
+    // slots below this one are never shared
+    int sharedFrom;
 } Chunk;
 
 void initChunk(Chunk* chunk);
@@ -67,6 +91,9 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line);
 void writeConstant(Chunk* chunk, unsigned char opcode, Value value, int line);
 void writeInt(Chunk* chunk, unsigned char opcode, int value, int line);
 int addConstant(Chunk* chunk, Value value);
+int appendConstant(Chunk* chunk, Value value);
+void truncateConstants(Chunk* chunk, int count);
+int instructionLength(Chunk* chunk, int offset);
 int getLine(Chunk* chunk, int offset);
 
 #endif
\ No newline at end of file
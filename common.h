@@ -7,6 +7,8 @@
 // Garbage Collection
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
+// Hash tables: probe lengths of vm.strings and vm.globals on exit
+//#define DEBUG_TABLE_STATS
 
 #define UINT8_COUNT 256
 
@@ -7,6 +7,7 @@
 #include "scanner.h"
 #include "object.h"
 #include "memory.h"
+#include "optimize.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -59,6 +60,18 @@ Compiler* current = NULL;
 ClassCompiler* currentClass = NULL;
 Chunk* compilingChunk;
 
+// where the left operand of the infix rule being parsed starts, in the
+// code and in the constant pool
+static int operandStart;
+static int operandConstants;
+// The last OP_NOT unary() emitted: its chunk, where its operand starts,
+// where it ends and whether the operand was another '!'. In a condition
+// !!x is just x.
+static Chunk* notChunk;
+static int notStart;
+static int notEnd = -1;
+static bool notNegatesNot;
+
 typedef enum {
 	PREC_NONE,
 	PREC_ASSIGNMENT,  // =
@@ -198,6 +211,47 @@ static void emitConstant(Value value) {
 	writeConstant(currentChunk(), OP_CONSTANT_LONG, value, parser.previous.line);
 }
 
+// The value pushed by the one instruction between 'start' and 'end', if
+// it is a constant
+static bool constantAt(int start, int end, Value* value) {
+	Chunk* chunk = currentChunk();
+	if (start >= end) return false;
+
+	switch (chunk->code[start]) {
+	case OP_NIL:
+		*value = NIL_VAL;
+		return end == start + 1;
+	case OP_TRUE:
+		*value = BOOL_VAL(true);
+		return end == start + 1;
+	case OP_FALSE:
+		*value = BOOL_VAL(false);
+		return end == start + 1;
+	case OP_CONSTANT_LONG: {
+		if (end != start + 1 + (int)sizeof(int)) return false;
+		uint8_t* operand = &chunk->code[start + 1];
+		int index = operand[0] | (operand[1] << 8) | (operand[2] << 16) | (operand[3] << 24);
+		*value = chunk->constants.values[index];
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+// Drop the constant pushes from 'start' on, and the constants added to
+// the pool since it held 'constants'
+static void discardConstants(int start, int constants) {
+	currentChunk()->count = start;
+	truncateConstants(currentChunk(), constants);
+}
+
+static void emitValue(Value value) {
+	if (IS_NIL(value)) emitByte(OP_NIL);
+	else if (IS_BOOL(value)) emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+	else emitConstant(value);
+}
+
 static void patchJump(int offset) {
 	// -2 to adjust for the bytecode for the jump offset itself.
 	int jump = currentChunk()->count - offset - 2;
@@ -208,6 +262,8 @@ static void patchJump(int offset) {
 
 	currentChunk()->code[offset] = (jump >> 8) & 0xff;
 	currentChunk()->code[offset + 1] = jump & 0xff;
+	// a jump lands here, so a !! that ends here can't be taken back
+	notEnd = -1;
 }
 
 static void initCompiler(Compiler* compiler, FunctionType type) {
@@ -240,6 +296,7 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 static ObjFunction* endCompiler() {
 	emitReturn();
 	ObjFunction* function = current->function;
+	if (!parser.hadError) optimizeChunk(currentChunk());
 
 #ifdef DEBUG_PRINT_CODE
 	if (!parser.hadError) {
@@ -279,11 +336,63 @@ static void declaration();
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
+// Operators on constants are worked out here, the way the VM would.
+// Operands it would reject are left for it to report at run time.
+static bool foldBinary(TokenType operatorType, Value a, Value b, Value* result) {
+	if (operatorType == TOKEN_EQUAL_EQUAL || operatorType == TOKEN_BANG_EQUAL) {
+		// strings are interned, equal ones are the same object
+		bool equal = valuesEqual(a, b);
+		*result = BOOL_VAL(operatorType == TOKEN_EQUAL_EQUAL ? equal : !equal);
+		return true;
+	}
+
+	if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+		ObjString* left = AS_STRING(a);
+		ObjString* right = AS_STRING(b);
+		int length = left->length + right->length;
+		char* chars = ALLOCATE(char, length + 1);
+		memcpy(chars, left->chars, left->length);
+		memcpy(chars + left->length, right->chars, right->length);
+		chars[length] = '\0';
+		*result = OBJ_VAL(takeString(chars, length, true));
+		return true;
+	}
+
+	if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+	double x = AS_NUMBER(a);
+	double y = AS_NUMBER(b);
+
+	switch (operatorType) {
+	case TOKEN_GREATER:       *result = BOOL_VAL(x > y); break;
+	case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); break;
+	case TOKEN_LESS:          *result = BOOL_VAL(x < y); break;
+	case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(!(x > y)); break;
+	case TOKEN_PLUS:          *result = NUMBER_VAL(x + y); break;
+	case TOKEN_MINUS:         *result = NUMBER_VAL(x - y); break;
+	case TOKEN_STAR:          *result = NUMBER_VAL(x * y); break;
+	case TOKEN_SLASH:         *result = NUMBER_VAL(x / y); break;
+	default: return false;
+	}
+	return true;
+}
+
 static void binary(bool canAssign) {
 	TokenType operatorType = parser.previous.type;
 	ParseRule* rule = getRule(operatorType);
+	int leftStart = operandStart;
+	int leftConstants = operandConstants;
+	int rightStart = currentChunk()->count;
 	parsePrecedence((Precedence)(rule->precedence + 1));
 
+	Value a, b, result;
+	if (constantAt(leftStart, rightStart, &a) &&
+		constantAt(rightStart, currentChunk()->count, &b) &&
+		foldBinary(operatorType, a, b, &result)) {
+		discardConstants(leftStart, leftConstants);
+		emitValue(result);
+		return;
+	}
+
 	switch (operatorType) {
 	case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
 	case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
@@ -370,6 +479,20 @@ static void string() {
 		parser.previous.length - 2)));
 }
 
+// A call to a global that holds a native skips the lookup: the native is
+// called by its index in vm.natives, and the VM only goes through the
+// global again once something has written it.
+static bool nativeCall(int name) {
+	int native = nativeIndex(AS_STRING(currentChunk()->constants.values[name]));
+	if (native == -1 || native > UINT8_MAX) return false;
+
+	advance();
+	uint8_t argCount = argumentList();
+	writeInt(currentChunk(), OP_CALL_NATIVE, name, parser.previous.line);
+	emitBytes((uint8_t)native, argCount);
+	return true;
+}
+
 static void namedVariable(Token name, bool canAssign) {
 	uint8_t getOp, setOp;
 	int arg = resolveLocal(current, &name);
@@ -397,6 +520,8 @@ static void namedVariable(Token name, bool canAssign) {
 	else {
 		if(getOp == OP_GET_LOCAL || getOp == OP_GET_UPVALUE)
 			emitBytes(getOp, (uint8_t)arg);
+		else if (check(TOKEN_LEFT_PAREN) && nativeCall(arg))
+			return;
 		else
 			writeInt(currentChunk(), getOp, arg, parser.previous.line);
 	}
@@ -452,11 +577,37 @@ static void unary(bool canAssign) {
 	TokenType operatorType = parser.previous.type;
 
 	// Compile the operand.
+	int start = currentChunk()->count;
+	int constants = currentChunk()->constants.count;
 	parsePrecedence(PREC_UNARY);
 
+	// a constant operand is folded
+	Value value;
+	if (constantAt(start, currentChunk()->count, &value)) {
+		if (operatorType == TOKEN_BANG) {
+			discardConstants(start, constants);
+			emitValue(BOOL_VAL(IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value))));
+			return;
+		}
+		if (operatorType == TOKEN_MINUS && IS_NUMBER(value)) {
+			discardConstants(start, constants);
+			emitConstant(NUMBER_VAL(-AS_NUMBER(value)));
+			return;
+		}
+	}
+
 	// Emit the operator instruction.
 	switch (operatorType) {
-	case TOKEN_BANG: emitByte(OP_NOT); break;
+	case TOKEN_BANG: {
+		bool negatesNot = notChunk == currentChunk() && notStart == start &&
+			notEnd == currentChunk()->count;
+		emitByte(OP_NOT);
+		notChunk = currentChunk();
+		notStart = start;
+		notEnd = currentChunk()->count;
+		notNegatesNot = negatesNot;
+		break;
+	}
 	case TOKEN_MINUS: emitByte(OP_NEGATE); break;
 	default: return; // Unreachable.
 	}
@@ -522,11 +673,15 @@ static void parsePrecedence(Precedence precedence) {
 	}
 
 	bool canAssign = precedence <= PREC_ASSIGNMENT;
+	int start = currentChunk()->count;
+	int constants = currentChunk()->constants.count;
 	prefixRule(canAssign);
 
 	while (precedence <= getRule(parser.current.type)->precedence) {
 		advance();
 		ParseFn infixRule = getRule(parser.previous.type)->infix;
+		operandStart = start;
+		operandConstants = constants;
 		infixRule(canAssign);
 	}
 
@@ -695,6 +850,15 @@ static void expression() {
 	parsePrecedence(PREC_ASSIGNMENT);
 }
 
+// an expression only tested for truth, where !!x is just x
+static void condition() {
+	expression();
+	if (notNegatesNot && notChunk == currentChunk() && notEnd == currentChunk()->count) {
+		currentChunk()->count -= 2;
+		notEnd = -1;
+	}
+}
+
 static void block() {
 	while (!check(TOKEN_END) && !check(TOKEN_EOF)) {
 		declaration();
@@ -836,6 +1000,102 @@ static void expressionStatement() {
 	emitByte(OP_POP);
 }
 
+// a 'for' whose condition and step only count, see countedLoop
+typedef struct {
+	int counter;
+	// a local slot, or -1 for the constant at 'limitConstant'
+	int limit;
+	int limitConstant;
+	int step;
+	uint8_t flags;
+} CountedLoop;
+
+static int operandIndex(int offset) {
+	uint8_t* operand = &currentChunk()->code[offset];
+	return operand[0] | (operand[1] << 8) | (operand[2] << 16) | (operand[3] << 24);
+}
+
+// Whether the condition compiled from 'start' to 'conditionEnd' is
+// 'i < limit', or one of the other comparisons, and the step from
+// 'stepStart' on is 'i = i + step' or 'i = i - step', with the counter a
+// local, the limit a local or constant and the step a number
+static bool countedLoop(int start, int conditionEnd, int stepStart, CountedLoop* loop) {
+	Chunk* chunk = currentChunk();
+	uint8_t* code = chunk->code;
+	int at = start;
+
+	if (conditionEnd - at < 5 || code[at] != OP_GET_LOCAL) return false;
+	loop->counter = code[at + 1];
+	at += 2;
+
+	if (code[at] == OP_GET_LOCAL) {
+		loop->limit = code[at + 1];
+		loop->limitConstant = -1;
+		at += 2;
+	}
+	else if (code[at] == OP_CONSTANT_LONG) {
+		loop->limit = -1;
+		loop->limitConstant = operandIndex(at + 1);
+		at += 1 + sizeof(int);
+	}
+	else {
+		return false;
+	}
+
+	int test = conditionEnd - at;
+	if (test == 1 && code[at] == OP_LESS) loop->flags = FOR_LESS;
+	else if (test == 1 && code[at] == OP_GREATER) loop->flags = FOR_GREATER;
+	else if (test == 2 && code[at] == OP_GREATER && code[at + 1] == OP_NOT) loop->flags = FOR_LESS_EQUAL;
+	else if (test == 2 && code[at] == OP_LESS && code[at + 1] == OP_NOT) loop->flags = FOR_GREATER_EQUAL;
+	else return false;
+
+	// get, constant, add, set and the statement's pop
+	at = stepStart;
+	if (chunk->count - at != 2 + 1 + (int)sizeof(int) + 1 + 2 + 1) return false;
+	if (code[at] != OP_GET_LOCAL || code[at + 1] != loop->counter || code[at + 2] != OP_CONSTANT_LONG) return false;
+	loop->step = operandIndex(at + 3);
+	if (!IS_NUMBER(chunk->constants.values[loop->step])) return false;
+
+	at += 3 + sizeof(int);
+	if (code[at] == OP_SUBTRACT) loop->flags |= FOR_SUBTRACT;
+	else if (code[at] != OP_ADD) return false;
+	return code[at + 1] == OP_SET_LOCAL && code[at + 2] == loop->counter && code[at + 3] == OP_POP;
+}
+
+// Compile the body of a counted loop whose condition and step began at
+// 'loopStart', replacing them with OP_FOR_PREP before the body and
+// OP_FOR_LOOP after it, which step and test the counter in place.
+static void countedForBody(int loopStart, CountedLoop* loop) {
+	currentChunk()->count = loopStart;
+
+	int limit = loop->limit;
+	if (limit == -1) {
+		// a constant limit is pushed once, into a local of its own
+		writeInt(currentChunk(), OP_CONSTANT_LONG, loop->limitConstant, parser.previous.line);
+		addLocal(syntheticToken(""));
+		markInitialized();
+		limit = current->localCount - 1;
+	}
+
+	emitBytes(OP_FOR_PREP, (uint8_t)loop->counter);
+	emitBytes((uint8_t)limit, loop->flags);
+	emitBytes(0xff, 0xff);
+	int exitJump = currentChunk()->count - 2;
+	int bodyStart = currentChunk()->count;
+
+	statement();
+
+	emitBytes(OP_FOR_LOOP, (uint8_t)loop->counter);
+	emitBytes((uint8_t)limit, loop->flags);
+	for (int i = 0; i < (int)sizeof(int); i++) emitByte((loop->step >> (8 * i)) & 0xff);
+
+	int offset = currentChunk()->count - bodyStart + 2;
+	if (offset > UINT16_MAX) error("Loop body too large.");
+	emitBytes((offset >> 8) & 0xff, offset & 0xff);
+
+	patchJump(exitJump);
+}
+
 static void forStatement() {
 	/*
 	* for let i = 0 while i < 100 step i = i + 1 do
@@ -856,7 +1116,8 @@ static void forStatement() {
 	// While
 	int exitJump = -1;
 	consume(TOKEN_WHILE, "Expect 'while' after definition.");
-	expression();
+	condition();
+	int conditionEnd = currentChunk()->count;
 	// Jump out of the loop if the condition is false.
 	exitJump = emitJump(OP_JUMP_IF_FALSE);
 	emitByte(OP_POP); // Condition.
@@ -870,6 +1131,13 @@ static void forStatement() {
 	expression();
 	emitByte(OP_POP);
 
+	CountedLoop counted;
+	if (!parser.hadError && countedLoop(loopStart, conditionEnd, incrementStart, &counted)) {
+		countedForBody(loopStart, &counted);
+		endScope();
+		return;
+	}
+
 	emitLoop(loopStart);
 	loopStart = incrementStart;
 	patchJump(bodyJump);
@@ -886,7 +1154,7 @@ static void forStatement() {
 }
 
 static void ifStatement() { // if condition statement
-	expression();
+	condition();
 
 	int thenJump = emitJump(OP_JUMP_IF_FALSE);
 	emitByte(OP_POP);
@@ -932,7 +1200,7 @@ static void returnStatement() {
 
 static void whileStatement() {
 	int loopStart = currentChunk()->count;
-	expression();
+	condition();
 
 	int exitJump = emitJump(OP_JUMP_IF_FALSE);
 	emitByte(OP_POP);
@@ -1030,9 +1298,12 @@ ObjFunction* compile(const char* source, char* ExePath, char* Dir, bool isPackag
 	ObjString* exePath = copyString(ExePath, strlen(ExePath));
 	ObjString* dirPath = copyString(Dir, strlen(Dir));
 
-	int is_package = makeConstant(BOOL_VAL(isPackage));
-	int exe_index = makeConstant(OBJ_VAL(exePath));
-	int dir_index = makeConstant(OBJ_VAL(dirPath));
+	// slots 0 to 2, read by OP_IMPORT and OP_INCLUDE. A .rosec file is
+	// loaded with its own, so no literal may share them.
+	appendConstant(currentChunk(), BOOL_VAL(isPackage));
+	appendConstant(currentChunk(), OBJ_VAL(exePath));
+	appendConstant(currentChunk(), OBJ_VAL(dirPath));
+	currentChunk()->sharedFrom = 3;
 
 	advance();
 	while (!match(TOKEN_EOF)) {
@@ -41,6 +41,26 @@ static int jumpInstruction(const char* name, int sign,
     return offset + 3;
 }
 
+static int forInstruction(const char* name, int sign,
+    Chunk* chunk, int offset) {
+    int length = instructionLength(chunk, offset);
+    uint8_t* operand = &chunk->code[offset + 1];
+    uint16_t jump = (uint16_t)(chunk->code[offset + length - 2] << 8);
+    jump |= chunk->code[offset + length - 1];
+    printf("%-16s %4d %4d %4d -> %d\n", name, operand[0], operand[1],
+        operand[2], offset + length + sign * jump);
+    return length;
+}
+
+static int nativeInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t* operand = &chunk->code[offset + 1];
+    int constant = operand[0] | (operand[1] << 8) | (operand[2] << 16) | (operand[3] << 24);
+    printf("%-16s %4d (%d args) '", name, operand[sizeof(int)], operand[sizeof(int) + 1]);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return 3 + sizeof(int);
+}
+
 static int constantInstruction(const char* name, Chunk* chunk, int offset) {
   uint8_t constant = chunk->code[offset + 1];
   printf("%-16s %4d '", name, constant);
@@ -120,6 +140,8 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         return jumpInstruction("OP_JUMP", 1, chunk, offset);
     case OP_JUMP_IF_FALSE:
         return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_POP_JUMP_IF_FALSE:
+        return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
     case OP_RETURN:
       return simpleInstruction("OP_RETURN", offset);
     case OP_IMPORT:
@@ -128,8 +150,14 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         return simpleInstruction("OP_INCLUDE", offset);
     case OP_LOOP:
         return jumpInstruction("OP_LOOP", -1, chunk, offset);
+    case OP_FOR_PREP:
+        return forInstruction("OP_FOR_PREP", 1, chunk, offset);
+    case OP_FOR_LOOP:
+        return forInstruction("OP_FOR_LOOP", -1, chunk, offset);
     case OP_CALL:
         return byteInstruction("OP_CALL", chunk, offset);
+    case OP_CALL_NATIVE:
+        return nativeInstruction("OP_CALL_NATIVE", chunk, offset);
     case OP_CLOSURE: {
         return constantInstruction("OP_CLOSURE", chunk, offset);
     }
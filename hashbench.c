@@ -0,0 +1,276 @@
+#include "hashbench.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+// each measurement repeats until it has run this long
+#define BENCH_MICROS 200000.0
+#define BENCH_NAME_MAX 32
+#define BENCH_LARGE_KEYS 4096
+#define BENCH_LARGE_KEY_LENGTH 1024
+
+typedef struct {
+	const char* chars;
+	int length;
+} Name;
+
+typedef struct {
+	Name* names;
+	int count;
+	int capacity;
+	// built-in names are written here, a file's point into its text
+	char* text;
+} Corpus;
+
+// keeps the compiler from dropping hashes nobody reads
+static volatile uint32_t sink;
+
+static double benchClock() {
+#ifdef _WIN32
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (double)counter.QuadPart * 1000000.0 / (double)frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec * 1000000.0 + (double)now.tv_nsec / 1000.0;
+#endif
+}
+
+static void addName(Corpus* corpus, const char* chars, int length) {
+	if (corpus->capacity < corpus->count + 1) {
+		corpus->capacity = corpus->capacity < 8 ? 8 : corpus->capacity * 2;
+		corpus->names = (Name*)realloc(corpus->names, sizeof(Name) * corpus->capacity);
+		if (corpus->names == NULL) exit(1);
+	}
+	corpus->names[corpus->count].chars = chars;
+	corpus->names[corpus->count].length = length;
+	corpus->count++;
+}
+
+static bool isAlpha(char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static bool isDigit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+// every identifier in the file, repeats included, as a script has them
+static bool readCorpus(Corpus* corpus, const char* path) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "Could not open file \"%s\".\n", path);
+		return false;
+	}
+
+	fseek(file, 0L, SEEK_END);
+	size_t size = ftell(file);
+	rewind(file);
+	corpus->text = (char*)malloc(size + 1);
+	if (corpus->text == NULL) exit(1);
+	size_t length = fread(corpus->text, 1, size, file);
+	fclose(file);
+	corpus->text[length] = '\0';
+
+	for (const char* c = corpus->text; *c != '\0';) {
+		if (!isAlpha(*c)) {
+			// a number's digits are not the start of a name
+			if (isDigit(*c)) while (isDigit(*c) || isAlpha(*c)) c++;
+			else c++;
+			continue;
+		}
+		const char* start = c;
+		while (isAlpha(*c) || isDigit(*c)) c++;
+		addName(corpus, start, (int)(c - start));
+	}
+
+	if (corpus->count == 0) {
+		fprintf(stderr, "No identifiers in \"%s\".\n", path);
+		return false;
+	}
+	return true;
+}
+
+// camel case names from common parts, loop variables and numbered temporaries
+static void builtinCorpus(Corpus* corpus) {
+	static const char* prefixes[] = {
+		"", "get", "set", "is", "has", "make", "update", "draw",
+		"load", "save", "on", "to", "find", "max", "min", "num"
+	};
+	static const char* nouns[] = {
+		"player", "enemy", "count", "index", "name", "value", "buffer", "position",
+		"speed", "item", "list", "node", "score", "level", "width", "height",
+		"color", "frame", "timer", "state", "input", "file", "path", "result"
+	};
+	static const char* suffixes[] = { "", "s", "2", "_old", "_new", "Id", "At", "Count" };
+	static const char* shortNames[] = { "i", "j", "k", "n", "x", "y", "z", "a", "b", "t", "dx", "dy" };
+	int prefixCount = sizeof(prefixes) / sizeof(prefixes[0]);
+	int nounCount = sizeof(nouns) / sizeof(nouns[0]);
+	int suffixCount = sizeof(suffixes) / sizeof(suffixes[0]);
+	int shortCount = sizeof(shortNames) / sizeof(shortNames[0]);
+	int temporaries = 1000;
+
+	int total = prefixCount * nounCount * suffixCount + shortCount + temporaries;
+	corpus->text = (char*)malloc((size_t)total * BENCH_NAME_MAX);
+	if (corpus->text == NULL) exit(1);
+	char* next = corpus->text;
+
+	for (int p = 0; p < prefixCount; p++) {
+		for (int n = 0; n < nounCount; n++) {
+			for (int s = 0; s < suffixCount; s++) {
+				int length = snprintf(next, BENCH_NAME_MAX, "%s%s%s", prefixes[p], nouns[n], suffixes[s]);
+				if (prefixes[p][0] != '\0') next[strlen(prefixes[p])] -= 'a' - 'A';
+				addName(corpus, next, length);
+				next += length + 1;
+			}
+		}
+	}
+	for (int i = 0; i < shortCount; i++) {
+		addName(corpus, shortNames[i], (int)strlen(shortNames[i]));
+	}
+	for (int i = 0; i < temporaries; i++) {
+		int length = snprintf(next, BENCH_NAME_MAX, "tmp%d", i);
+		addName(corpus, next, length);
+		next += length + 1;
+	}
+}
+
+static void freeCorpus(Corpus* corpus) {
+	free(corpus->names);
+	free(corpus->text);
+}
+
+// microseconds for one pass of hashString over every name
+static double timeNames(Corpus* corpus) {
+	long rounds = 0;
+	double start = benchClock();
+	double elapsed;
+	do {
+		uint32_t hash = 0;
+		for (int i = 0; i < corpus->count; i++) {
+			hash ^= hashString(corpus->names[i].chars, corpus->names[i].length);
+		}
+		sink = hash;
+		rounds++;
+	} while ((elapsed = benchClock() - start) < BENCH_MICROS);
+	return elapsed / rounds;
+}
+
+// microseconds for one pass of interned lookups, hashing included, the
+// way the compiler and copyString find every name they meet
+static double timeLookups(Corpus* corpus) {
+	long rounds = 0;
+	double start = benchClock();
+	double elapsed;
+	do {
+		for (int i = 0; i < corpus->count; i++) {
+			Name* name = &corpus->names[i];
+			ObjString* found = tableFindString(&vm.strings, name->chars, name->length,
+				hashString(name->chars, name->length));
+			sink = found->hash;
+		}
+		rounds++;
+	} while ((elapsed = benchClock() - start) < BENCH_MICROS);
+	return elapsed / rounds;
+}
+
+static void benchNames(Corpus* corpus) {
+	long long bytes = 0;
+	for (int i = 0; i < corpus->count; i++) bytes += corpus->names[i].length;
+
+	// the names as a script's globals would hold them
+	Table table;
+	initTable(&table);
+	for (int i = 0; i < corpus->count; i++) {
+		ObjString* name = copyString(corpus->names[i].chars, corpus->names[i].length);
+		tableSet(&table, name, NIL_VAL);
+	}
+
+	double hashMicros = timeNames(corpus);
+	double lookupMicros = timeLookups(corpus);
+	printf("identifiers: %d names, %.1f bytes on average\n",
+		corpus->count, (double)bytes / corpus->count);
+	printf("   hash    %8.2f ns per name, %8.1f MB/s\n",
+		hashMicros * 1000.0 / corpus->count, (double)bytes / hashMicros);
+	printf("   intern  %8.2f ns per lookup\n", lookupMicros * 1000.0 / corpus->count);
+	tableStats(&table, "identifiers");
+	freeTable(&table);
+}
+
+static void benchLargeSizes(const char* bytes) {
+	static const int sizes[] = { 16, 64, 256, 1024, 64 * 1024, 1024 * 1024 };
+
+	printf("\nlarge strings:\n");
+	printf("   %10s %12s %10s\n", "bytes", "ns/hash", "MB/s");
+	for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+		// about a megabyte between looks at the clock, which costs more
+		// than hashing a short string
+		int batch = (1024 * 1024) / sizes[i];
+		long rounds = 0;
+		double start = benchClock();
+		double elapsed;
+		do {
+			for (int j = 0; j < batch; j++) sink = hashString(bytes, sizes[i]);
+			rounds += batch;
+		} while ((elapsed = benchClock() - start) < BENCH_MICROS);
+		printf("   %10d %12.1f %10.1f\n", sizes[i], elapsed * 1000.0 / rounds,
+			(double)sizes[i] * rounds / elapsed);
+	}
+}
+
+// Long keys that share all but 4 bytes, in the middle where neither end
+// of the hash sees them, show whether every byte reaches the probe bits.
+static void benchLargeKeys(char* bytes) {
+	Table table;
+	initTable(&table);
+	for (int i = 0; i < BENCH_LARGE_KEYS; i++) {
+		memcpy(bytes + BENCH_LARGE_KEY_LENGTH / 2, &i, sizeof(i));
+		ObjString* key = copyString(bytes, BENCH_LARGE_KEY_LENGTH);
+		tableSet(&table, key, NIL_VAL);
+	}
+
+	printf("\n%d keys of %d bytes differing in %d\n", BENCH_LARGE_KEYS,
+		BENCH_LARGE_KEY_LENGTH, (int)sizeof(int));
+	tableStats(&table, "large strings");
+	freeTable(&table);
+}
+
+bool runHashBenchmark(const char* path) {
+	Corpus corpus = { NULL, 0, 0, NULL };
+	if (path == NULL) builtinCorpus(&corpus);
+	else if (!readCorpus(&corpus, path)) {
+		freeCorpus(&corpus);
+		return false;
+	}
+	benchNames(&corpus);
+	freeCorpus(&corpus);
+
+	// text-like bytes from a fixed xorshift, the same every run
+	int size = 1024 * 1024;
+	char* bytes = (char*)malloc(size);
+	if (bytes == NULL) exit(1);
+	uint32_t state = 2463534242u;
+	for (int i = 0; i < size; i++) {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		bytes[i] = (char)(' ' + state % 95);
+	}
+
+	benchLargeSizes(bytes);
+	benchLargeKeys(bytes);
+	free(bytes);
+	return true;
+}
@@ -0,0 +1,10 @@
+#ifndef ROSE_HASHBENCH_H
+#define ROSE_HASHBENCH_H
+#include "common.h"
+
+// --hash-bench: hash throughput and table probe lengths over identifiers,
+// the ones in the file at 'path' or a built-in list when it is NULL, and
+// over large strings
+bool runHashBenchmark(const char* path);
+
+#endif
@@ -0,0 +1,537 @@
+#include <stdint.h>
+#include <string.h>
+#include "inline.h"
+#include "chunk.h"
+#include "memory.h"
+#include "vm.h"
+
+// An inlined call keeps the OP_GET_GLOBAL that pushed the function, so
+// a call made before the definition still fails the same way, and runs
+// the body in place with its locals moved up to where the function and
+// arguments already sit. The result is then stored over the function
+// and the rest of the callee's frame popped.
+
+typedef struct {
+    ObjString* name;
+    ObjFunction* function;
+    int defines;
+    bool assigned;
+    bool inlinable;
+    // bytes before its OP_RETURN, the stack depth there and the deepest
+    // the stack gets
+    int length;
+    int returnDepth;
+    int maxDepth;
+} Callee;
+
+// a chunk decoded one entry per instruction
+typedef struct {
+    Chunk* chunk;
+    int count;
+    // 'count' offsets and the end of the code
+    int* offsets;
+    // the instruction a jump lands on, -1 for the rest
+    int* targets;
+    // the stack before each instruction, -1 when nothing reaches it
+    int* depths;
+    int maxDepth;
+} Code;
+
+typedef struct {
+    ObjFunction** functions;
+    int functionCount;
+    int functionCapacity;
+    Callee* callees;
+    int calleeCount;
+    int calleeCapacity;
+} Unit;
+
+static int readIndex(uint8_t* operand) {
+    return operand[0] | (operand[1] << 8) | (operand[2] << 16) | (operand[3] << 24);
+}
+
+static void writeIndex(uint8_t* operand, int index) {
+    operand[0] = index & 0xff;
+    operand[1] = (index >> 8) & 0xff;
+    operand[2] = (index >> 16) & 0xff;
+    operand[3] = (index >> 24) & 0xff;
+}
+
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_POP_JUMP_IF_FALSE || op == OP_LOOP ||
+        op == OP_FOR_PREP || op == OP_FOR_LOOP;
+}
+
+static bool jumpsBack(uint8_t op) {
+    return op == OP_LOOP || op == OP_FOR_LOOP;
+}
+
+// the script and every function declared in it, however deep
+static void addFunction(Unit* unit, ObjFunction* function) {
+    if (unit->functionCapacity < unit->functionCount + 1) {
+        int oldCapacity = unit->functionCapacity;
+        unit->functionCapacity = GROW_CAPACITY(oldCapacity);
+        unit->functions = GROW_ARRAY(ObjFunction*, unit->functions, oldCapacity, unit->functionCapacity);
+    }
+    unit->functions[unit->functionCount++] = function;
+
+    ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i])) addFunction(unit, AS_FUNCTION(constants->values[i]));
+    }
+}
+
+static Callee* findCallee(Unit* unit, ObjString* name, bool add) {
+    for (int i = 0; i < unit->calleeCount; i++) {
+        if (unit->callees[i].name == name) return &unit->callees[i];
+    }
+    if (!add) return NULL;
+
+    if (unit->calleeCapacity < unit->calleeCount + 1) {
+        int oldCapacity = unit->calleeCapacity;
+        unit->calleeCapacity = GROW_CAPACITY(oldCapacity);
+        unit->callees = GROW_ARRAY(Callee, unit->callees, oldCapacity, unit->calleeCapacity);
+    }
+    Callee* callee = &unit->callees[unit->calleeCount++];
+    memset(callee, 0, sizeof(Callee));
+    callee->name = name;
+    return callee;
+}
+
+// Count how often each global is defined and whether it is assigned.
+// False when the script loads code, which could assign any of them.
+static bool scanGlobals(Unit* unit) {
+    for (int f = 0; f < unit->functionCount; f++) {
+        Chunk* chunk = &unit->functions[f]->chunk;
+        int previous = -1;
+
+        for (int offset = 0; offset < chunk->count; previous = offset, offset += instructionLength(chunk, offset)) {
+            uint8_t* at = &chunk->code[offset];
+            switch (at[0]) {
+            case OP_IMPORT:
+            case OP_INCLUDE:
+                return false;
+            case OP_DEFINE_GLOBAL: {
+                Callee* callee = findCallee(unit, AS_STRING(chunk->constants.values[readIndex(at + 1)]), true);
+                if (callee->defines++ == 0 && previous != -1 && chunk->code[previous] == OP_CLOSURE) {
+                    callee->function = AS_FUNCTION(chunk->constants.values[readIndex(&chunk->code[previous + 1])]);
+                }
+                break;
+            }
+            case OP_SET_GLOBAL:
+                findCallee(unit, AS_STRING(chunk->constants.values[readIndex(at + 1)]), true)->assigned = true;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+// values the instruction at 'index' pops and pushes
+static bool stackEffect(Code* code, int index, int* pops, int* pushes) {
+    Chunk* chunk = code->chunk;
+    uint8_t* at = &chunk->code[code->offsets[index]];
+    *pops = 0;
+    *pushes = 0;
+
+    switch (at[0]) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_CONSTANT_LONG:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_CLOSURE:
+    case OP_CLASS:
+        *pushes = 1;
+        return true;
+    case OP_SET_LOCAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_JUMP_IF_FALSE:
+    case OP_FOR_PREP:
+    case OP_FOR_LOOP:
+        return true;
+    case OP_POP:
+    case OP_PRINT:
+    case OP_DEFINE_GLOBAL:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_RETURN:
+    case OP_CLOSE_UPVALUE:
+    case OP_METHOD:
+    case OP_INHERIT:
+    case OP_IMPORT:
+    case OP_INCLUDE:
+        *pops = 1;
+        return true;
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_GET_PROPERTY:
+        *pops = 1;
+        *pushes = 1;
+        return true;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+        *pops = 2;
+        *pushes = 1;
+        return true;
+    case OP_CALL:
+        *pops = at[1] + 1;
+        *pushes = 1;
+        return true;
+    case OP_CALL_NATIVE:
+        *pops = at[2 + sizeof(int)];
+        *pushes = 1;
+        return true;
+    case OP_INVOKE:
+        *pops = at[1 + sizeof(int)] + 1;
+        *pushes = 1;
+        return true;
+    case OP_SUPER_INVOKE:
+        *pops = at[1 + sizeof(int)] + 2;
+        *pushes = 1;
+        return true;
+    case OP_ARRAY: {
+        // the element count is the constant pushed right before it
+        if (index == 0 || chunk->code[code->offsets[index - 1]] != OP_CONSTANT_LONG) return false;
+        Value count = chunk->constants.values[readIndex(&chunk->code[code->offsets[index - 1] + 1])];
+        if (!IS_NUMBER(count) || AS_NUMBER(count) < 0 || AS_NUMBER(count) > UINT8_COUNT) return false;
+        *pops = (int)AS_NUMBER(count) + 1;
+        *pushes = 1;
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+// the stack depth before every instruction, the same on every path
+static bool measureDepths(Code* code, int entryDepth) {
+    int* work = ALLOCATE(int, code->count);
+    int top = 0;
+    bool valid = true;
+
+    code->depths[0] = entryDepth;
+    code->maxDepth = entryDepth;
+    work[top++] = 0;
+
+    while (top > 0 && valid) {
+        int index = work[--top];
+        uint8_t op = code->chunk->code[code->offsets[index]];
+        int pops, pushes;
+        if (!stackEffect(code, index, &pops, &pushes) || pops > code->depths[index]) {
+            valid = false;
+            break;
+        }
+
+        int depth = code->depths[index] - pops + pushes;
+        if (depth > code->maxDepth) code->maxDepth = depth;
+
+        int next[2];
+        int nextCount = 0;
+        if (code->targets[index] != -1) next[nextCount++] = code->targets[index];
+        if (op != OP_JUMP && op != OP_LOOP && op != OP_RETURN) next[nextCount++] = index + 1;
+
+        for (int n = 0; n < nextCount; n++) {
+            int successor = next[n];
+            if (successor == code->count) {
+                valid = false;
+            }
+            else if (code->depths[successor] == -1) {
+                code->depths[successor] = depth;
+                work[top++] = successor;
+            }
+            else if (code->depths[successor] != depth) {
+                valid = false;
+            }
+        }
+    }
+    FREE_ARRAY(int, work, code->count);
+    return valid;
+}
+
+static bool decode(Code* code, Chunk* chunk, int entryDepth) {
+    code->chunk = chunk;
+    code->count = 0;
+    code->offsets = NULL;
+    code->targets = NULL;
+    code->depths = NULL;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) code->count++;
+    if (code->count == 0) return false;
+
+    code->offsets = ALLOCATE(int, code->count + 1);
+    code->targets = ALLOCATE(int, code->count);
+    code->depths = ALLOCATE(int, code->count);
+
+    int* entryAt = ALLOCATE(int, chunk->count + 1);
+    for (int offset = 0, i = 0; offset < chunk->count; i++) {
+        int length = instructionLength(chunk, offset);
+        for (int byte = 0; byte < length; byte++) entryAt[offset + byte] = -1;
+        entryAt[offset] = i;
+        code->offsets[i] = offset;
+        offset += length;
+    }
+    code->offsets[code->count] = chunk->count;
+
+    bool valid = true;
+    for (int i = 0; i < code->count; i++) {
+        uint8_t op = chunk->code[code->offsets[i]];
+        code->targets[i] = -1;
+        code->depths[i] = -1;
+        if (!isJump(op)) continue;
+
+        // the distance is the last two bytes, from the next instruction
+        uint8_t* end = &chunk->code[code->offsets[i + 1]];
+        int distance = (end[-2] << 8) | end[-1];
+        int destination = code->offsets[i + 1] + (jumpsBack(op) ? -distance : distance);
+        if (destination < 0 || destination >= chunk->count || entryAt[destination] == -1) valid = false;
+        else code->targets[i] = entryAt[destination];
+    }
+    FREE_ARRAY(int, entryAt, chunk->count + 1);
+
+    return valid && measureDepths(code, entryDepth);
+}
+
+static void freeCode(Code* code) {
+    if (code->offsets != NULL) FREE_ARRAY(int, code->offsets, code->count + 1);
+    if (code->targets != NULL) FREE_ARRAY(int, code->targets, code->count);
+    if (code->depths != NULL) FREE_ARRAY(int, code->depths, code->count);
+}
+
+// whether the body of 'callee' can stand in for its calls
+static void measureCallee(Callee* callee) {
+    Value native;
+    if (callee->function == NULL || callee->defines != 1 || callee->assigned ||
+        callee->function->upvalueCount != 0 || tableGet(&vm.globals, callee->name, &native)) return;
+
+    Chunk* chunk = &callee->function->chunk;
+    Code code;
+    if (!decode(&code, chunk, callee->function->arity + 1)) {
+        freeCode(&code);
+        return;
+    }
+
+    // one return, at the end
+    int last = code.count - 1;
+    bool inlinable = code.offsets[last] <= INLINE_BUDGET && chunk->code[code.offsets[last]] == OP_RETURN &&
+        code.depths[last] != -1;
+
+    for (int i = 0; i < last && inlinable; i++) {
+        uint8_t* at = &chunk->code[code.offsets[i]];
+        if (code.depths[i] == -1) inlinable = false;
+
+        switch (at[0]) {
+        case OP_RETURN:
+        case OP_CLOSURE:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CLOSE_UPVALUE:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_INHERIT:
+        case OP_GET_SUPER:
+        case OP_SUPER_INVOKE:
+        case OP_DEFINE_GLOBAL:
+        case OP_IMPORT:
+        case OP_INCLUDE:
+            inlinable = false;
+            break;
+        case OP_GET_GLOBAL:
+        case OP_CALL_NATIVE:
+            // recursive
+            if (AS_STRING(chunk->constants.values[readIndex(at + 1)]) == callee->name) inlinable = false;
+            break;
+        default:
+            break;
+        }
+    }
+
+    callee->inlinable = inlinable;
+    callee->length = code.offsets[last];
+    callee->returnDepth = code.depths[last];
+    callee->maxDepth = code.maxDepth;
+    freeCode(&code);
+}
+
+static int slotOf(Code* code, int call) {
+    return code->depths[call] - code->chunk->code[code->offsets[call] + 1] - 1;
+}
+
+// the callee whose body can replace the OP_CALL at 'call', or NULL
+static Callee* inlinedCallee(Unit* unit, Code* code, int call) {
+    Chunk* chunk = code->chunk;
+    if (code->depths[call] == -1) return NULL;
+
+    int argCount = chunk->code[code->offsets[call] + 1];
+    int slot = slotOf(code, call);
+
+    // the instruction that pushed the function, with nothing between it
+    // and the call touching its slot
+    int push = call - 1;
+    for (; push >= 0 && code->depths[push] > slot; push--) {
+        int pops, pushes;
+        stackEffect(code, push, &pops, &pushes);
+        if (code->depths[push] - pops <= slot) return NULL;
+    }
+    if (push < 0 || code->depths[push] != slot) return NULL;
+
+    uint8_t* at = &chunk->code[code->offsets[push]];
+    if (at[0] != OP_GET_GLOBAL) return NULL;
+
+    Callee* callee = findCallee(unit, AS_STRING(chunk->constants.values[readIndex(at + 1)]), false);
+    if (callee == NULL || !callee->inlinable || callee->function->arity != argCount ||
+        slot + callee->maxDepth > UINT8_COUNT) return NULL;
+
+    // control only enters between the two at the push and leaves at the call
+    for (int i = 0; i < code->count; i++) {
+        int target = code->targets[i];
+        if (target == -1) continue;
+        bool from = i > push && i < call;
+        bool to = target > push && target <= call;
+        if (from != to) return NULL;
+    }
+    return callee;
+}
+
+static int expandedLength(Callee* callee) {
+    // OP_SET_LOCAL for the result, then a pop for the rest of the frame
+    return callee->length + 2 + callee->returnDepth - 1;
+}
+
+static void emitBody(Chunk* caller, Callee* callee, int slot, uint8_t* to) {
+    Chunk* body = &callee->function->chunk;
+    memcpy(to, body->code, callee->length);
+
+    for (int offset = 0; offset < callee->length; offset += instructionLength(body, offset)) {
+        uint8_t* at = &to[offset];
+        switch (at[0]) {
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+            at[1] += slot;
+            break;
+        case OP_FOR_PREP:
+            at[1] += slot;
+            at[2] += slot;
+            break;
+        case OP_FOR_LOOP:
+            at[1] += slot;
+            at[2] += slot;
+            writeIndex(at + 4, addConstant(caller, body->constants.values[readIndex(at + 4)]));
+            break;
+        case OP_CONSTANT_LONG:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_INVOKE:
+        case OP_CALL_NATIVE:
+            writeIndex(at + 1, addConstant(caller, body->constants.values[readIndex(at + 1)]));
+            break;
+        default:
+            break;
+        }
+    }
+
+    to += callee->length;
+    to[0] = OP_SET_LOCAL;
+    to[1] = slot;
+    memset(to + 2, OP_POP, callee->returnDepth - 1);
+}
+
+// the code of 'function' with its calls inlined, NULL when none were
+static uint8_t* rewrite(Unit* unit, ObjFunction* function, int* size) {
+    Chunk* chunk = &function->chunk;
+    Code code;
+    if (!decode(&code, chunk, function->arity + 1)) {
+        freeCode(&code);
+        return NULL;
+    }
+
+    Callee** inlined = ALLOCATE(Callee*, code.count);
+    int* offsets = ALLOCATE(int, code.count + 1);
+    int calls = 0;
+    *size = 0;
+    for (int i = 0; i < code.count; i++) {
+        inlined[i] = NULL;
+        if (chunk->code[code.offsets[i]] == OP_CALL) inlined[i] = inlinedCallee(unit, &code, i);
+        if (inlined[i] != NULL) calls++;
+
+        offsets[i] = *size;
+        *size += inlined[i] != NULL ? expandedLength(inlined[i]) : code.offsets[i + 1] - code.offsets[i];
+    }
+    offsets[code.count] = *size;
+
+    uint8_t* result = NULL;
+    if (calls > 0) {
+        result = ALLOCATE(uint8_t, *size);
+        bool fits = true;
+        for (int i = 0; i < code.count && fits; i++) {
+            uint8_t* to = &result[offsets[i]];
+            if (inlined[i] != NULL) {
+                emitBody(chunk, inlined[i], slotOf(&code, i), to);
+                continue;
+            }
+
+            int length = code.offsets[i + 1] - code.offsets[i];
+            memcpy(to, &chunk->code[code.offsets[i]], length);
+            if (code.targets[i] != -1) {
+                int distance = offsets[code.targets[i]] - offsets[i + 1];
+                if (jumpsBack(to[0])) distance = -distance;
+                fits = distance <= UINT16_MAX;
+                to[length - 2] = (distance >> 8) & 0xff;
+                to[length - 1] = distance & 0xff;
+            }
+        }
+
+        if (!fits) {
+            FREE_ARRAY(uint8_t, result, *size);
+            result = NULL;
+        }
+    }
+
+    FREE_ARRAY(Callee*, inlined, code.count);
+    FREE_ARRAY(int, offsets, code.count + 1);
+    freeCode(&code);
+    return result;
+}
+
+void inlineCalls(ObjFunction* script) {
+    Unit unit = { NULL, 0, 0, NULL, 0, 0 };
+    addFunction(&unit, script);
+
+    if (scanGlobals(&unit)) {
+        for (int i = 0; i < unit.calleeCount; i++) measureCallee(&unit.callees[i]);
+
+        // every body is copied from the code as it was, so nothing is
+        // replaced until all of it is written
+        uint8_t** code = ALLOCATE(uint8_t*, unit.functionCount);
+        int* sizes = ALLOCATE(int, unit.functionCount);
+        for (int f = 0; f < unit.functionCount; f++) code[f] = rewrite(&unit, unit.functions[f], &sizes[f]);
+
+        for (int f = 0; f < unit.functionCount; f++) {
+            if (code[f] == NULL) continue;
+            Chunk* chunk = &unit.functions[f]->chunk;
+            FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+            chunk->code = code[f];
+            chunk->count = sizes[f];
+            chunk->capacity = sizes[f];
+        }
+        FREE_ARRAY(uint8_t*, code, unit.functionCount);
+        FREE_ARRAY(int, sizes, unit.functionCount);
+    }
+
+    FREE_ARRAY(ObjFunction*, unit.functions, unit.functionCapacity);
+    FREE_ARRAY(Callee, unit.callees, unit.calleeCapacity);
+}
@@ -0,0 +1,15 @@
+#ifndef ROSE_INLINE_H
+#define ROSE_INLINE_H
+#include "object.h"
+
+// bytes of code a function body may have to be inlined, its return left out
+#define INLINE_BUDGET 32
+
+// Replace calls to small global functions in 'script' and the functions
+// it declares with their bodies. Only functions without upvalues, nested
+// functions or recursion are taken, named by a global the script defines
+// once and never assigns. Scripts that import or include are left alone,
+// since the code they load could assign it.
+void inlineCalls(ObjFunction* script);
+
+#endif
@@ -0,0 +1,92 @@
+#include "gc.h"
+#include <stdint.h>
+#include <string.h>
+#include "../../value.h"
+#include "../../vm.h"
+#include "../../object.h"
+#include "../../memory.h"
+#include "../../snapshot.h"
+
+// spend up to the given microseconds on collection, for idle time in a
+// frame loop, true once a whole cycle has finished
+static Value Step(int argCount, Value* args) {
+    if (argCount != 1 || !IS_NUMBER(args[0])) return NIL_VAL;
+    return BOOL_VAL(gcStep(AS_NUMBER(args[0])));
+}
+
+// a whole cycle now, marked and swept, returns the heap size left
+static Value Collect(int argCount, Value* args) {
+    if (argCount != 0) return NIL_VAL;
+    collectGarbage(true);
+    return NUMBER_VAL((double)vm.bytesAllocated);
+}
+
+// gc_stats() prints the --gc-stats report, gc_stats("name") returns one
+// counter: minor, cycles, minor_pause, major_pause, max_pause (in
+// microseconds), allocated, freed, heap, large or threshold (in bytes)
+static Value Stats(int argCount, Value* args) {
+    if (argCount == 0) {
+        printGCStats();
+        return NIL_VAL;
+    }
+    if (argCount != 1 || !IS_STRING(args[0])) return NIL_VAL;
+
+    const char* name = AS_CSTRING(args[0]);
+    double longest = vm.minorPauses.longest > vm.majorPauses.longest ?
+        vm.minorPauses.longest : vm.majorPauses.longest;
+
+    if (strcmp(name, "minor") == 0) return NUMBER_VAL(vm.minorPauses.count);
+    if (strcmp(name, "cycles") == 0) return NUMBER_VAL(vm.gcCycles);
+    if (strcmp(name, "minor_pause") == 0) return NUMBER_VAL(vm.minorPauses.total);
+    if (strcmp(name, "major_pause") == 0) return NUMBER_VAL(vm.majorPauses.total);
+    if (strcmp(name, "max_pause") == 0) return NUMBER_VAL(longest);
+    if (strcmp(name, "allocated") == 0) {
+        return NUMBER_VAL((double)(vm.bytesAllocated + vm.largeBytes + vm.bytesFreed));
+    }
+    if (strcmp(name, "freed") == 0) return NUMBER_VAL((double)vm.bytesFreed);
+    if (strcmp(name, "heap") == 0) return NUMBER_VAL((double)vm.bytesAllocated);
+    if (strcmp(name, "large") == 0) return NUMBER_VAL((double)vm.largeBytes);
+    if (strcmp(name, "threshold") == 0) return NUMBER_VAL((double)vm.nextGC);
+    return NIL_VAL;
+}
+
+// a byte count that fits size_t, NaN fails both tests. (double)SIZE_MAX
+// rounds up to 2^64, which does not fit.
+static bool isSize(Value value) {
+    return IS_NUMBER(value) && AS_NUMBER(value) >= 0 && AS_NUMBER(value) < (double)SIZE_MAX;
+}
+
+// heap size that starts the next cycle, returns the previous one
+static Value SetThreshold(int argCount, Value* args) {
+    if (argCount != 1 || !isSize(args[0])) return NIL_VAL;
+
+    size_t previous = vm.gcHeapMin;
+    setGCThreshold((size_t)AS_NUMBER(args[0]));
+    return NUMBER_VAL((double)previous);
+}
+
+// collect fully before the heap grows past this, 0 for no limit,
+// returns the previous limit
+static Value SetHeapLimit(int argCount, Value* args) {
+    if (argCount != 1 || !isSize(args[0])) return NIL_VAL;
+
+    size_t previous = vm.gcHeapLimit;
+    setGCHeapLimit((size_t)AS_NUMBER(args[0]));
+    return NUMBER_VAL((double)previous);
+}
+
+// collect and write the live objects to a file for rose --heap-summary
+// and --heap-diff, true once written
+static Value Snapshot(int argCount, Value* args) {
+    if (argCount != 1 || !IS_STRING(args[0])) return NIL_VAL;
+    return BOOL_VAL(writeHeapSnapshot(AS_CSTRING(args[0])));
+}
+
+void LoadGC() {
+    defineNative("gc_step", Step);
+    defineNative("gc_collect", Collect);
+    defineNative("gc_stats", Stats);
+    defineNative("gc_set_threshold", SetThreshold);
+    defineNative("gc_set_heap_limit", SetHeapLimit);
+    defineNative("gc_snapshot", Snapshot);
+}
@@ -0,0 +1,6 @@
+#ifndef ROSE_LIB_GC
+#define ROSE_LIB_GC
+
+void LoadGC();
+
+#endif
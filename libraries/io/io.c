@@ -2,6 +2,7 @@
 #include "../../value.h"
 #include "../../vm.h"
 #include "../../object.h"
+#include "../../memory.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -117,12 +118,9 @@ static Value readFile(int argCount, Value* args) {
     size_t fileSize = ftell(file);
     rewind(file);
 
-    char* buffer = (char*)malloc(fileSize + 1);
-    // check if succeded
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
-    }
+    // the string owns length + 1 bytes, big files go to the large object space
+    char* buffer = ALLOCATE(char, fileSize + 2);
+    buffer[fileSize + 1] = '\0';
     size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
     if (bytesRead < fileSize) {
         fprintf(stderr, "Could not read file \"%s\".\n", path);
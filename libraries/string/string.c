@@ -2,22 +2,419 @@
 #include "../../value.h"
 #include "../../vm.h"
 #include "../../object.h"
+#include "../../memory.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-// read a text file
+// pick the widest vector unit the compiler targets, scalar otherwise
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define ROSE_STRING_AVX2
+#define ROSE_STRING_SSE2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ROSE_STRING_SSE2
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static inline int lowestBit(uint32_t mask) {
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+}
+static inline int highestBit(uint32_t mask) {
+    unsigned long index;
+    _BitScanReverse(&index, mask);
+    return (int)index;
+}
+#else
+static inline int lowestBit(uint32_t mask) { return __builtin_ctz(mask); }
+static inline int highestBit(uint32_t mask) { return 31 - __builtin_clz(mask); }
+#endif
+
+// Scanning
+// first occurrence of needle in haystack, NULL if missing
+static const char* findBytes(const char* hay, int hayLen, const char* needle, int needleLen) {
+    if (needleLen == 0) return hay;
+    if (needleLen > hayLen) return NULL;
+    if (needleLen == 1) return (const char*)memchr(hay, needle[0], hayLen);
+
+    int last = hayLen - needleLen; // last valid start position
+    int i = 0;
+
+    // compare the first and last needle byte against a whole block at once,
+    // only candidates that match both get a full memcmp
+#if defined(ROSE_STRING_AVX2)
+    __m256i first32 = _mm256_set1_epi8(needle[0]);
+    __m256i tail32 = _mm256_set1_epi8(needle[needleLen - 1]);
+    for (; i + 32 <= last + 1; i += 32) {
+        __m256i blockFirst = _mm256_loadu_si256((const __m256i*)(hay + i));
+        __m256i blockTail = _mm256_loadu_si256((const __m256i*)(hay + i + needleLen - 1));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(first32, blockFirst), _mm256_cmpeq_epi8(tail32, blockTail)));
+        while (mask != 0) {
+            int bit = lowestBit(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, needleLen - 2) == 0) return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+#if defined(ROSE_STRING_SSE2)
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i tail = _mm_set1_epi8(needle[needleLen - 1]);
+    for (; i + 16 <= last + 1; i += 16) {
+        __m128i blockFirst = _mm_loadu_si128((const __m128i*)(hay + i));
+        __m128i blockTail = _mm_loadu_si128((const __m128i*)(hay + i + needleLen - 1));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(first, blockFirst), _mm_cmpeq_epi8(tail, blockTail)));
+        while (mask != 0) {
+            int bit = lowestBit(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, needleLen - 2) == 0) return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    // remaining positions, let memchr find the candidates
+    while (i <= last) {
+        const char* candidate = (const char*)memchr(hay + i, needle[0], last - i + 1);
+        if (candidate == NULL) return NULL;
+        if (memcmp(candidate + 1, needle + 1, needleLen - 1) == 0) return candidate;
+        i = (int)(candidate - hay) + 1;
+    }
+    return NULL;
+}
+
+// last occurrence of needle in haystack, NULL if missing
+static const char* findLastBytes(const char* hay, int hayLen, const char* needle, int needleLen) {
+    if (needleLen == 0) return hay + hayLen;
+    if (needleLen > hayLen) return NULL;
+
+    int i = hayLen - needleLen; // highest start position not yet checked
+
+#if defined(ROSE_STRING_SSE2)
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i tail = _mm_set1_epi8(needle[needleLen - 1]);
+    for (; i >= 15; i -= 16) {
+        int start = i - 15;
+        __m128i blockFirst = _mm_loadu_si128((const __m128i*)(hay + start));
+        __m128i blockTail = _mm_loadu_si128((const __m128i*)(hay + start + needleLen - 1));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(first, blockFirst), _mm_cmpeq_epi8(tail, blockTail)));
+        while (mask != 0) {
+            int bit = highestBit(mask);
+            if (memcmp(hay + start + bit, needle, needleLen) == 0) return hay + start + bit;
+            mask &= ~(1u << bit);
+        }
+    }
+#endif
+
+    for (; i >= 0; i--) {
+        if (hay[i] == needle[0] && memcmp(hay + i, needle, needleLen) == 0) return hay + i;
+    }
+    return NULL;
+}
+
+// ASCII case mapping, 'from' is 'a' or 'A'
+static void mapCase(char* dest, const char* src, int length, char from) {
+    int i = 0;
+#if defined(ROSE_STRING_SSE2)
+    __m128i lower = _mm_set1_epi8(from - 1);
+    __m128i upper = _mm_set1_epi8(from + 26);
+    __m128i flip = _mm_set1_epi8(0x20);
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(src + i));
+        // bytes >= 0x80 compare as negative so they never fall in range
+        __m128i inRange = _mm_and_si128(_mm_cmpgt_epi8(block, lower), _mm_cmplt_epi8(block, upper));
+        _mm_storeu_si128((__m128i*)(dest + i), _mm_xor_si128(block, _mm_and_si128(inRange, flip)));
+    }
+#endif
+    for (; i < length; i++) {
+        char c = src[i];
+        dest[i] = (c >= from && c < from + 26) ? (char)(c ^ 0x20) : c;
+    }
+}
+
+static bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// a number argument as an index into [0, limit], NaN counts as 0
+static int clampIndex(double index, int limit) {
+    if (!(index > 0)) return 0;
+    if (index > limit) return limit;
+    return (int)index;
+}
+
+// Functions
+// length of a string
 static Value Strlen(int argCount, Value* args) {
     if (argCount != 1) return NIL_VAL;
     if (!IS_STRING(args[0])) return NIL_VAL;
 
-    const char* string = AS_CSTRING(args[0]);
-    
-    return NUMBER_VAL(strlen(string));
+    return NUMBER_VAL(AS_STRING(args[0])->length);
+}
+
+// index of the first match at or after an optional start, -1 if none
+static Value Find(int argCount, Value* args) {
+    if (argCount != 2 && argCount != 3) return NIL_VAL;
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1])) return NIL_VAL;
+
+    ObjString* string = AS_STRING(args[0]);
+    ObjString* sub = AS_STRING(args[1]);
+
+    int start = 0;
+    if (argCount == 3) {
+        if (!IS_NUMBER(args[2])) return NIL_VAL;
+        if (AS_NUMBER(args[2]) > string->length) return NUMBER_VAL(-1);
+        start = clampIndex(AS_NUMBER(args[2]), string->length);
+    }
+
+    const char* found = findBytes(string->chars + start, string->length - start, sub->chars, sub->length);
+    if (found == NULL) return NUMBER_VAL(-1);
+    return NUMBER_VAL((double)(found - string->chars));
+}
+
+// index of the last match, -1 if none
+static Value RFind(int argCount, Value* args) {
+    if (argCount != 2) return NIL_VAL;
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1])) return NIL_VAL;
+
+    ObjString* string = AS_STRING(args[0]);
+    ObjString* sub = AS_STRING(args[1]);
+
+    const char* found = findLastBytes(string->chars, string->length, sub->chars, sub->length);
+    if (found == NULL) return NUMBER_VAL(-1);
+    return NUMBER_VAL((double)(found - string->chars));
+}
+
+// number of non overlapping matches
+static Value Count(int argCount, Value* args) {
+    if (argCount != 2) return NIL_VAL;
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1])) return NIL_VAL;
+
+    ObjString* string = AS_STRING(args[0]);
+    ObjString* sub = AS_STRING(args[1]);
+    if (sub->length == 0) return NIL_VAL;
+
+    int count = 0;
+    const char* cursor = string->chars;
+    const char* end = string->chars + string->length;
+    const char* found;
+    while ((found = findBytes(cursor, (int)(end - cursor), sub->chars, sub->length)) != NULL) {
+        count++;
+        cursor = found + sub->length;
+    }
+    return NUMBER_VAL(count);
+}
+
+// replace every match of 'old' with 'new'
+static Value Replace(int argCount, Value* args) {
+    if (argCount != 3) return NIL_VAL;
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1]) || !IS_STRING(args[2])) return NIL_VAL;
+
+    ObjString* string = AS_STRING(args[0]);
+    ObjString* from = AS_STRING(args[1]);
+    ObjString* to = AS_STRING(args[2]);
+    if (from->length == 0) return args[0];
+
+    const char* end = string->chars + string->length;
+
+    // size the result first so it is built in a single allocation
+    int count = 0;
+    const char* cursor = string->chars;
+    const char* found;
+    while ((found = findBytes(cursor, (int)(end - cursor), from->chars, from->length)) != NULL) {
+        count++;
+        cursor = found + from->length;
+    }
+    if (count == 0) return args[0];
+
+    int length = string->length + count * (to->length - from->length);
+    char* buffer = ALLOCATE(char, length + 1);
+    char* dest = buffer;
+
+    cursor = string->chars;
+    while ((found = findBytes(cursor, (int)(end - cursor), from->chars, from->length)) != NULL) {
+        memcpy(dest, cursor, found - cursor);
+        dest += found - cursor;
+        memcpy(dest, to->chars, to->length);
+        dest += to->length;
+        cursor = found + from->length;
+    }
+    memcpy(dest, cursor, end - cursor);
+    buffer[length] = '\0';
+
+    return OBJ_VAL(takeString(buffer, length, true));
+}
+
+// the piece stays on the stack while the array grows around it
+static void appendPiece(ObjArray* pieces, const char* chars, int length) {
+    push(OBJ_VAL(copyString(chars, length)));
+    writeValueArray(&pieces->values, vm.stackTop[-1]);
+    pop();
+}
+
+// split on a separator into an array of strings
+static Value Split(int argCount, Value* args) {
+    if (argCount != 2) return NIL_VAL;
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1])) return NIL_VAL;
+
+    ObjString* string = AS_STRING(args[0]);
+    ObjString* sep = AS_STRING(args[1]);
+    if (sep->length == 0) return NIL_VAL;
+
+    ObjArray* pieces = newArray();
+    push(OBJ_VAL(pieces));
+
+    const char* end = string->chars + string->length;
+    const char* cursor = string->chars;
+    const char* found;
+    while ((found = findBytes(cursor, (int)(end - cursor), sep->chars, sep->length)) != NULL) {
+        appendPiece(pieces, cursor, (int)(found - cursor));
+        cursor = found + sep->length;
+    }
+    appendPiece(pieces, cursor, (int)(end - cursor));
+
+    pop();
+    return OBJ_VAL(pieces);
+}
+
+// join an array of strings with a separator
+static Value Join(int argCount, Value* args) {
+    if (argCount != 2) return NIL_VAL;
+    if (!IS_ARRAY(args[0]) || !IS_STRING(args[1])) return NIL_VAL;
+
+    ValueArray* pieces = &AS_ARRAY(args[0])->values;
+    ObjString* sep = AS_STRING(args[1]);
+
+    int length = 0;
+    for (int i = 0; i < pieces->count; i++) {
+        if (!IS_STRING(pieces->values[i])) return NIL_VAL;
+        length += AS_STRING(pieces->values[i])->length;
+    }
+    if (pieces->count > 1) length += (pieces->count - 1) * sep->length;
+
+    char* buffer = ALLOCATE(char, length + 1);
+    char* dest = buffer;
+    for (int i = 0; i < pieces->count; i++) {
+        if (i != 0) {
+            memcpy(dest, sep->chars, sep->length);
+            dest += sep->length;
+        }
+        ObjString* piece = AS_STRING(pieces->values[i]);
+        memcpy(dest, piece->chars, piece->length);
+        dest += piece->length;
+    }
+    buffer[length] = '\0';
+
+    return OBJ_VAL(takeString(buffer, length, true));
+}
+
+static Value StartsWith(int argCount, Value* args) {
+    if (argCount != 2) return NIL_VAL;
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1])) return NIL_VAL;
+
+    ObjString* string = AS_STRING(args[0]);
+    ObjString* prefix = AS_STRING(args[1]);
+    if (prefix->length > string->length) return BOOL_VAL(false);
+    return BOOL_VAL(memcmp(string->chars, prefix->chars, prefix->length) == 0);
+}
+
+static Value EndsWith(int argCount, Value* args) {
+    if (argCount != 2) return NIL_VAL;
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1])) return NIL_VAL;
+
+    ObjString* string = AS_STRING(args[0]);
+    ObjString* suffix = AS_STRING(args[1]);
+    if (suffix->length > string->length) return BOOL_VAL(false);
+    return BOOL_VAL(memcmp(string->chars + string->length - suffix->length,
+        suffix->chars, suffix->length) == 0);
+}
+
+// strip whitespace from both ends
+static Value Trim(int argCount, Value* args) {
+    if (argCount != 1) return NIL_VAL;
+    if (!IS_STRING(args[0])) return NIL_VAL;
+
+    ObjString* string = AS_STRING(args[0]);
+    int start = 0;
+    int end = string->length;
+    while (start < end && isSpace(string->chars[start])) start++;
+    while (end > start && isSpace(string->chars[end - 1])) end--;
+
+    if (start == 0 && end == string->length) return args[0];
+    return OBJ_VAL(copyString(string->chars + start, end - start));
+}
+
+static Value ToUpper(int argCount, Value* args) {
+    if (argCount != 1) return NIL_VAL;
+    if (!IS_STRING(args[0])) return NIL_VAL;
+
+    ObjString* string = AS_STRING(args[0]);
+    char* buffer = ALLOCATE(char, string->length + 1);
+    mapCase(buffer, string->chars, string->length, 'a');
+    buffer[string->length] = '\0';
+    return OBJ_VAL(takeString(buffer, string->length, true));
+}
+
+static Value ToLower(int argCount, Value* args) {
+    if (argCount != 1) return NIL_VAL;
+    if (!IS_STRING(args[0])) return NIL_VAL;
+
+    ObjString* string = AS_STRING(args[0]);
+    char* buffer = ALLOCATE(char, string->length + 1);
+    mapCase(buffer, string->chars, string->length, 'A');
+    buffer[string->length] = '\0';
+    return OBJ_VAL(takeString(buffer, string->length, true));
+}
+
+// -1, 0 or 1 by byte order
+static Value Compare(int argCount, Value* args) {
+    if (argCount != 2) return NIL_VAL;
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1])) return NIL_VAL;
+
+    ObjString* a = AS_STRING(args[0]);
+    ObjString* b = AS_STRING(args[1]);
+    if (a == b) return NUMBER_VAL(0); // interned
+
+    int common = a->length < b->length ? a->length : b->length;
+    int result = memcmp(a->chars, b->chars, common);
+    if (result == 0) result = a->length - b->length;
+    return NUMBER_VAL(result < 0 ? -1 : (result > 0 ? 1 : 0));
+}
+
+// substring by start index and length
+static Value Substring(int argCount, Value* args) {
+    if (argCount != 3) return NIL_VAL;
+    if (!IS_STRING(args[0]) || !IS_NUMBER(args[1]) || !IS_NUMBER(args[2])) return NIL_VAL;
+
+    ObjString* string = AS_STRING(args[0]);
+    int start = clampIndex(AS_NUMBER(args[1]), string->length);
+    int length = string->length - start;
+    // a negative length takes the rest of the string
+    if (AS_NUMBER(args[2]) >= 0) length = clampIndex(AS_NUMBER(args[2]), length);
+
+    return OBJ_VAL(copyString(string->chars + start, length));
 }
 /////////////////////////////////////////////////////////////////////////////////
 
 void LoadString() {
     // string functions
     defineNative("strlen", Strlen);
-}
\ No newline at end of file
+    defineNative("sys_lib_string_find", Find);
+    defineNative("sys_lib_string_rfind", RFind);
+    defineNative("sys_lib_string_count", Count);
+    defineNative("sys_lib_string_replace", Replace);
+    defineNative("sys_lib_string_split", Split);
+    defineNative("sys_lib_string_join", Join);
+    defineNative("sys_lib_string_starts_with", StartsWith);
+    defineNative("sys_lib_string_ends_with", EndsWith);
+    defineNative("sys_lib_string_trim", Trim);
+    defineNative("sys_lib_string_to_upper", ToUpper);
+    defineNative("sys_lib_string_to_lower", ToLower);
+    defineNative("sys_lib_string_compare", Compare);
+    defineNative("sys_lib_string_sub", Substring);
+}
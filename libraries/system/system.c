@@ -47,11 +47,6 @@ static Value Type(int argCount, Value* args) {
 		buffer = malloc(length + 1);
 		memcpy(buffer, "<object>", length + 1);
 		break;
-	case VAL_NATIVE:
-		length = 12;
-		buffer = malloc(length + 1);
-		memcpy(buffer, "<native value>", length + 1);
-		break;
 	default:
 		break;
 	}
@@ -46,22 +46,34 @@ typedef enum {
     FUNC_CUSTOM         // Custom signature - user defines calling convention
 } FunctionSignature;
 
+typedef struct LoadedLibrary LoadedLibrary;
+
 // Structure to hold function information
 typedef struct {
     void* function_ptr;
     FunctionSignature signature;
     char name[64];
     bool is_valid;
+    LoadedLibrary* library;
 } DLLFunction;
 
 // Structure to hold library information
-typedef struct {
+struct LoadedLibrary {
     LIBRARY_HANDLE handle;
     char path[256];
     DLLFunction functions[MAX_FUNCTIONS_PER_LIB];
     int function_count;
     bool is_loaded;
-} LoadedLibrary;
+    // library and function objects still pointing here
+    int references;
+};
+
+// Libraries, functions and the pointers functions return reach Rose as
+// foreign objects with these tags. A library is closed once no object
+// refers to it, unless dll_unload closed it first.
+static const char LIBRARY_TAG[] = "library";
+static const char FUNCTION_TAG[] = "function";
+static const char POINTER_TAG[] = "pointer";
 
 // Global library registry
 static LoadedLibrary g_libraries[MAX_LIBRARIES];
@@ -77,13 +89,52 @@ static void InitializeDLLSystem() {
     }
 }
 
-// Find library by handle
-static LoadedLibrary* FindLibraryByHandle(LIBRARY_HANDLE handle) {
-    for (int i = 0; i < g_library_count; i++) {
-        if (g_libraries[i].handle == handle && g_libraries[i].is_loaded) {
-            return &g_libraries[i];
-        }
+// Library of a library object, NULL once it was unloaded
+static LoadedLibrary* AsLibrary(Value value) {
+    if (!isForeign(value, LIBRARY_TAG)) return NULL;
+    LoadedLibrary* lib = (LoadedLibrary*)AS_FOREIGN(value)->pointer;
+    return lib->is_loaded ? lib : NULL;
+}
+
+static DLLFunction* AsFunction(Value value) {
+    if (!isForeign(value, FUNCTION_TAG)) return NULL;
+    return (DLLFunction*)AS_FOREIGN(value)->pointer;
+}
+
+static void CloseLoadedLibrary(LoadedLibrary* lib) {
+    // Invalidate all functions from this library
+    for (int i = 0; i < lib->function_count; i++) {
+        lib->functions[i].is_valid = false;
     }
+
+    CLOSE_LIBRARY(lib->handle);
+    lib->is_loaded = false;
+}
+
+// Finalizers, run by the collector
+static void ReleaseLibrary(void* pointer) {
+    LoadedLibrary* lib = (LoadedLibrary*)pointer;
+    if (--lib->references == 0 && lib->is_loaded) CloseLoadedLibrary(lib);
+}
+
+static void ReleaseFunction(void* pointer) {
+    ReleaseLibrary(((DLLFunction*)pointer)->library);
+}
+
+static Value LibraryValue(LoadedLibrary* lib) {
+    lib->references++;
+    return OBJ_VAL(newForeign(LIBRARY_TAG, lib, 0, ReleaseLibrary));
+}
+
+// Pointers are not owned, they are freed through the library if at all
+static Value PointerValue(void* pointer) {
+    if (pointer == NULL) return NIL_VAL;
+    return OBJ_VAL(newForeign(POINTER_TAG, pointer, 0, NULL));
+}
+
+static void* AsPointer(Value value) {
+    if (IS_STRING(value)) return (void*)AS_CSTRING(value);
+    if (IS_FOREIGN(value)) return AS_FOREIGN(value)->pointer;
     return NULL;
 }
 
@@ -94,20 +145,29 @@ static Value RoseLoadLibrary(int argCount, Value* args) {
 
     InitializeDLLSystem();
 
-    if (g_library_count >= MAX_LIBRARIES) {
-        printf("Error: Maximum number of libraries (%d) reached\n", MAX_LIBRARIES);
-        return NIL_VAL;
-    }
-
     const char* library_path = AS_CSTRING(args[0]);
 
     // Check if library is already loaded
     for (int i = 0; i < g_library_count; i++) {
         if (g_libraries[i].is_loaded && strcmp(g_libraries[i].path, library_path) == 0) {
-            return NATIVE_VAL(g_libraries[i].handle, sizeof(LIBRARY_HANDLE));
+            return LibraryValue(&g_libraries[i]);
         }
     }
 
+    // Reuse the entry of a library nothing refers to anymore
+    LoadedLibrary* lib = NULL;
+    for (int i = 0; i < g_library_count; i++) {
+        if (!g_libraries[i].is_loaded && g_libraries[i].references == 0) {
+            lib = &g_libraries[i];
+            break;
+        }
+    }
+
+    if (lib == NULL && g_library_count >= MAX_LIBRARIES) {
+        printf("Error: Maximum number of libraries (%d) reached\n", MAX_LIBRARIES);
+        return NIL_VAL;
+    }
+
     // Load the library
     LIBRARY_HANDLE handle = LOAD_LIBRARY(library_path);
     if (!handle) {
@@ -119,17 +179,16 @@ static Value RoseLoadLibrary(int argCount, Value* args) {
     }
 
     // Store library information
-    LoadedLibrary* lib = &g_libraries[g_library_count];
+    if (lib == NULL) lib = &g_libraries[g_library_count++];
     lib->handle = handle;
     strncpy(lib->path, library_path, sizeof(lib->path) - 1);
     lib->path[sizeof(lib->path) - 1] = '\0';
     lib->function_count = 0;
     lib->is_loaded = true;
-
-    g_library_count++;
+    lib->references = 0;
 
     printf("Successfully loaded library: %s\n", library_path);
-    return NATIVE_VAL(handle, sizeof(LIBRARY_HANDLE));
+    return LibraryValue(lib);
 }
 
 // Get function from loaded library
@@ -138,11 +197,10 @@ static Value RoseGetFunction(int argCount, Value* args) {
     if (!IS_STRING(args[1])) return NIL_VAL;
     if (!IS_NUMBER(args[2])) return NIL_VAL;
 
-    LIBRARY_HANDLE handle = AS_NATIVE_VAL(args[0]);
     const char* function_name = AS_CSTRING(args[1]);
     FunctionSignature signature = (FunctionSignature)AS_NUMBER(args[2]);
 
-    LoadedLibrary* lib = FindLibraryByHandle(handle);
+    LoadedLibrary* lib = AsLibrary(args[0]);
     if (!lib) {
         printf("Error: Invalid library handle\n");
         return NIL_VAL;
@@ -154,7 +212,7 @@ static Value RoseGetFunction(int argCount, Value* args) {
     }
 
     // Get function pointer
-    void* func_ptr = GET_FUNCTION(handle, function_name);
+    void* func_ptr = GET_FUNCTION(lib->handle, function_name);
     if (!func_ptr) {
         printf("Error: Function '%s' not found in library\n", function_name);
         return NIL_VAL;
@@ -167,18 +225,20 @@ static Value RoseGetFunction(int argCount, Value* args) {
     strncpy(func->name, function_name, sizeof(func->name) - 1);
     func->name[sizeof(func->name) - 1] = '\0';
     func->is_valid = true;
+    func->library = lib;
 
     lib->function_count++;
+    lib->references++;
 
     printf("Successfully loaded function: %s\n", function_name);
-    return NATIVE_VAL(func, sizeof(DLLFunction*));
+    return OBJ_VAL(newForeign(FUNCTION_TAG, func, 0, ReleaseFunction));
 }
 
 // Call a loaded function with arguments
 static Value RoseCallFunction(int argCount, Value* args) {
     if (argCount < 1) return NIL_VAL;
 
-    DLLFunction* func = (DLLFunction*)AS_NATIVE_VAL(args[0]);
+    DLLFunction* func = AsFunction(args[0]);
     if (!func || !func->is_valid) {
         printf("Error: Invalid function handle\n");
         return NIL_VAL;
@@ -207,7 +267,7 @@ static Value RoseCallFunction(int argCount, Value* args) {
     case FUNC_PTR_VOID: {
         void* (*f)() = (void* (*)())func->function_ptr;
         void* result = f();
-        return NATIVE_VAL(result, sizeof(void*));
+        return PointerValue(result);
     }
 
     case FUNC_VOID_INT: {
@@ -262,15 +322,15 @@ static Value RoseCallFunction(int argCount, Value* args) {
     case FUNC_PTR_PTR: {
         if (argCount != 2) return NIL_VAL;
         void* (*f)(void*) = (void* (*)(void*))func->function_ptr;
-        void* param = IS_STRING(args[1]) ? (void*)AS_CSTRING(args[1]) : AS_NATIVE_VAL(args[1]);
+        void* param = AsPointer(args[1]);
         void* result = f(param);
-        return NATIVE_VAL(result, sizeof(void*));
+        return PointerValue(result);
     }
 
     case FUNC_INT_PTR: {
         if (argCount != 2) return NIL_VAL;
         int (*f)(void*) = (int (*)(void*))func->function_ptr;
-        void* param = IS_STRING(args[1]) ? (void*)AS_CSTRING(args[1]) : AS_NATIVE_VAL(args[1]);
+        void* param = AsPointer(args[1]);
         int result = f(param);
         return NUMBER_VAL(result);
     }
@@ -279,7 +339,7 @@ static Value RoseCallFunction(int argCount, Value* args) {
         if (argCount != 2 || !IS_NUMBER(args[1])) return NIL_VAL;
         void* (*f)(int) = (void* (*)(int))func->function_ptr;
         void* result = f((int)AS_NUMBER(args[1]));
-        return NATIVE_VAL(result, sizeof(void*));
+        return PointerValue(result);
     }
 
     case FUNC_CUSTOM:
@@ -293,22 +353,14 @@ static Value RoseCallFunction(int argCount, Value* args) {
 static Value RoseUnloadLibrary(int argCount, Value* args) {
     if (argCount != 1) return NIL_VAL;
 
-    LIBRARY_HANDLE handle = AS_NATIVE_VAL(args[0]);
-    LoadedLibrary* lib = FindLibraryByHandle(handle);
+    LoadedLibrary* lib = AsLibrary(args[0]);
 
     if (!lib) {
         printf("Error: Invalid library handle\n");
         return BOOL_VAL(false);
     }
 
-    // Invalidate all functions from this library
-    for (int i = 0; i < lib->function_count; i++) {
-        lib->functions[i].is_valid = false;
-    }
-
-    // Close the library
-    CLOSE_LIBRARY(handle);
-    lib->is_loaded = false;
+    CloseLoadedLibrary(lib);
 
     printf("Successfully unloaded library: %s\n", lib->path);
     return BOOL_VAL(true);
@@ -355,7 +407,7 @@ static Value RoseCreateWrapper(int argCount, Value* args) {
     if (argCount != 2) return NIL_VAL;
     if (!IS_STRING(args[1])) return NIL_VAL;
 
-    DLLFunction* func = (DLLFunction*)AS_NATIVE_VAL(args[0]);
+    DLLFunction* func = AsFunction(args[0]);
     const char* wrapper_name = AS_CSTRING(args[1]);
 
     if (!func || !func->is_valid) {
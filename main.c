@@ -2,6 +2,10 @@
 #include "chunk.h"
 #include "debug.h"
 #include "vm.h"
+#include "memory.h"
+#include "snapshot.h"
+#include "hashbench.h"
+#include "tier.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,21 +13,90 @@
 static void repl();
 static char* readFile(const char* path);
 static void runFile(const char* path);
+static void compileOnly(const char* path);
+static void usage();
 
 int main(int argc, const char* argv[]){
 
     // init the vm
     initVM();
 
-    if (argc == 1) {
+    // options come before the script
+    int arg = 1;
+    bool compiling = false;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--gc-stats") == 0) {
+            vm.gcStats = true;
+        }
+        else if (strcmp(argv[arg], "--gc-concurrent") == 0) {
+            vm.gcConcurrent = true;
+        }
+        else if (strcmp(argv[arg], "--gc-log") == 0) {
+            vm.gcLog = true;
+        }
+        else if (strcmp(argv[arg], "--tier") == 0) {
+            vm.tierCalls = TIER_CALLS;
+        }
+        else if (strncmp(argv[arg], "--tier-calls=", 13) == 0) {
+            char* end;
+            long calls = strtol(argv[arg] + 13, &end, 10);
+            if (*end != '\0' || calls < 1 || calls > INT32_MAX) {
+                fprintf(stderr, "Invalid option '%s'.\n", argv[arg]);
+                exit(64);
+            }
+            vm.tierCalls = (int)calls;
+        }
+        else if (strcmp(argv[arg], "--no-inline") == 0) {
+            vm.inlining = false;
+        }
+        else if (strcmp(argv[arg], "--no-cache") == 0) {
+            vm.caching = false;
+        }
+        // write file.rosec and stop
+        else if (strcmp(argv[arg], "--compile") == 0) {
+            compiling = true;
+        }
+        // files written by gc_snapshot
+        else if (strcmp(argv[arg], "--heap-summary") == 0) {
+            if (arg + 2 != argc) usage();
+            exit(summarizeHeapSnapshot(argv[arg + 1]) ? 0 : 74);
+        }
+        else if (strcmp(argv[arg], "--heap-diff") == 0) {
+            if (arg + 3 != argc) usage();
+            exit(diffHeapSnapshots(argv[arg + 1], argv[arg + 2]) ? 0 : 74);
+        }
+        else if (strcmp(argv[arg], "--hash-bench") == 0) {
+            if (arg + 2 < argc) usage();
+            exit(runHashBenchmark(arg + 1 < argc ? argv[arg + 1] : NULL) ? 0 : 74);
+        }
+        // --gc-growth=2, --gc-heap-min=4M, --gc-heap-limit=1G, --gc-threads=4
+        else if (strncmp(argv[arg], "--gc-", 5) == 0 && strchr(argv[arg], '=') != NULL) {
+            const char* name = argv[arg] + 5;
+            const char* value = strchr(name, '=');
+
+            if (!setGCOption(name, (int)(value - name), value + 1)) {
+                fprintf(stderr, "Invalid option '%s'.\n", argv[arg]);
+                exit(64);
+            }
+        }
+        else {
+            fprintf(stderr, "Unknown option '%s'.\n", argv[arg]);
+            exit(64);
+        }
+    }
+
+    if (compiling) {
+        if (arg != argc - 1) usage();
+        compileOnly(argv[arg]);
+    }
+    else if (arg == argc) {
         repl();
     }
-    else if (argc == 2) {
-        runFile(argv[1]);
+    else if (arg == argc - 1) {
+        runFile(argv[arg]);
     }
     else {
-        fprintf(stderr, "Usage: rose [path]\n");
-        exit(64);
+        usage();
     }
 
     //runFile("test.rose");
@@ -32,6 +105,16 @@ int main(int argc, const char* argv[]){
     return 0;
 }
 
+static void usage() {
+    fprintf(stderr, "Usage: rose [--gc-stats] [--gc-concurrent] [--gc-log] [--gc-<option>=value]\n");
+    fprintf(stderr, "            [--tier] [--tier-calls=n] [--no-inline] [--no-cache] [path]\n");
+    fprintf(stderr, "       rose --compile path\n");
+    fprintf(stderr, "       rose --heap-summary snapshot\n");
+    fprintf(stderr, "       rose --heap-diff before after\n");
+    fprintf(stderr, "       rose --hash-bench [path]\n");
+    exit(64);
+}
+
 // colored text
 static void red() {
     printf("\033[1;31m");
@@ -63,6 +146,9 @@ static void repl() {
     printf("Aasem Ibrahim Shokr\n");
     reset();
 
+    // a later line could assign a function already inlined into an earlier one
+    vm.inlining = false;
+
     char line[1024];
     for (;;) {
         blue();
@@ -74,7 +160,7 @@ static void repl() {
             break;
         }
 
-        interpret(line);
+        interpret(line, NULL);
     }
 }
 
@@ -109,11 +195,30 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
+static bool isBytecode(const char* path) {
+    size_t length = strlen(path);
+    return length >= 6 && strcmp(path + length - 6, ".rosec") == 0;
+}
+
 static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+    InterpretResult result;
+    if (isBytecode(path)) {
+        result = interpretBytecode(path);
+    }
+    else {
+        char* source = readFile(path);
+        result = interpret(source, path);
+        free(source);
+    }
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+}
+
+static void compileOnly(const char* path) {
+    char* source = readFile(path);
+    bool compiled = compileFile(source, path);
+    free(source);
+
+    if (!compiled) exit(65);
 }
\ No newline at end of file
@@ -1,27 +1,471 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <math.h>
+#include <string.h>
 #include "memory.h"
 #include "vm.h"
 #include "compiler.h"
+#include "thread.h"
+#include "weak.h"
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+#ifdef _WIN32
+#include <windows.h>
+#include <malloc.h>
+#define ALLOCATE_PAGE() _aligned_malloc(GC_PAGE_SIZE, GC_PAGE_SIZE)
+#define FREE_PAGE(page) _aligned_free(page)
+#define MAP_MEMORY(size) VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE)
+#define UNMAP_MEMORY(pointer, size) VirtualFree(pointer, 0, MEM_RELEASE)
+#define DISCARD_MEMORY(pointer, size) VirtualFree(pointer, size, MEM_DECOMMIT)
+#define RECOMMIT_MEMORY(pointer, size) VirtualAlloc(pointer, size, MEM_COMMIT, PAGE_READWRITE)
+#else
+#include <time.h>
+#include <sys/mman.h>
+static void* allocatePage() {
+    void* page;
+    return posix_memalign(&page, GC_PAGE_SIZE, GC_PAGE_SIZE) == 0 ? page : NULL;
+}
+#define ALLOCATE_PAGE() allocatePage()
+#define FREE_PAGE(page) free(page)
+static void* mapMemory(size_t size) {
+    void* pointer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return pointer == MAP_FAILED ? NULL : pointer;
+}
+#define MAP_MEMORY(size) mapMemory(size)
+#define UNMAP_MEMORY(pointer, size) munmap(pointer, size)
+// the mapping stays, its pages read back as zeros
+#define DISCARD_MEMORY(pointer, size) madvise(pointer, size, MADV_DONTNEED)
+#define RECOMMIT_MEMORY(pointer, size) ((void)0)
+#endif
+
+// an incremental step runs for at most GC_STEP_MICROS, and one is due
+// every GC_STEP_BYTES allocated while a cycle is under way
+#define GC_STEP_MICROS 500
+#define GC_STEP_BYTES (64 * 1024)
+// objects traced or swept between two looks at the clock
+#define GC_STEP_CHECK 128
+// objects the concurrent marker blackens per turn of the heap lock
+#define GC_MARKER_BATCH 64
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-    vm.bytesAllocated += newSize - oldSize;
+// concurrent marking: the helper thread owns grayStack until it sets
+// markerDone, mutator stores into old objects take heapLock meanwhile
+static THREAD_HANDLE markerThread;
+static MUTEX heapLock;
+static long markerDone;
 
-    if (newSize > oldSize) {
-#ifdef DEBUG_STRESS_GC
-        collectGarbage();
+// Parallel stop-the-world phases, see ROSE_GC_THREADS: each worker owns a
+// gray queue the others steal from, and counts the bytes it frees so
+// vm.bytesAllocated is only touched by the main thread
+#define GC_MAX_THREADS 64
+// heaps smaller than this are traced and swept on the main thread
+#define GC_PARALLEL_MIN (4 * 1024 * 1024)
+
+// finalizer of a foreign object a sweep worker freed, run by the main
+// thread once the sweep is done
+typedef struct {
+    ForeignFinalizer finalize;
+    void* pointer;
+} Finalizer;
+
+typedef struct {
+    MUTEX lock;
+    int count;
+    int capacity;
+    Obj** items;
+    size_t freed;
+    int finalizerCount;
+    int finalizerCapacity;
+    Finalizer* finalizers;
+} GCWorker;
+
+static GCWorker workers[GC_MAX_THREADS];
+static int workerCount;
+static long runningWorkers;
+static long idleWorkers;
+static Page** sweepPages;
+static int sweepPageCount;
+static long nextSweepPage;
+static THREAD_LOCAL GCWorker* currentWorker;
+
+// Large object space: buffers of GC_LARGE_SIZE bytes and more, such as
+// the characters of a big string or the values of a big array, are mapped
+// straight from the system and never move. They are counted in
+// vm.largeBytes, which has its own threshold, so bulk data does not bring
+// the next collection of the small heap forward.
+#define GC_LARGE_SIZE (64 * 1024)
+#define GC_LARGE_MIN (16 * 1024 * 1024)
+#define GC_LARGE_ALIGN 4096
+// freed mappings kept, with their pages handed back, for reuse
+#define GC_LARGE_CACHE 8
+
+typedef struct {
+    void* pointer;
+    size_t capacity;
+} LargeBlock;
+
+// live blocks, and an open addressing index from their addresses to their
+// slots there, -1 for an empty entry
+static LargeBlock* largeBlocks;
+static int largeCount;
+static int largeCapacity;
+static int* largeIndex;
+static int largeIndexCapacity;
+static LargeBlock largeCache[GC_LARGE_CACHE];
+static int largeCached;
+// sweep workers free large buffers too
+static MUTEX largeLock;
+
+// free slots of a page are linked through their first word
+typedef struct FreeSlot {
+    struct FreeSlot* next;
+} FreeSlot;
+
+// Every page of a size class is on one of its lists. A cycle's sweep
+// moves them all to 'unswept', allocation only uses swept pages.
+typedef struct {
+    Page* available;
+    Page* full;
+    Page* unswept;
+} SizeClass;
+
+static SizeClass sizeClasses[GC_SIZE_CLASSES];
+// classes below this one have nothing left to sweep
+static int sweepClass = GC_SIZE_CLASSES;
+
+// every weak object, settled after each major mark, and the ones a
+// minor collection found in the remembered set
+static Obj** weakObjects;
+static int weakCount;
+static int weakCapacity;
+static Obj** youngWeak;
+static int youngWeakCount;
+static int youngWeakCapacity;
+
+// young objects copied out of the nursery, waiting to be scanned
+static Obj** promoted;
+static int promotedCount;
+static int promotedCapacity;
+
+#define SLOT_SIZE(sizeClass) (((sizeClass) + 1) * GC_GRANULE)
+#define FIRST_SLOT(page) \
+    ((uint8_t*)(page) + ((sizeof(Page) + GC_GRANULE - 1) & ~(size_t)(GC_GRANULE - 1)))
+#define SET_LIVE(object) \
+    (PAGE_OF(object)->live[GRANULE_OF(object) / 8] |= MARK_MASK(object))
+
+// a copied young object keeps its new address in its second word,
+// strings keep their hash for the string table
+#define FORWARD_ADDRESS(object) (*(Obj**)((uint8_t*)(object) + sizeof(Obj*)))
+
+static void releaseObject(Obj* object);
+
+static void pushPage(Page** list, Page* page) {
+    page->next = *list;
+    *list = page;
+}
+
+static Page* newPage(int sizeClass) {
+    Page* page = (Page*)ALLOCATE_PAGE();
+    if (page == NULL) exit(1);
+
+    memset(page->marks, 0, sizeof(page->marks));
+    memset(page->live, 0, sizeof(page->live));
+    page->sizeClass = sizeClass;
+    page->liveCount = 0;
+    page->free = NULL;
+
+    // thread the free list so the lowest addresses are handed out first
+    size_t slotSize = SLOT_SIZE(sizeClass);
+    uint8_t* first = FIRST_SLOT(page);
+    uint8_t* slot = first + (GC_PAGE_SIZE - (first - (uint8_t*)page)) / slotSize * slotSize;
+    while (slot > first) {
+        slot -= slotSize;
+        ((FreeSlot*)slot)->next = page->free;
+        page->free = (FreeSlot*)slot;
+    }
+
+    pushPage(&sizeClasses[sizeClass].available, page);
+    return page;
+}
+
+// bytes freed by a sweep worker are added up once it is done
+static void countFreed(size_t bytes) {
+    if (currentWorker != NULL) {
+        currentWorker->freed += bytes;
+    }
+    else {
+        vm.bytesAllocated -= bytes;
+        vm.bytesFreed += bytes;
+    }
+}
+
+// Free the unmarked objects of a page and clear its marks for the next
+// cycle. A page is only ever swept by one thread.
+static void sweepPage(Page* page) {
+    size_t slotSize = SLOT_SIZE(page->sizeClass);
+
+    for (int i = 0; i < (int)sizeof(page->marks); i++) {
+        uint8_t dead = page->live[i] & (uint8_t)~page->marks[i];
+        page->live[i] = page->marks[i];
+        page->marks[i] = 0;
+        if (dead == 0) continue;
+
+        for (int bit = 0; bit < 8; bit++) {
+            if (!(dead & (1 << bit))) continue;
+
+            Obj* object = (Obj*)((uint8_t*)page + (i * 8 + bit) * GC_GRANULE);
+#ifdef DEBUG_LOG_GC
+            printf("%p free type %d\n", (void*)object, object->type);
 #endif
-        if (vm.bytesAllocated > vm.nextGC) {
-            collectGarbage();
+            releaseObject(object);
+
+            FreeSlot* slot = (FreeSlot*)object;
+            slot->next = page->free;
+            page->free = slot;
+            page->liveCount--;
+            countFreed(slotSize);
+        }
+    }
+}
+
+// An empty page goes back to the system unless it is the only one with
+// room in its class, which saves allocating it again straight away
+static void filePage(Page* page) {
+    SizeClass* sizeClass = &sizeClasses[page->sizeClass];
+
+    if (page->liveCount == 0 && sizeClass->available != NULL) {
+        FREE_PAGE(page);
+    }
+    else {
+        pushPage(page->free != NULL ? &sizeClass->available : &sizeClass->full, page);
+    }
+}
+
+// Old objects are popped off the free list of a page of their size class,
+// sweeping the class's pages first if a cycle left them unswept.
+// bytesAllocated counts whole slots.
+static Obj* allocateSlot(size_t size) {
+    int index = (int)((size + GC_GRANULE - 1) / GC_GRANULE) - 1;
+    // every object type fits the largest class
+    if (index >= GC_SIZE_CLASSES) exit(1);
+    SizeClass* sizeClass = &sizeClasses[index];
+
+    while (sizeClass->available == NULL && sizeClass->unswept != NULL) {
+        Page* page = sizeClass->unswept;
+        sizeClass->unswept = page->next;
+        sweepPage(page);
+        filePage(page);
+    }
+
+    Page* page = sizeClass->available;
+    if (page == NULL) page = newPage(index);
+
+    FreeSlot* slot = page->free;
+    page->free = slot->next;
+    page->liveCount++;
+    SET_LIVE(slot);
+
+    if (page->free == NULL) {
+        sizeClass->available = page->next;
+        pushPage(&sizeClass->full, page);
+    }
+
+    vm.bytesAllocated += SLOT_SIZE(index);
+    return (Obj*)slot;
+}
+
+static void releasePages(Page* page) {
+    while (page != NULL) {
+        Page* next = page->next;
+        size_t slotSize = SLOT_SIZE(page->sizeClass);
+
+        for (uint8_t* slot = FIRST_SLOT(page);
+            slot + slotSize <= (uint8_t*)page + GC_PAGE_SIZE;
+            slot += slotSize) {
+            if (page->live[GRANULE_OF(slot) / 8] & MARK_MASK(slot)) releaseObject((Obj*)slot);
+        }
+
+        FREE_PAGE(page);
+        page = next;
+    }
+}
+
+// Returns whether the object was marked already. The marker thread and
+// the parallel workers share mark bytes with each other and the mutator.
+static bool setMark(Obj* object) {
+    uint8_t* byte = MARK_BYTE(object);
+    uint8_t mask = MARK_MASK(object);
+
+    if (currentWorker != NULL || vm.gcPhase == GC_CONCURRENT_MARK) {
+        return (ATOMIC_OR8(byte, mask) & mask) != 0;
+    }
+
+    bool marked = (*byte & mask) != 0;
+    *byte |= mask;
+    return marked;
+}
+
+// mappings are page aligned, so the low bits carry nothing
+static uint32_t hashLarge(void* pointer) {
+    uint64_t bits = (uint64_t)(uintptr_t)pointer >> 12;
+    uint32_t hash = (uint32_t)(bits ^ (bits >> 32));
+    hash ^= hash >> 16;
+    hash *= 0x7feb352d;
+    hash ^= hash >> 15;
+    return hash;
+}
+
+// entry of the block at 'pointer', or the empty one it would go in
+static int* findLargeEntry(void* pointer) {
+    uint32_t mask = (uint32_t)largeIndexCapacity - 1;
+    for (uint32_t i = hashLarge(pointer) & mask;; i = (i + 1) & mask) {
+        int* entry = &largeIndex[i];
+        if (*entry == -1 || largeBlocks[*entry].pointer == pointer) return entry;
+    }
+}
+
+static void growLargeIndex() {
+    free(largeIndex);
+    largeIndexCapacity = GROW_CAPACITY(largeIndexCapacity);
+    largeIndex = (int*)malloc(sizeof(int) * largeIndexCapacity);
+    if (largeIndex == NULL) exit(1);
+    for (int i = 0; i < largeIndexCapacity; i++) largeIndex[i] = -1;
+
+    for (int i = 0; i < largeCount; i++) *findLargeEntry(largeBlocks[i].pointer) = i;
+}
+
+// take the entry of the block at 'pointer' out, moving the entries probed
+// past it back
+static void unindexLarge(void* pointer) {
+    uint32_t mask = (uint32_t)largeIndexCapacity - 1;
+    int* entry = findLargeEntry(pointer);
+    uint32_t hole = (uint32_t)(entry - largeIndex);
+
+    for (uint32_t i = (hole + 1) & mask; largeIndex[i] != -1; i = (i + 1) & mask) {
+        uint32_t home = hashLarge(largeBlocks[largeIndex[i]].pointer) & mask;
+        bool reachable = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+        if (reachable) continue;
+
+        largeIndex[hole] = largeIndex[i];
+        hole = i;
+    }
+    largeIndex[hole] = -1;
+}
+
+// an index, since mapping another block can move the registry
+static int findLarge(void* pointer) {
+    if (largeCount == 0) return -1;
+    return *findLargeEntry(pointer);
+}
+
+// a cached mapping that fits without wasting more than half of it
+static void* allocateLarge(size_t size) {
+    size_t capacity = (size + GC_LARGE_ALIGN - 1) & ~(size_t)(GC_LARGE_ALIGN - 1);
+    LargeBlock block = { NULL, capacity };
+
+    for (int i = 0; i < largeCached; i++) {
+        if (largeCache[i].capacity >= capacity && largeCache[i].capacity / 2 <= capacity) {
+            block = largeCache[i];
+            largeCache[i] = largeCache[--largeCached];
+            RECOMMIT_MEMORY(block.pointer, block.capacity);
+            break;
+        }
+    }
+
+    if (block.pointer == NULL) {
+        block.pointer = MAP_MEMORY(capacity);
+        if (block.pointer == NULL) exit(1);
+    }
+
+    if (largeCapacity < largeCount + 1) {
+        largeCapacity = GROW_CAPACITY(largeCapacity);
+        largeBlocks = (LargeBlock*)realloc(largeBlocks, sizeof(LargeBlock) * largeCapacity);
+
+        if (largeBlocks == NULL) exit(1);
+    }
+    if (largeIndexCapacity / 2 < largeCount + 1) growLargeIndex();
+
+    largeBlocks[largeCount] = block;
+    *findLargeEntry(block.pointer) = largeCount++;
+    return block.pointer;
+}
+
+static void freeLarge(int index) {
+    LargeBlock block = largeBlocks[index];
+
+    // the last block fills the hole
+    unindexLarge(block.pointer);
+    if (index != --largeCount) {
+        largeBlocks[index] = largeBlocks[largeCount];
+        *findLargeEntry(largeBlocks[index].pointer) = index;
+    }
+
+    if (largeCached < GC_LARGE_CACHE) {
+        DISCARD_MEMORY(block.pointer, block.capacity);
+        largeCache[largeCached++] = block;
+        return;
+    }
+
+    UNMAP_MEMORY(block.pointer, block.capacity);
+}
+
+// Buffers that cross the threshold move between malloc and a mapping.
+// One that stays large keeps its mapping while it fits.
+static void* reallocateLarge(void* pointer, size_t oldSize, size_t newSize) {
+    LOCK_MUTEX(&largeLock);
+    // a buffer the caller got from malloc itself is not listed
+    int block = oldSize >= GC_LARGE_SIZE ? findLarge(pointer) : -1;
+    void* result = NULL;
+
+    if (newSize >= GC_LARGE_SIZE) {
+        if (block != -1 && newSize <= largeBlocks[block].capacity) {
+            result = pointer;
         }
+        else {
+            result = allocateLarge(newSize);
+        }
+        vm.largeBytes += newSize;
+
+        if (vm.largeBytes > vm.nextLarge) vm.gcStepAt = 0;
+    }
+    else if (newSize > 0) {
+        result = malloc(newSize);
+        if (result == NULL) exit(1);
+        vm.bytesAllocated += newSize;
+    }
+
+    if (pointer != NULL && result != pointer) {
+        if (result != NULL) memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+
+        if (block != -1) freeLarge(block);
+        else free(pointer);
     }
-    
+
+    if (block != -1) {
+        vm.largeBytes -= oldSize;
+        vm.bytesFreed += oldSize;
+    }
+    else {
+        countFreed(oldSize);
+    }
+
+    UNLOCK_MUTEX(&largeLock);
+    return result;
+}
+
+// Collections run at the interpreter's safe points, so allocating never
+// collects and every C local stays valid across it
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+    if (oldSize >= GC_LARGE_SIZE || newSize >= GC_LARGE_SIZE) {
+        return reallocateLarge(pointer, oldSize, newSize);
+    }
+
+    // sweep workers only ever free
+    if (newSize < oldSize) countFreed(oldSize - newSize);
+    else vm.bytesAllocated += newSize - oldSize;
+
     if (newSize == 0) {
         free(pointer);
         return NULL;
@@ -49,6 +493,56 @@ static void markArray(ValueArray* array) {
     }
 }
 
+static size_t objectSize(ObjType type) {
+    switch (type) {
+    case OBJ_STRING: return sizeof(ObjString);
+    case OBJ_NATIVE: return sizeof(ObjNative);
+    case OBJ_ARRAY: return sizeof(ObjArray);
+    case OBJ_FUNCTION: return sizeof(ObjFunction);
+    case OBJ_CLOSURE: return sizeof(ObjClosure);
+    case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+    case OBJ_CLASS: return sizeof(ObjClass);
+    case OBJ_INSTANCE: return sizeof(ObjInstance);
+    case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+    case OBJ_WEAK_REF: return sizeof(ObjWeakRef);
+    case OBJ_WEAK_MAP: return sizeof(ObjWeakMap);
+    case OBJ_FOREIGN: return sizeof(ObjForeign);
+    }
+    return 0;
+}
+
+// nursery objects are packed on 8 byte boundaries
+#define YOUNG_SIZE(size) (((size) + 7) & ~(size_t)7)
+
+static void pushWork(GCWorker* worker, Obj* object) {
+    LOCK_MUTEX(&worker->lock);
+    if (worker->capacity < worker->count + 1) {
+        worker->capacity = GROW_CAPACITY(worker->capacity);
+        worker->items = (Obj**)realloc(worker->items, sizeof(Obj*) * worker->capacity);
+
+        if (worker->items == NULL) exit(1);
+    }
+
+    worker->items[worker->count++] = object;
+    UNLOCK_MUTEX(&worker->lock);
+}
+
+static void pushGray(Obj* object) {
+    if (currentWorker != NULL) {
+        pushWork(currentWorker, object);
+        return;
+    }
+
+    if (vm.grayCapacity < vm.grayCount + 1) {
+        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+        vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+
+        if (vm.grayStack == NULL) exit(1);
+    }
+
+    vm.grayStack[vm.grayCount++] = object;
+}
+
 static void blackenObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void*)object);
@@ -92,43 +586,51 @@ static void blackenObject(Obj* object) {
     case OBJ_UPVALUE:
         markValue(((ObjUpvalue*)object)->closed);
         break;
+    case OBJ_ARRAY:
+        markArray(&((ObjArray*)object)->values);
+        break;
     case OBJ_NATIVE:
     case OBJ_STRING:
+    case OBJ_FOREIGN:
+        break;
+    case OBJ_WEAK_REF:
+    case OBJ_WEAK_MAP:
+        // what they point to is settled once marking is done
         break;
     }
 }
 
+// young objects are never marked, they are traced once promoted
 void markObject(Obj* object) {
-    if (object == NULL) return;
-    if (object->isMarked) return;
+    if (object == NULL || IS_YOUNG(object)) return;
+    if (setMark(object)) return;
 
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*)object);
     printValue(OBJ_VAL(object));
     printf("\n");
 #endif
-    object->isMarked = true;
+    pushGray(object);
+}
 
-    if (vm.grayCapacity < vm.grayCount + 1) {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-        vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
 
-        if (vm.grayStack == NULL) exit(1);
+static void deferFinalizer(GCWorker* worker, ForeignFinalizer finalize, void* pointer) {
+    if (worker->finalizerCapacity < worker->finalizerCount + 1) {
+        worker->finalizerCapacity = GROW_CAPACITY(worker->finalizerCapacity);
+        worker->finalizers = (Finalizer*)realloc(worker->finalizers,
+            sizeof(Finalizer) * worker->finalizerCapacity);
+
+        if (worker->finalizers == NULL) exit(1);
     }
 
-    vm.grayStack[vm.grayCount++] = object;
+    worker->finalizers[worker->finalizerCount].finalize = finalize;
+    worker->finalizers[worker->finalizerCount].pointer = pointer;
+    worker->finalizerCount++;
 }
 
-
-static void freeObject(Obj* object) {
-#ifdef DEBUG_LOG_GC
-    printf("%p free type %d\n", (void*)object, object->type);
-#endif
+// frees what the object owns but not the object itself
+static void releaseObject(Obj* object) {
     switch (object->type) {
-        case OBJ_BOUND_METHOD: {
-            FREE(ObjBoundMethod, object);
-            break; 
-        }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
             /*if (!callDestructor(instance)) {
@@ -137,53 +639,127 @@ static void freeObject(Obj* object) {
                 fprintf(stderr, "Warning: Failed to call destructor for instance.\n");
 #endif // DEBUG_LOG_GC
             }*/
-            // Proceed with freeing the instance's memory
             freeTable(&instance->fields);
-            FREE(ObjInstance, instance);
             break;
         }
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
             FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
+            FREE_ARRAY(uint8_t, function->baselineCode, function->baselineCapacity);
             freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
             break;
         }
-        case OBJ_NATIVE:
-            FREE(ObjNative, object);
-            break;
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
             FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
             break;
         }
-        case OBJ_UPVALUE:
-            FREE(ObjUpvalue, object);
+        case OBJ_CLASS:
+            freeTable(&((ObjClass*)object)->methods);
             break;
-        case OBJ_CLASS: {
-            ObjClass* klass = (ObjClass*)object;
-            freeTable(&klass->methods);
-            FREE(ObjClass, object);
+        case OBJ_ARRAY: {
+            // elements are referenced, not owned
+            ObjArray* array = (ObjArray*)object;
+            FREE_ARRAY(Value, array->values.values, array->values.capacity);
             break;
         }
+        case OBJ_WEAK_MAP: {
+            ObjWeakMap* map = (ObjWeakMap*)object;
+            FREE_ARRAY(WeakEntry, map->entries, map->capacity);
+            break;
+        }
+        case OBJ_FOREIGN: {
+            ObjForeign* foreign = (ObjForeign*)object;
+            countFreed(foreign->externalSize);
+            if (foreign->finalize == NULL) break;
+
+            if (currentWorker != NULL) {
+                deferFinalizer(currentWorker, foreign->finalize, foreign->pointer);
+            }
+            else {
+                foreign->finalize(foreign->pointer);
+            }
+            break;
+        }
+        case OBJ_NATIVE:
+        case OBJ_UPVALUE:
+        case OBJ_BOUND_METHOD:
+        case OBJ_WEAK_REF:
+            break;
+    }
+}
+
+static void walkPages(Page* page, HeapVisitor visit, void* context) {
+    for (; page != NULL; page = page->next) {
+        size_t slotSize = SLOT_SIZE(page->sizeClass);
+
+        for (uint8_t* slot = FIRST_SLOT(page);
+            slot + slotSize <= (uint8_t*)page + GC_PAGE_SIZE;
+            slot += slotSize) {
+            if (page->live[GRANULE_OF(slot) / 8] & MARK_MASK(slot)) {
+                visit((Obj*)slot, slotSize, context);
+            }
+        }
+    }
+}
+
+// Every object in the nursery and the old space. Pages waiting for their
+// sweep still hold the dead objects of the last cycle, collect first.
+void walkHeap(HeapVisitor visit, void* context) {
+    for (int i = 0; i < GC_SIZE_CLASSES; i++) {
+        walkPages(sizeClasses[i].available, visit, context);
+        walkPages(sizeClasses[i].full, visit, context);
+        walkPages(sizeClasses[i].unswept, visit, context);
+    }
+
+    for (uint8_t* young = vm.nurseryStart; young < vm.nurseryTop;) {
+        Obj* object = (Obj*)young;
+        size_t size = YOUNG_SIZE(objectSize(object->type));
+        visit(object, size, context);
+        young += size;
     }
 }
 
 void freeObjects() {
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+    if (vm.gcPhase == GC_CONCURRENT_MARK) JOIN_THREAD(markerThread);
+
+    for (int i = 0; i < GC_SIZE_CLASSES; i++) {
+        releasePages(sizeClasses[i].available);
+        releasePages(sizeClasses[i].full);
+        releasePages(sizeClasses[i].unswept);
+    }
+
+    for (uint8_t* young = vm.nurseryStart; young < vm.nurseryTop;) {
+        Obj* object = (Obj*)young;
+        young += YOUNG_SIZE(objectSize(object->type));
+        if (!object->isMarked) releaseObject(object);
     }
 
+    free(vm.nurseryStart);
+    free(vm.remembered);
+    free(weakObjects);
+    free(youngWeak);
+    free(promoted);
+    free(vm.satbLog);
+    free(vm.deferred);
     free(vm.grayStack);
+    FREE_MUTEX(&heapLock);
+
+    for (int i = 0; i < largeCount; i++) {
+        UNMAP_MEMORY(largeBlocks[i].pointer, largeBlocks[i].capacity);
+    }
+    for (int i = 0; i < largeCached; i++) {
+        UNMAP_MEMORY(largeCache[i].pointer, largeCache[i].capacity);
+    }
+    free(largeBlocks);
+    free(largeIndex);
+    FREE_MUTEX(&largeLock);
+    free(vm.minorPauses.times);
+    free(vm.majorPauses.times);
 }
 
 static void markRoots() {
@@ -205,56 +781,970 @@ static void markRoots() {
     markCompilerRoots();
     markObject((Obj*)vm.initString);
     markObject((Obj*)vm.destString);
+    for (int i = 0; i < vm.nativeCount; i++) {
+        markObject((Obj*)vm.natives[i].name);
+    }
 }
 
-static void traceReferences() {
-    while (vm.grayCount > 0) {
-        Obj* object = vm.grayStack[--vm.grayCount];
-        blackenObject(object);
+static Obj* popWork(GCWorker* worker) {
+    Obj* object = NULL;
+    LOCK_MUTEX(&worker->lock);
+    if (worker->count > 0) object = worker->items[--worker->count];
+    UNLOCK_MUTEX(&worker->lock);
+    return object;
+}
+
+// move half of another worker's queue over, the oldest entries first
+static bool stealWork(GCWorker* thief) {
+    for (int i = 0; i < workerCount; i++) {
+        GCWorker* victim = &workers[i];
+        if (victim == thief) continue;
+
+        LOCK_MUTEX(&victim->lock);
+        int taken = (victim->count + 1) / 2;
+        if (taken == 0) {
+            UNLOCK_MUTEX(&victim->lock);
+            continue;
+        }
+
+        Obj** stolen = (Obj**)malloc(sizeof(Obj*) * taken);
+        if (stolen == NULL) exit(1);
+        memcpy(stolen, victim->items, sizeof(Obj*) * taken);
+        victim->count -= taken;
+        memmove(victim->items, victim->items + taken, sizeof(Obj*) * victim->count);
+        UNLOCK_MUTEX(&victim->lock);
+
+        for (int j = 0; j < taken; j++) pushWork(thief, stolen[j]);
+        free(stolen);
+        return true;
+    }
+
+    return false;
+}
+
+static bool anyWork() {
+    for (int i = 0; i < workerCount; i++) {
+        LOCK_MUTEX(&workers[i].lock);
+        int count = workers[i].count;
+        UNLOCK_MUTEX(&workers[i].lock);
+        if (count > 0) return true;
     }
+
+    return false;
 }
 
-static void sweep() {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        if (object->isMarked) {
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
+// Marking is over once every worker is idle: an idle worker holds no
+// gray object and only the owner of a queue ever adds to it
+static THREAD_FUNCTION(markWorker) {
+    currentWorker = (GCWorker*)arg;
+
+    for (;;) {
+        Obj* object = popWork(currentWorker);
+        if (object != NULL) {
+            blackenObject(object);
+            continue;
         }
-        else {
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
-            }
-            else {
-                vm.objects = object;
-            }
+        if (stealWork(currentWorker)) continue;
 
-            freeObject(unreached);
+        ATOMIC_ADD(&idleWorkers, 1);
+        while (ATOMIC_LOAD(&idleWorkers) < ATOMIC_LOAD(&runningWorkers) && !anyWork()) {
+            YIELD_THREAD();
         }
+        if (ATOMIC_LOAD(&idleWorkers) == ATOMIC_LOAD(&runningWorkers)) break;
+        ATOMIC_ADD(&idleWorkers, -1);
     }
+
+    currentWorker = NULL;
+    return THREAD_RETURN;
 }
 
-void collectGarbage() {
-#ifdef DEBUG_LOG_GC
-    printf("-- gc begin --\n");
-    size_t before = vm.bytesAllocated;
-#endif
+static THREAD_FUNCTION(sweepWorker);
 
-    markRoots();
-    traceReferences();
-    tableRemoveWhite(&vm.strings);
-    sweep();
+// The main thread is worker 0. Queues of workers whose thread could not
+// be started are stolen from like any other.
+static void runWorkers(bool marking) {
+    THREAD_HANDLE threads[GC_MAX_THREADS];
+    int started = 1;
+    runningWorkers = 1;
+    idleWorkers = 0;
+
+    for (; started < workerCount; started++) {
+        // counted before it starts, worker 0 is busy until this loop ends
+        ATOMIC_ADD(&runningWorkers, 1);
+        if (!START_THREAD(threads[started], marking ? markWorker : sweepWorker,
+            &workers[started])) {
+            ATOMIC_ADD(&runningWorkers, -1);
+            break;
+        }
+    }
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    if (marking) markWorker(&workers[0]);
+    else sweepWorker(&workers[0]);
 
-#ifdef DEBUG_LOG_GC
-    printf("-- gc end --\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-        before - vm.bytesAllocated, before, vm.bytesAllocated,
-        vm.nextGC);
+    for (int i = 1; i < started; i++) JOIN_THREAD(threads[i]);
+}
+
+static bool parallelGC() {
+    return vm.gcThreads > 1 && vm.bytesAllocated >= GC_PARALLEL_MIN;
+}
+
+static void startWorkers() {
+    workerCount = vm.gcThreads < GC_MAX_THREADS ? vm.gcThreads : GC_MAX_THREADS;
+    for (int i = 0; i < workerCount; i++) {
+        INIT_MUTEX(&workers[i].lock);
+        workers[i].count = 0;
+        workers[i].freed = 0;
+        workers[i].finalizerCount = 0;
+    }
+}
+
+static void stopWorkers() {
+    for (int i = 0; i < workerCount; i++) {
+        FREE_MUTEX(&workers[i].lock);
+        free(workers[i].items);
+        workers[i].items = NULL;
+        workers[i].capacity = 0;
+        free(workers[i].finalizers);
+        workers[i].finalizers = NULL;
+        workers[i].finalizerCapacity = 0;
+    }
+}
+
+// deal the gray stack out to the workers and let them trace the heap
+static void parallelTrace() {
+    startWorkers();
+
+    for (int i = 0; i < vm.grayCount; i++) {
+        pushWork(&workers[i % workerCount], vm.grayStack[i]);
+    }
+    vm.grayCount = 0;
+
+    runWorkers(true);
+    stopWorkers();
+}
+
+static void traceReferences() {
+    if (parallelGC() && vm.grayCount > 0) parallelTrace();
+
+    while (vm.grayCount > 0) {
+        Obj* object = vm.grayStack[--vm.grayCount];
+        blackenObject(object);
+    }
+}
+
+static double gcClock() {
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double)counter.QuadPart * 1000000.0 / (double)frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec * 1000000.0 + (double)now.tv_nsec / 1000.0;
 #endif
+}
+
+static void recordPause(GCPauses* pauses, double micros) {
+    pauses->total += micros;
+    if (micros > pauses->longest) pauses->longest = micros;
+    if (!vm.gcStats) {
+        pauses->count++;
+        return;
+    }
+
+    if (pauses->capacity < pauses->count + 1) {
+        pauses->capacity = GROW_CAPACITY(pauses->capacity);
+        pauses->times = (double*)realloc(pauses->times, sizeof(double) * pauses->capacity);
+
+        if (pauses->times == NULL) exit(1);
+    }
+
+    pauses->times[pauses->count++] = micros;
+}
+
+// remembered objects the sweep is about to free
+static void pruneRemembered() {
+    int kept = 0;
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        if (IS_MARKED(vm.remembered[i])) vm.remembered[kept++] = vm.remembered[i];
+    }
+    vm.rememberedCount = kept;
+}
+
+void lockHeap() {
+    LOCK_MUTEX(&heapLock);
+}
+
+void unlockHeap() {
+    UNLOCK_MUTEX(&heapLock);
+}
+
+// snapshot-at-the-beginning log, drained at the remark
+void logOverwrite(Obj* object) {
+    if (IS_YOUNG(object) || IS_MARKED(object)) return;
+
+    if (vm.satbCapacity < vm.satbCount + 1) {
+        vm.satbCapacity = GROW_CAPACITY(vm.satbCapacity);
+        vm.satbLog = (Obj**)realloc(vm.satbLog, sizeof(Obj*) * vm.satbCapacity);
+
+        if (vm.satbLog == NULL) exit(1);
+    }
+
+    vm.satbLog[vm.satbCount++] = object;
+}
+
+// a table in the middle of an incremental resize moves entries on reads,
+// which the mutator does without the lock, so it waits for the remark
+static bool tablesMoving(Obj* object) {
+    switch (object->type) {
+    case OBJ_INSTANCE: return ((ObjInstance*)object)->fields.oldControl != NULL;
+    case OBJ_CLASS: return ((ObjClass*)object)->methods.oldControl != NULL;
+    default: return false;
+    }
+}
+
+static void deferObject(Obj* object) {
+    if (vm.deferredCapacity < vm.deferredCount + 1) {
+        vm.deferredCapacity = GROW_CAPACITY(vm.deferredCapacity);
+        vm.deferred = (Obj**)realloc(vm.deferred, sizeof(Obj*) * vm.deferredCapacity);
+
+        if (vm.deferred == NULL) exit(1);
+    }
+
+    vm.deferred[vm.deferredCount++] = object;
+}
+
+// Helper thread: drains the gray stack built from the roots, taking the
+// heap lock for a batch of objects at a time
+static THREAD_FUNCTION(markerMain) {
+    for (;;) {
+        LOCK_MUTEX(&heapLock);
+        for (int work = 0; vm.grayCount > 0 && work < GC_MARKER_BATCH; work++) {
+            Obj* object = vm.grayStack[--vm.grayCount];
+            if (tablesMoving(object)) deferObject(object);
+            else blackenObject(object);
+        }
+        bool empty = vm.grayCount == 0;
+        UNLOCK_MUTEX(&heapLock);
+
+        if (empty) break;
+    }
+
+    ATOMIC_STORE(&markerDone, 1);
+    return THREAD_RETURN;
+}
+
+static void startCycle() {
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin --\n");
+#endif
+    vm.gcPhase = GC_MARK;
+    markRoots();
+}
+
+// Stop the world for the snapshot: with the nursery emptied the marker
+// only ever sees old objects, the mutator then keeps running and logs
+// every reference it overwrites
+static void startConcurrentCycle() {
+#ifdef DEBUG_LOG_GC
+    printf("-- concurrent gc begin --\n");
+#endif
+    collectYoung();
+    vm.gcPhase = GC_CONCURRENT_MARK;
+    markRoots();
+
+    ATOMIC_STORE(&markerDone, 0);
+    if (!START_THREAD(markerThread, markerMain, NULL)) {
+        // no thread, mark incrementally instead
+        vm.gcPhase = GC_MARK;
+    }
+}
+
+static void joinMarker() {
+    JOIN_THREAD(markerThread);
+
+    for (int i = 0; i < vm.satbCount; i++) markObject(vm.satbLog[i]);
+    vm.satbCount = 0;
+    for (int i = 0; i < vm.deferredCount; i++) blackenObject(vm.deferred[i]);
+    vm.deferredCount = 0;
+}
+
+// The value of a weak map entry is marked once its key is, which can mark
+// further keys, so this repeats until nothing new turns up. Weak objects
+// that survive then lose whatever is still unmarked.
+static void settleWeak() {
+    bool marked;
+    do {
+        marked = false;
+        for (int i = 0; i < weakCount; i++) {
+            if (weakObjects[i]->type != OBJ_WEAK_MAP || !IS_MARKED(weakObjects[i])) continue;
+            ObjWeakMap* map = (ObjWeakMap*)weakObjects[i];
+
+            for (int j = 0; j < map->capacity; j++) {
+                WeakEntry* entry = &map->entries[j];
+                if (entry->key == NULL || !IS_OBJ(entry->value)) continue;
+                if (!IS_MARKED(entry->key) || IS_MARKED(AS_OBJ(entry->value))) continue;
+
+                markObject(AS_OBJ(entry->value));
+                marked = true;
+            }
+        }
+        traceReferences();
+    } while (marked);
+
+    int kept = 0;
+    for (int i = 0; i < weakCount; i++) {
+        Obj* object = weakObjects[i];
+        // the sweep frees it
+        if (!IS_MARKED(object)) continue;
+        weakObjects[kept++] = object;
+
+        if (object->type == OBJ_WEAK_REF) {
+            ObjWeakRef* ref = (ObjWeakRef*)object;
+            if (ref->target != NULL && !IS_MARKED(ref->target)) ref->target = NULL;
+            continue;
+        }
+
+        ObjWeakMap* map = (ObjWeakMap*)object;
+        for (int j = 0; j < map->capacity; j++) {
+            WeakEntry* entry = &map->entries[j];
+            if (entry->key != NULL && !IS_MARKED(entry->key)) clearWeakEntry(map, entry);
+        }
+    }
+    weakCount = kept;
+}
+
+// Atomic end of marking. Incremental: promoting the nursery grays what
+// only young objects pointed to, then the roots are scanned once more.
+// Concurrent: young objects count as allocated during the cycle, the
+// remark only drains the snapshot log.
+static void finishMark() {
+    collectYoung();
+    if (vm.gcPhase == GC_CONCURRENT_MARK) joinMarker();
+    else markRoots();
+    traceReferences();
+    settleWeak();
+    tableRemoveWhite(&vm.strings);
+    pruneRemembered();
+
+    // every page waits to be swept, by allocation or by later steps
+    for (int i = 0; i < GC_SIZE_CLASSES; i++) {
+        SizeClass* sizeClass = &sizeClasses[i];
+        Page** list = &sizeClass->unswept;
+        while (*list != NULL) list = &(*list)->next;
+        *list = sizeClass->available;
+        while (*list != NULL) list = &(*list)->next;
+        *list = sizeClass->full;
+        sizeClass->available = sizeClass->full = NULL;
+    }
+    sweepClass = 0;
+    vm.gcPhase = GC_SWEEP;
+}
+
+// the next safe point that collects, never past the heap limit
+static void setStepAt(size_t bytes) {
+    if (vm.gcHeapLimit > 0 && bytes > vm.gcHeapLimit) bytes = vm.gcHeapLimit;
+    vm.gcStepAt = bytes;
+}
+
+// Objects allocated during the sweep go to pages already swept
+static bool sweepStep(double deadline) {
+    for (; sweepClass < GC_SIZE_CLASSES; sweepClass++) {
+        SizeClass* sizeClass = &sizeClasses[sweepClass];
+        while (sizeClass->unswept != NULL) {
+            Page* page = sizeClass->unswept;
+            sizeClass->unswept = page->next;
+            sweepPage(page);
+            filePage(page);
+
+            if (gcClock() > deadline) return false;
+        }
+    }
+
+    vm.gcPhase = GC_IDLE;
+    vm.gcCycles++;
+    vm.nextGC = (size_t)(vm.bytesAllocated * vm.gcGrowFactor);
+    if (vm.nextGC < vm.gcHeapMin) vm.nextGC = vm.gcHeapMin;
+    vm.nextLarge = (size_t)(vm.largeBytes * vm.gcGrowFactor);
+    if (vm.nextLarge < GC_LARGE_MIN) vm.nextLarge = GC_LARGE_MIN;
+    setStepAt(vm.nextGC);
+
+    if (vm.gcLog) {
+        fprintf(stderr, "[gc] cycle %d done, heap %zu bytes, next at %zu\n",
+            vm.gcCycles, vm.bytesAllocated, vm.nextGC);
+    }
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end --\n");
+    printf("   heap %zu bytes, next at %zu\n", vm.bytesAllocated, vm.nextGC);
+#endif
+    return true;
+}
+
+static THREAD_FUNCTION(sweepWorker) {
+    currentWorker = (GCWorker*)arg;
+
+    for (;;) {
+        long index = ATOMIC_ADD(&nextSweepPage, 1);
+        if (index >= sweepPageCount) break;
+        sweepPage(sweepPages[index]);
+    }
+
+    currentWorker = NULL;
+    return THREAD_RETURN;
+}
+
+// Sweep every page left in parallel, then file them on the main thread
+static void parallelSweep() {
+    sweepPageCount = 0;
+    int capacity = 0;
+    for (int i = 0; i < GC_SIZE_CLASSES; i++) {
+        for (Page* page = sizeClasses[i].unswept; page != NULL; page = page->next) {
+            if (capacity < sweepPageCount + 1) {
+                capacity = GROW_CAPACITY(capacity);
+                sweepPages = (Page**)realloc(sweepPages, sizeof(Page*) * capacity);
+
+                if (sweepPages == NULL) exit(1);
+            }
+
+            sweepPages[sweepPageCount++] = page;
+        }
+        sizeClasses[i].unswept = NULL;
+    }
+
+    startWorkers();
+    nextSweepPage = 0;
+    runWorkers(false);
+
+    for (int i = 0; i < sweepPageCount; i++) filePage(sweepPages[i]);
+    for (int i = 0; i < workerCount; i++) {
+        vm.bytesAllocated -= workers[i].freed;
+        vm.bytesFreed += workers[i].freed;
+        for (int j = 0; j < workers[i].finalizerCount; j++) {
+            workers[i].finalizers[j].finalize(workers[i].finalizers[j].pointer);
+        }
+    }
+    stopWorkers();
+    free(sweepPages);
+    sweepPages = NULL;
+}
+
+// Run collection work until 'micros' have passed, starting a cycle when
+// none is under way. Returns true once the cycle has finished.
+bool gcStep(double micros) {
+    double start = gcClock();
+    double deadline = start + micros;
+
+    if (vm.gcPhase == GC_IDLE) startCycle();
+    if (vm.gcPhase == GC_CONCURRENT_MARK) {
+        if (!ATOMIC_LOAD(&markerDone)) return false;
+        finishMark();
+    }
+
+    if (vm.gcPhase == GC_MARK) {
+        int work = 0;
+        while (vm.grayCount > 0) {
+            blackenObject(vm.grayStack[--vm.grayCount]);
+            if (++work % GC_STEP_CHECK == 0 && gcClock() > deadline) break;
+        }
+        if (vm.grayCount == 0) finishMark();
+    }
+
+    bool finished = false;
+    if (vm.gcPhase == GC_SWEEP) finished = sweepStep(deadline);
+
+    if (!finished) setStepAt(vm.bytesAllocated + GC_STEP_BYTES);
+    recordPause(&vm.majorPauses, gcClock() - start);
+    return finished;
+}
+
+static void finishSweep() {
+    if (parallelGC()) parallelSweep();
+    sweepStep(HUGE_VAL);
+}
+
+// Finish marking without yielding, or run a whole mark once the previous
+// cycle is swept. The pages are swept later, lazily, unless 'sweep' asks
+// for the whole cycle now.
+void collectGarbage(bool sweep) {
+    double start = gcClock();
+
+    if (vm.gcPhase == GC_SWEEP) finishSweep();
+    // a cycle under way keeps what was live when it started, so a whole
+    // collection finishes it and then runs one of its own
+    if (sweep && vm.gcPhase != GC_IDLE) {
+        if (vm.gcPhase == GC_MARK) traceReferences();
+        finishMark();
+        finishSweep();
+    }
+    if (vm.gcPhase == GC_IDLE) startCycle();
+    if (vm.gcPhase == GC_MARK) traceReferences();
+    finishMark();
+
+    if (sweep) finishSweep();
+    else setStepAt(vm.bytesAllocated + GC_STEP_BYTES);
+    recordPause(&vm.majorPauses, gcClock() - start);
+}
+
+void gcSafePoint() {
+#ifdef DEBUG_STRESS_GC
+    collectYoung();
+    collectGarbage(false);
+#else
+    if (vm.minorPending) collectYoung();
+    if (vm.bytesAllocated <= vm.gcStepAt) return;
+
+    if (vm.gcHeapLimit > 0 && vm.bytesAllocated > vm.gcHeapLimit) {
+        collectGarbage(true);
+        if (vm.bytesAllocated > vm.gcHeapLimit) {
+            fprintf(stderr, "Heap limit of %zu bytes exceeded, %zu bytes live.\n",
+                vm.gcHeapLimit, vm.bytesAllocated);
+            exit(1);
+        }
+    }
+    // the heap grew by the growth factor again before the cycle could finish marking
+    else if (vm.gcPhase != GC_SWEEP && vm.bytesAllocated > vm.nextGC * vm.gcGrowFactor) {
+        collectGarbage(false);
+    }
+    else if (vm.gcPhase == GC_IDLE && vm.gcConcurrent) {
+        double start = gcClock();
+        startConcurrentCycle();
+        // look for the marker at every safe point
+        if (vm.gcPhase == GC_CONCURRENT_MARK) vm.gcStepAt = 0;
+        else setStepAt(vm.bytesAllocated + GC_STEP_BYTES);
+        recordPause(&vm.majorPauses, gcClock() - start);
+    }
+    else {
+        gcStep(GC_STEP_MICROS);
+    }
+#endif
+}
+
+static int comparePauses(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void printPauses(const char* name, GCPauses* pauses) {
+    if (pauses->count == 0) {
+        fprintf(stderr, "%-6s no pauses\n", name);
+        return;
+    }
+
+    // without --gc-stats only the totals were kept
+    if (pauses->times == NULL) {
+        fprintf(stderr, "%-6s %d pauses, total %.0fus, max %.1fus\n",
+            name, pauses->count, pauses->total, pauses->longest);
+        return;
+    }
+
+    qsort(pauses->times, pauses->count, sizeof(double), comparePauses);
+
+#define PERCENTILE(p) pauses->times[(int)((pauses->count - 1) * (p))]
+    fprintf(stderr, "%-6s %d pauses, total %.0fus, p50 %.1fus, p90 %.1fus, p99 %.1fus, max %.1fus\n",
+        name, pauses->count, pauses->total, PERCENTILE(0.5), PERCENTILE(0.9), PERCENTILE(0.99),
+        pauses->longest);
+#undef PERCENTILE
+}
+
+// --gc-stats report, written when the VM shuts down or by gc_stats()
+void printGCStats() {
+    fprintf(stderr, "-- gc stats --\n");
+    printPauses("minor", &vm.minorPauses);
+    printPauses("major", &vm.majorPauses);
+    fprintf(stderr, "cycles %d finished\n", vm.gcCycles);
+    fprintf(stderr, "bytes  %zu allocated, %zu freed\n",
+        vm.bytesAllocated + vm.largeBytes + vm.bytesFreed, vm.bytesFreed);
+    fprintf(stderr, "heap   %zu bytes, next cycle at %zu\n", vm.bytesAllocated, vm.nextGC);
+    fprintf(stderr, "large  %zu bytes, next cycle at %zu\n", vm.largeBytes, vm.nextLarge);
+}
+
+// the heap size that starts the next cycle, and the least it is set to
+void setGCThreshold(size_t bytes) {
+    vm.gcHeapMin = bytes;
+    if (vm.gcPhase == GC_IDLE) {
+        vm.nextGC = bytes;
+        setStepAt(bytes);
+    }
+}
+
+// 0 lifts the limit
+void setGCHeapLimit(size_t bytes) {
+    vm.gcHeapLimit = bytes;
+    if (vm.gcPhase == GC_IDLE) setStepAt(vm.nextGC);
+    else if (vm.gcStepAt > 0) setStepAt(vm.gcStepAt);
+}
+
+// Options given as --gc-<name>=value or ROSE_GC_<NAME>. Byte counts may
+// end in K, M or G. False for an unknown name or a bad value.
+bool setGCOption(const char* name, int length, const char* value) {
+    char* end;
+    double number = strtod(value, &end);
+    if (end == value || number < 0) return false;
+
+    switch (*end) {
+    case 'K': case 'k': number *= 1024; end++; break;
+    case 'M': case 'm': number *= 1024 * 1024; end++; break;
+    case 'G': case 'g': number *= 1024 * 1024 * 1024; end++; break;
+    }
+    if (*end != '\0') return false;
+
+#define IS_OPTION(option) \
+    (length == (int)sizeof(option) - 1 && memcmp(name, option, length) == 0)
+    if (IS_OPTION("growth")) {
+        // a factor of 1 or less would collect at every step
+        if (number <= 1) return false;
+        vm.gcGrowFactor = number;
+    }
+    else if (IS_OPTION("heap-min")) {
+        setGCThreshold((size_t)number);
+    }
+    else if (IS_OPTION("heap-limit")) {
+        setGCHeapLimit((size_t)number);
+    }
+    else if (IS_OPTION("threads")) {
+        if (number < 1) return false;
+        vm.gcThreads = (int)number;
+    }
+    else if (IS_OPTION("log")) {
+        vm.gcLog = number != 0;
+    }
+    else {
+        return false;
+    }
+#undef IS_OPTION
+    return true;
+}
+
+void initNursery() {
+    vm.nurseryStart = (uint8_t*)malloc(GC_NURSERY_SIZE);
+    if (vm.nurseryStart == NULL) exit(1);
+
+    vm.nurseryTop = vm.nurseryStart;
+    vm.nurseryEnd = vm.nurseryStart + GC_NURSERY_SIZE;
+    vm.minorPending = false;
+    INIT_MUTEX(&heapLock);
+    INIT_MUTEX(&largeLock);
+}
+
+// NULL once the nursery is full, the caller then allocates in the old
+// space and the interpreter runs a minor collection at its next safe point
+Obj* allocateYoung(size_t size) {
+    size = YOUNG_SIZE(size);
+    if ((size_t)(vm.nurseryEnd - vm.nurseryTop) < size) {
+        vm.minorPending = true;
+        return NULL;
+    }
+
+    Obj* object = (Obj*)vm.nurseryTop;
+    vm.nurseryTop += size;
+    object->isRemembered = false;
+    return object;
+}
+
+static void appendObject(Obj*** list, int* count, int* capacity, Obj* object) {
+    if (*capacity < *count + 1) {
+        *capacity = GROW_CAPACITY(*capacity);
+        *list = (Obj**)realloc(*list, sizeof(Obj*) * *capacity);
+
+        if (*list == NULL) exit(1);
+    }
+
+    (*list)[(*count)++] = object;
+}
+
+void registerWeak(Obj* object) {
+    appendObject(&weakObjects, &weakCount, &weakCapacity, object);
+}
+
+void rememberObject(Obj* object) {
+    if (object->isRemembered || IS_YOUNG(object)) return;
+    object->isRemembered = true;
+
+    if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Obj**)realloc(vm.remembered, sizeof(Obj*) * vm.rememberedCapacity);
+
+        if (vm.remembered == NULL) exit(1);
+    }
+
+    vm.remembered[vm.rememberedCount++] = object;
+}
+
+// copy a live young object to the old space and leave its new address behind
+static Obj* promoteObject(Obj* object) {
+    size_t size = objectSize(object->type);
+    Obj* copy = allocateSlot(size);
+    memcpy(copy, object, size);
+    copy->isMarked = false;
+    copy->isRemembered = false;
+
+    if (promotedCapacity < promotedCount + 1) {
+        promotedCapacity = GROW_CAPACITY(promotedCapacity);
+        promoted = (Obj**)realloc(promoted, sizeof(Obj*) * promotedCapacity);
+
+        if (promoted == NULL) exit(1);
+    }
+    promoted[promotedCount++] = copy;
+
+    // a closed upvalue points at its own 'closed' field
+    if (object->type == OBJ_UPVALUE) {
+        ObjUpvalue* upvalue = (ObjUpvalue*)copy;
+        if (upvalue->location == &((ObjUpvalue*)object)->closed) {
+            upvalue->location = &upvalue->closed;
+        }
+    }
+
+#ifdef DEBUG_LOG_GC
+    printf("%p promote to %p\n", (void*)object, (void*)copy);
+#endif
+
+    object->isMarked = true;
+    FORWARD_ADDRESS(object) = copy;
+    return copy;
+}
+
+Obj* forwardObject(Obj* object) {
+    if (object == NULL || !IS_YOUNG(object)) return object;
+    if (object->isMarked) return FORWARD_ADDRESS(object);
+    return promoteObject(object);
+}
+
+void forwardValue(Value* value) {
+    if (IS_OBJ(*value)) value->as.obj = forwardObject(AS_OBJ(*value));
+}
+
+static void forwardArray(ValueArray* array) {
+    for (int i = 0; i < array->count; i++) {
+        forwardValue(&array->values[i]);
+    }
+}
+
+// update the references of an old object to the promoted copies
+static void scanObject(Obj* object) {
+    switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+        ObjBoundMethod* bound = (ObjBoundMethod*)object;
+        forwardValue(&bound->receiver);
+        bound->method = (ObjClosure*)forwardObject((Obj*)bound->method);
+        break;
+    }
+    case OBJ_INSTANCE: {
+        ObjInstance* instance = (ObjInstance*)object;
+        forwardTable(&instance->fields);
+        break;
+    }
+    case OBJ_CLASS: {
+        ObjClass* klass = (ObjClass*)object;
+        klass->name = (ObjString*)forwardObject((Obj*)klass->name);
+        forwardTable(&klass->methods);
+        break;
+    }
+    case OBJ_CLOSURE: {
+        ObjClosure* closure = (ObjClosure*)object;
+        for (int i = 0; i < closure->upvalueCount; i++) {
+            closure->upvalues[i] = (ObjUpvalue*)forwardObject((Obj*)closure->upvalues[i]);
+        }
+        break;
+    }
+    case OBJ_FUNCTION: {
+        ObjFunction* function = (ObjFunction*)object;
+        function->name = (ObjString*)forwardObject((Obj*)function->name);
+        forwardArray(&function->chunk.constants);
+        break;
+    }
+    case OBJ_UPVALUE:
+        forwardValue(&((ObjUpvalue*)object)->closed);
+        break;
+    case OBJ_ARRAY:
+        forwardArray(&((ObjArray*)object)->values);
+        break;
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+    case OBJ_FOREIGN:
+        break;
+    case OBJ_WEAK_REF:
+    case OBJ_WEAK_MAP:
+        // seen to once every strong reference is copied
+        appendObject(&youngWeak, &youngWeakCount, &youngWeakCapacity, object);
+        break;
+    }
+}
+
+// Scan the copies until no new ones appear, while marking they are
+// gray for the major cycle as well, or black when the cycle is
+// concurrent since they were not in its snapshot
+static void scanPromoted(bool concurrent) {
+    while (promotedCount > 0) {
+        Obj* object = promoted[--promotedCount];
+        scanObject(object);
+        if (vm.gcPhase == GC_MARK) markObject(object);
+        else if (concurrent) setMark(object);
+    }
+}
+
+static bool survivesMinor(Obj* object) {
+    return !IS_YOUNG(object) || object->isMarked;
+}
+
+// a young value is copied when its key survives, true if any was
+static bool copyEphemerons() {
+    bool copied = false;
+    for (int i = 0; i < youngWeakCount; i++) {
+        if (youngWeak[i]->type != OBJ_WEAK_MAP) continue;
+        ObjWeakMap* map = (ObjWeakMap*)youngWeak[i];
+
+        for (int j = 0; j < map->capacity; j++) {
+            WeakEntry* entry = &map->entries[j];
+            if (entry->key == NULL || !IS_OBJ(entry->value)) continue;
+            if (survivesMinor(AS_OBJ(entry->value)) || !survivesMinor(entry->key)) continue;
+
+            forwardValue(&entry->value);
+            copied = true;
+        }
+    }
+    return copied;
+}
+
+// repoint what was copied and clear what was left in the nursery
+static void clearYoungWeak() {
+    for (int i = 0; i < youngWeakCount; i++) {
+        if (youngWeak[i]->type == OBJ_WEAK_REF) {
+            ObjWeakRef* ref = (ObjWeakRef*)youngWeak[i];
+            if (ref->target != NULL && IS_YOUNG(ref->target)) {
+                ref->target = ref->target->isMarked ? FORWARD_ADDRESS(ref->target) : NULL;
+            }
+            continue;
+        }
+
+        ObjWeakMap* map = (ObjWeakMap*)youngWeak[i];
+        bool moved = false;
+        for (int j = 0; j < map->capacity; j++) {
+            WeakEntry* entry = &map->entries[j];
+            if (entry->key == NULL) continue;
+
+            if (!survivesMinor(entry->key)) {
+                clearWeakEntry(map, entry);
+                continue;
+            }
+            if (IS_YOUNG(entry->key)) {
+                entry->key = FORWARD_ADDRESS(entry->key);
+                moved = true;
+            }
+            // the value was copied along with its key
+            forwardValue(&entry->value);
+        }
+
+        // keys hash on their address
+        if (moved) rehashWeakMap(map);
+    }
+    youngWeakCount = 0;
+}
+
+// Minor collection: copy everything reachable from the roots and the
+// remembered set out of the nursery, then reuse the whole nursery.
+// Only called between instructions, so no C local holds a young object.
+void collectYoung() {
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin --\n");
+    size_t before = vm.bytesAllocated;
+#endif
+    double start = gcClock();
+    // the marker thread reads the old objects this rewrites
+    bool concurrent = vm.gcPhase == GC_CONCURRENT_MARK;
+    if (concurrent) lockHeap();
+
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        forwardValue(slot);
+    }
+
+    for (int i = 0; i < vm.frameCount; i++) {
+        vm.frames[i].closure = (ObjClosure*)forwardObject((Obj*)vm.frames[i].closure);
+    }
+
+    // open upvalues link to each other outside of any barrier
+    for (ObjUpvalue** upvalue = &vm.openUpvalues;
+        *upvalue != NULL;
+        upvalue = &(*upvalue)->next) {
+        *upvalue = (ObjUpvalue*)forwardObject((Obj*)*upvalue);
+    }
+
+    forwardTable(&vm.globals);
+    vm.initString = (ObjString*)forwardObject((Obj*)vm.initString);
+    vm.destString = (ObjString*)forwardObject((Obj*)vm.destString);
+    for (int i = 0; i < vm.nativeCount; i++) {
+        vm.natives[i].name = (ObjString*)forwardObject((Obj*)vm.natives[i].name);
+    }
+
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        vm.remembered[i]->isRemembered = false;
+        scanObject(vm.remembered[i]);
+    }
+    vm.rememberedCount = 0;
+
+    scanPromoted(concurrent);
+    // values of weak maps are only copied for keys that survive, which
+    // can copy more keys in turn
+    while (copyEphemerons()) scanPromoted(concurrent);
+    clearYoungWeak();
+
+    // the string table is weak: repoint promoted keys, drop dead ones
+    for (uint8_t* young = vm.nurseryStart; young < vm.nurseryTop;) {
+        Obj* object = (Obj*)young;
+        young += YOUNG_SIZE(objectSize(object->type));
+
+        if (object->isMarked) {
+            if (object->type == OBJ_STRING) {
+                tableReplaceKey(&vm.strings, (ObjString*)object, (ObjString*)FORWARD_ADDRESS(object));
+            }
+        }
+        else {
+            if (object->type == OBJ_STRING) {
+                tableReplaceKey(&vm.strings, (ObjString*)object, NULL);
+            }
+            releaseObject(object);
+        }
+    }
+
+#ifdef DEBUG_STRESS_GC
+    // stale young pointers now read garbage instead of the old object
+    memset(vm.nurseryStart, 0xDB, vm.nurseryTop - vm.nurseryStart);
+#endif
+    vm.nurseryTop = vm.nurseryStart;
+    vm.minorPending = false;
+    if (concurrent) unlockHeap();
+    double micros = gcClock() - start;
+    recordPause(&vm.minorPauses, micros);
+
+    if (vm.gcLog) {
+        fprintf(stderr, "[gc] minor %d took %.1fus, old space %zu bytes\n",
+            vm.minorPauses.count, micros, vm.bytesAllocated);
+    }
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end --\n");
+    printf("   old space %zu -> %zu bytes\n", before, vm.bytesAllocated);
+#endif
+}
+
+// An old allocation made while marking starts out gray, it is scanned at
+// a later step, once the caller has filled it in. Concurrent marking
+// leaves it black, it is not part of the snapshot.
+Obj* allocateOld(size_t size) {
+    Obj* object = allocateSlot(size);
+
+    // it is filled in with young objects before any barrier sees it
+    object->isRemembered = false;
+    rememberObject(object);
+
+    object->isMarked = false;
+    if (vm.gcPhase == GC_MARK || vm.gcPhase == GC_CONCURRENT_MARK) setMark(object);
+    if (vm.gcPhase == GC_MARK) pushGray(object);
+    return object;
+}
+
+// the object's references changed wholesale
+void rescanObject(Obj* object) {
+    rememberObject(object);
+    if (vm.gcPhase == GC_MARK && IS_MARKED(object)) pushGray(object);
 }
\ No newline at end of file
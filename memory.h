@@ -19,11 +19,95 @@
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+// Young generation: strings, closures, upvalues, instances, bound methods
+// and arrays are bump allocated in the nursery, survivors are copied to
+// the old space by collectYoung at the next safe point of the interpreter
+#define GC_NURSERY_SIZE (512 * 1024)
+
+// users need vm.h
+#define IS_YOUNG(object) \
+    ((uint8_t*)(object) >= vm.nurseryStart && (uint8_t*)(object) < vm.nurseryEnd)
+
+// Old objects live in pages of equal sized slots, one size class per page,
+// and keep their mark and allocation bits on the side, one per 8 byte
+// granule. There is no list of objects, a sweep walks the bitmaps.
+#define GC_PAGE_SIZE (64 * 1024)
+#define GC_GRANULE 8
+#define GC_SIZE_CLASSES 32
+
+typedef struct Page {
+    // next page on its size class's list
+    struct Page* next;
+    struct FreeSlot* free;
+    int sizeClass;
+    int liveCount;
+    uint8_t marks[GC_PAGE_SIZE / GC_GRANULE / 8];
+    uint8_t live[GC_PAGE_SIZE / GC_GRANULE / 8];
+} Page;
+
+#define PAGE_OF(object) \
+    ((Page*)((uintptr_t)(object) & ~(uintptr_t)(GC_PAGE_SIZE - 1)))
+#define GRANULE_OF(object) \
+    (((uintptr_t)(object) & (GC_PAGE_SIZE - 1)) / GC_GRANULE)
+#define MARK_BYTE(object) (&PAGE_OF(object)->marks[GRANULE_OF(object) / 8])
+#define MARK_MASK(object) ((uint8_t)(1 << (GRANULE_OF(object) % 8)))
+
+// a young object is marked in its header once a minor collection copied it
+#define IS_MARKED(object) \
+    (IS_YOUNG(object) ? ((Obj*)(object))->isMarked : \
+    (*MARK_BYTE(object) & MARK_MASK(object)) != 0)
+
+// Every store of a value into an object goes through here: old objects
+// pointing into the nursery are remembered for the next minor collection,
+// and while a major cycle marks, a marked owner shades what it is given
+#define WRITE_BARRIER(owner, value) \
+    do { \
+        if (IS_OBJ(value)) { \
+            if (IS_YOUNG(AS_OBJ(value))) \
+                rememberObject((Obj*)(owner)); \
+            else if (vm.gcPhase == GC_MARK && IS_MARKED((Obj*)(owner))) \
+                markObject(AS_OBJ(value)); \
+        } \
+    } while (false)
+
+// Concurrent marking works on a snapshot of the heap taken when the cycle
+// starts: a reference about to be overwritten in an old object is logged,
+// with the heap locked, so the marker still reaches what it pointed to
+#define SATB_BARRIER(value) \
+    do { \
+        if (vm.gcPhase == GC_CONCURRENT_MARK && IS_OBJ(value)) \
+            logOverwrite(AS_OBJ(value)); \
+    } while (false)
+
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 void markValue(Value value);
 void markObject(Obj* object);
-void collectGarbage();
+void collectGarbage(bool sweep);
 void freeObjects();
 
+bool gcStep(double micros);
+void gcSafePoint();
+void printGCStats();
+void setGCThreshold(size_t bytes);
+void setGCHeapLimit(size_t bytes);
+bool setGCOption(const char* name, int length, const char* value);
+
+void initNursery();
+Obj* allocateYoung(size_t size);
+Obj* allocateOld(size_t size);
+void rememberObject(Obj* object);
+void registerWeak(Obj* object);
+void rescanObject(Obj* object);
+void lockHeap();
+void unlockHeap();
+void logOverwrite(Obj* object);
+Obj* forwardObject(Obj* object);
+void forwardValue(Value* value);
+void collectYoung();
+
+// every object with the bytes its slot takes, for heap snapshots
+typedef void (*HeapVisitor)(Obj* object, size_t size, void* context);
+void walkHeap(HeapVisitor visit, void* context);
+
 #endif
\ No newline at end of file
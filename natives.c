@@ -9,9 +9,11 @@
 #include "libraries/system/system.h"
 #include "libraries/math/math.h"
 #include "libraries/string/string.h"
+#include "libraries/gc/gc.h"
 #include "libraries/sdl/sdl.h"
 #include "libraries/sfml/sfml.h"
 #include "array.h"
+#include "weak.h"
 
 
 // Load Libraries
@@ -24,6 +26,8 @@ void DefineNativeFunctions() {
 	LoadMath();
 	// String
 	LoadString();
+	// Garbage collector
+	LoadGC();
 	// SDL
 	//LoadSDL();
 	//SFML
@@ -31,5 +35,6 @@ void DefineNativeFunctions() {
 	//LoadArrays();
 	//LoadTables();
 	LoadArray();
+	LoadWeak();
 	LoadDLL();
 }
\ No newline at end of file
@@ -1,5 +1,8 @@
 #include <stdio.h>
 #include <string.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #include "memory.h"
 #include "object.h"
@@ -11,12 +14,23 @@
     (type*)allocateObject(sizeof(type), objectType)
 
 static Obj* allocateObject(size_t size, ObjType type) {
-	Obj* object = (Obj*)reallocate(NULL, 0, size);
-	object->type = type;
-	object->isMarked = false;
+	Obj* object = NULL;
+
+	// functions, classes and natives live as long as the program, weak
+	// objects stay put so the collector can list them
+	if (type != OBJ_FUNCTION && type != OBJ_CLASS && type != OBJ_NATIVE &&
+		type != OBJ_WEAK_REF && type != OBJ_WEAK_MAP) {
+		object = allocateYoung(size);
+	}
+
+	if (object == NULL) {
+		object = allocateOld(size);
+	}
+	else {
+		object->isMarked = false;
+	}
 
-	object->next = vm.objects;
-	vm.objects = object;
+	object->type = type;
 
 #ifdef DEBUG_LOG_GC
 	printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -25,6 +39,40 @@ static Obj* allocateObject(size_t size, ObjType type) {
 	return object;
 }
 
+ObjArray* newArray() {
+	ObjArray* array = ALLOCATE_OBJ(ObjArray, OBJ_ARRAY);
+	initValueArray(&array->values);
+	return array;
+}
+
+ObjWeakRef* newWeakRef(Obj* target) {
+	ObjWeakRef* ref = ALLOCATE_OBJ(ObjWeakRef, OBJ_WEAK_REF);
+	ref->target = target;
+	registerWeak((Obj*)ref);
+	return ref;
+}
+
+ObjWeakMap* newWeakMap() {
+	ObjWeakMap* map = ALLOCATE_OBJ(ObjWeakMap, OBJ_WEAK_MAP);
+	map->count = 0;
+	map->tombstones = 0;
+	map->capacity = 0;
+	map->entries = NULL;
+	registerWeak((Obj*)map);
+	return map;
+}
+
+ObjForeign* newForeign(const char* tag, void* pointer, size_t externalSize,
+	ForeignFinalizer finalize) {
+	ObjForeign* foreign = ALLOCATE_OBJ(ObjForeign, OBJ_FOREIGN);
+	foreign->tag = tag;
+	foreign->pointer = pointer;
+	foreign->finalize = finalize;
+	foreign->externalSize = externalSize;
+	vm.bytesAllocated += externalSize;
+	return foreign;
+}
+
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
 	ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
 	bound->receiver = receiver;
@@ -44,6 +92,10 @@ ObjFunction* newFunction() {
 	function->arity = 0;
 	function->name = NULL;
 	function->upvalueCount = 0;
+	function->calls = 0;
+	function->baselineCode = NULL;
+	function->baselineCapacity = 0;
+	function->numberArgs = 0;
 	initChunk(&function->chunk);
 	return function;
 }
@@ -88,14 +140,108 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash) {
 	return string;
 }
 
-// Algorithm: FNV-1a
-static uint32_t hashString(const char* key, int length) {
-	uint32_t hash = 2166136261u;
-	for (int i = 0; i < length; i++) {
-		hash ^= (uint8_t)key[i];
-		hash *= 16777619;
+// Algorithm: wyhash style, consumes 8 to 48 bytes per round instead of one
+static const uint64_t hashSecret[4] = {
+	0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+	0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+// 64x64 -> 128 bit multiply, low half in a and high half in b
+static inline void hashMum(uint64_t* a, uint64_t* b) {
+#if defined(__SIZEOF_INT128__)
+	__uint128_t r = (__uint128_t)*a * *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	*a = _umul128(*a, *b, b);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32);
+	uint64_t c = t < rl;
+	uint64_t lo = t + (rm1 << 32);
+	c += lo < t;
+	*a = lo;
+	*b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t hashMix(uint64_t a, uint64_t b) {
+	hashMum(&a, &b);
+	return a ^ b;
+}
+
+static inline uint64_t read64(const uint8_t* p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t read32(const uint8_t* p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+uint32_t hashString(const char* key, int length) {
+	const uint8_t* p = (const uint8_t*)key;
+	size_t i = (size_t)length;
+	uint64_t seed = hashMix(hashSecret[0], hashSecret[1]);
+	uint64_t a, b;
+
+	if (i <= 16) {
+		if (i >= 4) {
+			// two overlapping 32 bit reads from each end cover 4..16 bytes
+			size_t shift = (i >> 3) << 2;
+			a = (read32(p) << 32) | read32(p + shift);
+			b = (read32(p + i - 4) << 32) | read32(p + i - 4 - shift);
+		}
+		else if (i > 0) {
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[i >> 1] << 8) | p[i - 1];
+			b = 0;
+		}
+		else {
+			a = b = 0;
+		}
+	}
+	else {
+		if (i > 48) {
+			// three independent lanes keep the multipliers busy on long strings
+			uint64_t see1 = seed, see2 = seed;
+			do {
+				seed = hashMix(read64(p) ^ hashSecret[1], read64(p + 8) ^ seed);
+				see1 = hashMix(read64(p + 16) ^ hashSecret[2], read64(p + 24) ^ see1);
+				see2 = hashMix(read64(p + 32) ^ hashSecret[3], read64(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16) {
+			seed = hashMix(read64(p) ^ hashSecret[1], read64(p + 8) ^ seed);
+			p += 16;
+			i -= 16;
+		}
+		a = read64(p + i - 16);
+		b = read64(p + i - 8);
 	}
-	return hash;
+
+	a ^= hashSecret[1];
+	b ^= seed;
+	hashMum(&a, &b);
+	uint64_t hash = hashMix(a ^ hashSecret[0] ^ (uint64_t)length, b ^ hashSecret[1]);
+	return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// The string table is weak, a string found in it while the marker thread
+// runs may be one the snapshot no longer reaches
+static ObjString* reviveString(ObjString* string) {
+	if (vm.gcPhase == GC_CONCURRENT_MARK) {
+		lockHeap();
+		SATB_BARRIER(OBJ_VAL(string));
+		unlockHeap();
+	}
+	return string;
 }
 
 ObjString* copyString(const char* chars, int length) {
@@ -103,7 +249,7 @@ ObjString* copyString(const char* chars, int length) {
 
 	// return if duplicated
 	ObjString* interned = tableFindString(&vm.strings, chars, length,hash);
-	if (interned != NULL) return interned;
+	if (interned != NULL) return reviveString(interned);
 
 	char* heapChars = ALLOCATE(char, length + 1);
 	memcpy(heapChars, chars, length);
@@ -127,7 +273,7 @@ ObjString* takeString(char* chars, int length, bool canDelete) {
 	if (interned != NULL) {
 		if(canDelete)
 			FREE_ARRAY(char, chars, length + 1);
-		return interned;
+		return reviveString(interned);
 	}
 
 	return allocateString(chars, length, hash);
@@ -159,6 +305,9 @@ void printObject(Value value) {
 	case OBJ_NATIVE:
 		printf("<native fn>");
 		break;
+	case OBJ_ARRAY:
+		printf("<array>");
+		break;
 	case OBJ_CLOSURE:
 		printFunction(AS_CLOSURE(value)->function);
 		break;
@@ -168,5 +317,14 @@ void printObject(Value value) {
 	case OBJ_BOUND_METHOD:
 		printFunction(AS_BOUND_METHOD(value)->method->function);
 		break;
+	case OBJ_WEAK_REF:
+		printf("<weakref>");
+		break;
+	case OBJ_WEAK_MAP:
+		printf("<weakmap>");
+		break;
+	case OBJ_FOREIGN:
+		printf("<foreign %s>", AS_FOREIGN(value)->tag);
+		break;
 	}
 }
\ No newline at end of file
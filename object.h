@@ -16,6 +16,9 @@
 #define AS_NATIVE(value)       (((ObjNative*)AS_OBJ(value))->function)
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
+#define AS_WEAK_REF(value)     ((ObjWeakRef*)AS_OBJ(value))
+#define AS_WEAK_MAP(value)     ((ObjWeakMap*)AS_OBJ(value))
+#define AS_FOREIGN(value)      ((ObjForeign*)AS_OBJ(value))
 
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
 #define IS_INSTANCE(value)     isObjType(value, OBJ_INSTANCE)
@@ -25,6 +28,9 @@
 #define IS_FUNCTION(value)     isObjType(value, OBJ_FUNCTION)
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
 #define IS_ARRAY(value)        isObjType(value, OBJ_ARRAY)
+#define IS_WEAK_REF(value)     isObjType(value, OBJ_WEAK_REF)
+#define IS_WEAK_MAP(value)     isObjType(value, OBJ_WEAK_MAP)
+#define IS_FOREIGN(value)      isObjType(value, OBJ_FOREIGN)
 
 typedef enum {
 	OBJ_STRING,
@@ -35,29 +41,36 @@ typedef enum {
 	OBJ_UPVALUE,
 	OBJ_CLASS,
 	OBJ_INSTANCE,
-	OBJ_BOUND_METHOD
+	OBJ_BOUND_METHOD,
+	OBJ_WEAK_REF,
+	OBJ_WEAK_MAP,
+	OBJ_FOREIGN
 } ObjType;
 
+// Three bytes with no alignment of their own, so an object's first 4 byte
+// field shares the header word. Objects are at least 16 bytes, the minor
+// collection keeps the new address of a moved one in its second word.
 struct Obj {
-	ObjType type;
+	uint8_t type;
+	// young objects only: copied by the minor collection, old objects
+	// keep their mark bit in their page
 	bool isMarked;
-	struct Obj* next;
+	// old object listed in vm.remembered, may point into the nursery
+	bool isRemembered;
 };
 
 // Arrays
-struct ObjArray
-{
+typedef struct {
 	Obj obj;
-	ObjString* name;
-	int length;
-	ValueArray* val_array;
-};
+	ValueArray values;
+} ObjArray;
 /////////
 
 struct ObjString {
 	Obj obj;
 	int length;
 	char* chars;
+	// past the forwarding word, the string table rehashes moved keys
 	uint32_t hash;
 };
 
@@ -74,13 +87,20 @@ typedef struct {
 	int upvalueCount;
 	Chunk chunk;
 	ObjString* name;
+	// calls so far, counted until the tier rebuilds it
+	int calls;
+	// code it ran before that, kept for frames still in it and for calls
+	// whose arguments are not the numbers 'numberArgs' expects
+	uint8_t* baselineCode;
+	int baselineCapacity;
+	uint32_t numberArgs;
 } ObjFunction;
 
 typedef struct {
 	Obj obj;
+	int upvalueCount;
 	ObjFunction* function;
 	ObjUpvalue** upvalues;
-	int upvalueCount;
 } ObjClosure;
 
 typedef struct {
@@ -101,6 +121,42 @@ typedef struct {
 	ObjClosure* method;
 } ObjBoundMethod;
 
+// Weak objects, see weak.c. The collector clears what only they reach.
+typedef struct {
+	Obj obj;
+	Obj* target;
+} ObjWeakRef;
+
+// an ephemeron: 'value' is kept alive by the map only while 'key' is
+typedef struct {
+	Obj* key;
+	Value value;
+} WeakEntry;
+
+// hashed on key identity, a deleted entry has no key and a true value
+typedef struct {
+	Obj obj;
+	int count;
+	int tombstones;
+	int capacity;
+	WeakEntry* entries;
+} ObjWeakMap;
+
+// Foreign objects hold memory or a handle the VM did not allocate, such
+// as a loaded library. The finalizer runs on the main thread once the
+// object is collected and must not call back into the VM. 'externalSize'
+// is what the pointer holds on to, counted in the heap so the collector
+// knows about it.
+typedef void (*ForeignFinalizer)(void* pointer);
+
+typedef struct {
+	Obj obj;
+	// one static string per kind of pointer, compared by address
+	const char* tag;
+	void* pointer;
+	ForeignFinalizer finalize;
+	size_t externalSize;
+} ObjForeign;
 
 ObjClosure* newClosure(ObjFunction* function);
 
@@ -112,10 +168,22 @@ typedef struct {
 } ObjNative;
 
 // strings
+uint32_t hashString(const char* key, int length);
 ObjString* takeString(char* chars, int length, bool canDelete);
 ObjString* copyString(const char* chars, int length);
 ObjUpvalue* newUpvalue(Value* slot);
 
+// arrays
+ObjArray* newArray();
+
+// weak objects
+ObjWeakRef* newWeakRef(Obj* target);
+ObjWeakMap* newWeakMap();
+
+// foreign objects
+ObjForeign* newForeign(const char* tag, void* pointer, size_t externalSize,
+	ForeignFinalizer finalize);
+
 // OOP
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 ObjClass* newClass(ObjString* name);
@@ -131,4 +199,8 @@ static inline bool isObjType(Value value, ObjType type) {
 	return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+static inline bool isForeign(Value value, const char* tag) {
+	return IS_FOREIGN(value) && AS_FOREIGN(value)->tag == tag;
+}
+
 #endif
\ No newline at end of file
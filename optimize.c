@@ -0,0 +1,353 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "optimize.h"
+#include "object.h"
+#include "memory.h"
+
+// The code decoded one entry per instruction. Jumps point at the entry
+// they land on, so entries can be dropped and the rest laid out again; a
+// dropped entry hands control on to the next one still there. OP_LOOP is
+// decoded as a backward OP_JUMP and written back by direction. The
+// counted loop instructions also land somewhere, but are left alone.
+typedef struct {
+    int offset;
+    int length;
+    uint8_t op;
+    int target;
+    // jumps landing here, fixed up as they are moved or dropped
+    int jumpsIn;
+    bool removed;
+    bool reached;
+} Instruction;
+
+typedef struct {
+    Chunk* chunk;
+    // 'count' instructions and an entry for the end of the code
+    Instruction* code;
+    int count;
+    bool changed;
+} Pass;
+
+static int readIndex(uint8_t* operand) {
+    return operand[0] | (operand[1] << 8) | (operand[2] << 16) | (operand[3] << 24);
+}
+
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_POP_JUMP_IF_FALSE;
+}
+
+static bool isCountedLoop(uint8_t op) {
+    return op == OP_FOR_PREP || op == OP_FOR_LOOP;
+}
+
+static bool hasTarget(uint8_t op) {
+    return isJump(op) || isCountedLoop(op);
+}
+
+static bool fallsThrough(uint8_t op) {
+    return op != OP_JUMP && op != OP_RETURN;
+}
+
+static bool isFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// the entry control gets to at 'index'
+static int live(Pass* pass, int index) {
+    while (pass->code[index].removed) index++;
+    return index;
+}
+
+static int nextLive(Pass* pass, int index) {
+    return live(pass, index + 1);
+}
+
+static int previousLive(Pass* pass, int index) {
+    do index--; while (index >= 0 && pass->code[index].removed);
+    return index;
+}
+
+static bool fallsInto(Pass* pass, int index) {
+    int previous = previousLive(pass, index);
+    return previous != -1 && fallsThrough(pass->code[previous].op);
+}
+
+// the jump at 'index' falls through only when the value it tested was
+// truthy, and nothing else gets here
+static bool knownTruthy(Pass* pass, int index) {
+    int previous = previousLive(pass, index);
+    return pass->code[index].jumpsIn == 0 && previous != -1 &&
+        pass->code[previous].op == OP_JUMP_IF_FALSE;
+}
+
+// the value a constant push leaves on the stack
+static bool pushedConstant(Pass* pass, int index, Value* value) {
+    Instruction* ins = &pass->code[index];
+    switch (ins->op) {
+    case OP_NIL: *value = NIL_VAL; return true;
+    case OP_TRUE: *value = BOOL_VAL(true); return true;
+    case OP_FALSE: *value = BOOL_VAL(false); return true;
+    case OP_CONSTANT_LONG:
+        *value = pass->chunk->constants.values[readIndex(&pass->chunk->code[ins->offset + 1])];
+        return true;
+    default:
+        return false;
+    }
+}
+
+// a push nothing else sees when it is popped right away
+static bool isPurePush(Pass* pass, int index) {
+    Value value;
+    uint8_t op = pass->code[index].op;
+    return op == OP_GET_LOCAL || op == OP_GET_UPVALUE || pushedConstant(pass, index, &value);
+}
+
+static void drop(Pass* pass, int index) {
+    Instruction* ins = &pass->code[index];
+    if (hasTarget(ins->op)) pass->code[live(pass, ins->target)].jumpsIn--;
+    ins->removed = true;
+    pass->code[live(pass, index)].jumpsIn += ins->jumpsIn;
+    ins->jumpsIn = 0;
+    pass->changed = true;
+}
+
+static void retarget(Pass* pass, int index, int target) {
+    Instruction* ins = &pass->code[index];
+    pass->code[live(pass, ins->target)].jumpsIn--;
+    pass->code[target].jumpsIn++;
+    ins->target = target;
+    pass->changed = true;
+}
+
+// jumps only turn into other jumps or one byte instructions
+static void setOp(Pass* pass, int index, uint8_t op) {
+    Instruction* ins = &pass->code[index];
+    if (isJump(ins->op) && !isJump(op)) pass->code[live(pass, ins->target)].jumpsIn--;
+    ins->op = op;
+    ins->length = isJump(op) ? 3 : 1;
+    pass->changed = true;
+}
+
+static void dropUnreachable(Pass* pass) {
+    int* stack = ALLOCATE(int, 2 * (pass->count + 1));
+    int top = 0;
+
+    for (int i = 0; i < pass->count; i++) pass->code[i].reached = false;
+    stack[top++] = live(pass, 0);
+
+    while (top > 0) {
+        int index = stack[--top];
+        Instruction* ins = &pass->code[index];
+        if (index == pass->count || ins->reached) continue;
+
+        ins->reached = true;
+        if (hasTarget(ins->op)) stack[top++] = live(pass, ins->target);
+        if (fallsThrough(ins->op)) stack[top++] = nextLive(pass, index);
+    }
+    FREE_ARRAY(int, stack, 2 * (pass->count + 1));
+
+    for (int i = 0; i < pass->count; i++) {
+        if (!pass->code[i].removed && !pass->code[i].reached) drop(pass, i);
+    }
+}
+
+// Follow the jump at 'index' through the jumps it lands on, as far as
+// the value it tested decides them. Conditional jumps stay forward.
+static void thread(Pass* pass, int index) {
+    Instruction* ins = &pass->code[index];
+    int target = live(pass, ins->target);
+
+    for (int hops = 0; hops < 16 && target != pass->count; hops++) {
+        Instruction* to = &pass->code[target];
+        int next;
+        if (to->op == OP_JUMP) {
+            next = live(pass, to->target);
+        }
+        else if (to->op == OP_JUMP_IF_FALSE && ins->op == OP_JUMP_IF_FALSE) {
+            next = live(pass, to->target);
+        }
+        else if (to->op == OP_JUMP_IF_FALSE && ins->op == OP_JUMP && knownTruthy(pass, index)) {
+            next = nextLive(pass, target);
+        }
+        else {
+            break;
+        }
+
+        if (next == target || (ins->op != OP_JUMP && next <= index)) break;
+        target = next;
+    }
+
+    if (target != live(pass, ins->target)) retarget(pass, index, target);
+}
+
+static void simplify(Pass* pass, int index) {
+    Instruction* ins = &pass->code[index];
+    int previous = previousLive(pass, index);
+    Value value;
+
+    switch (ins->op) {
+    case OP_JUMP: {
+        thread(pass, index);
+        int target = live(pass, ins->target);
+        if (target == nextLive(pass, index)) drop(pass, index);
+        else if (target != pass->count && pass->code[target].op == OP_RETURN) setOp(pass, index, OP_RETURN);
+        break;
+    }
+    case OP_JUMP_IF_FALSE: {
+        if (ins->jumpsIn == 0 && previous != -1 && pushedConstant(pass, previous, &value)) {
+            if (isFalsey(value)) setOp(pass, index, OP_JUMP);
+            else drop(pass, index);
+            break;
+        }
+
+        thread(pass, index);
+        int target = live(pass, ins->target);
+        int next = nextLive(pass, index);
+        if (target == next) {
+            drop(pass, index);
+            break;
+        }
+
+        // the pops on both ways out of a condition go into the jump
+        if (next != pass->count && pass->code[next].op == OP_POP && pass->code[next].jumpsIn == 0 &&
+            target != pass->count && pass->code[target].op == OP_POP &&
+            pass->code[target].jumpsIn == 1 && !fallsInto(pass, target)) {
+            setOp(pass, index, OP_POP_JUMP_IF_FALSE);
+            drop(pass, next);
+            drop(pass, target);
+        }
+        break;
+    }
+    case OP_POP_JUMP_IF_FALSE:
+        if (ins->jumpsIn == 0 && previous != -1 && pushedConstant(pass, previous, &value)) {
+            drop(pass, previous);
+            if (isFalsey(value)) setOp(pass, index, OP_JUMP);
+            else drop(pass, index);
+            break;
+        }
+
+        thread(pass, index);
+        if (live(pass, ins->target) == nextLive(pass, index)) setOp(pass, index, OP_POP);
+        break;
+    case OP_POP:
+        if (ins->jumpsIn == 0 && previous != -1 && isPurePush(pass, previous)) {
+            drop(pass, previous);
+            drop(pass, index);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// write the instructions left back into the chunk
+static bool layOut(Pass* pass) {
+    Chunk* chunk = pass->chunk;
+    int* offsets = ALLOCATE(int, pass->count + 1);
+    int size = 0;
+    for (int i = 0; i < pass->count; i++) {
+        offsets[i] = size;
+        if (!pass->code[i].removed) size += pass->code[i].length;
+    }
+    offsets[pass->count] = size;
+
+    uint8_t* code = ALLOCATE(uint8_t, size);
+    bool fits = true;
+    for (int i = 0; i < pass->count && fits; i++) {
+        Instruction* ins = &pass->code[i];
+        if (ins->removed) continue;
+
+        uint8_t* at = &code[offsets[i]];
+        at[0] = ins->op;
+        if (isCountedLoop(ins->op)) {
+            // the operands stay, the jump is the last two bytes
+            memcpy(at + 1, &chunk->code[ins->offset + 1], ins->length - 3);
+            int distance = offsets[live(pass, ins->target)] - (offsets[i] + ins->length);
+            if (ins->op == OP_FOR_LOOP) distance = -distance;
+            fits = distance >= 0 && distance <= UINT16_MAX;
+            at[ins->length - 2] = (distance >> 8) & 0xff;
+            at[ins->length - 1] = distance & 0xff;
+        }
+        else if (isJump(ins->op)) {
+            int distance = offsets[live(pass, ins->target)] - (offsets[i] + 3);
+            if (distance < 0) {
+                at[0] = OP_LOOP;
+                distance = -distance;
+            }
+            fits = distance <= UINT16_MAX;
+            at[1] = (distance >> 8) & 0xff;
+            at[2] = distance & 0xff;
+        }
+        else {
+            memcpy(at + 1, &chunk->code[ins->offset + 1], ins->length - 1);
+        }
+    }
+    FREE_ARRAY(int, offsets, pass->count + 1);
+
+    if (!fits) {
+        FREE_ARRAY(uint8_t, code, size);
+        return false;
+    }
+
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    chunk->code = code;
+    chunk->count = size;
+    chunk->capacity = size;
+    return true;
+}
+
+void optimizeChunk(Chunk* chunk) {
+    int count = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) count++;
+    if (count == 0) return;
+
+    Instruction* code = ALLOCATE(Instruction, count + 1);
+    int* entryAt = ALLOCATE(int, chunk->count + 1);
+    for (int offset = 0, i = 0; offset < chunk->count; i++) {
+        Instruction* ins = &code[i];
+        ins->offset = offset;
+        ins->length = instructionLength(chunk, offset);
+        ins->op = chunk->code[offset];
+        ins->jumpsIn = 0;
+        ins->removed = false;
+        for (int byte = 0; byte < ins->length; byte++) entryAt[offset + byte] = -1;
+        entryAt[offset] = i;
+        offset += ins->length;
+    }
+    code[count] = (Instruction){ .offset = chunk->count, .op = OP_RETURN };
+    entryAt[chunk->count] = count;
+
+    bool valid = true;
+    for (int i = 0; i < count; i++) {
+        Instruction* ins = &code[i];
+        if (ins->op != OP_LOOP && !hasTarget(ins->op)) continue;
+
+        // the distance is the last two bytes, from the next instruction
+        int end = ins->offset + ins->length;
+        int distance = (chunk->code[end - 2] << 8) | chunk->code[end - 1];
+        int destination = end + (ins->op == OP_LOOP || ins->op == OP_FOR_LOOP ? -distance : distance);
+        if (destination < 0 || destination > chunk->count || entryAt[destination] == -1) {
+            valid = false;
+            break;
+        }
+        if (ins->op == OP_LOOP) ins->op = OP_JUMP;
+        ins->target = entryAt[destination];
+        code[ins->target].jumpsIn++;
+    }
+    FREE_ARRAY(int, entryAt, chunk->count + 1);
+
+    if (valid) {
+        Pass pass = { chunk, code, count, false };
+        do {
+            pass.changed = false;
+            dropUnreachable(&pass);
+            for (int i = 0; i < count; i++) {
+                if (!code[i].removed) simplify(&pass, i);
+            }
+        } while (pass.changed);
+
+        layOut(&pass);
+    }
+    FREE_ARRAY(Instruction, code, count + 1);
+}
@@ -0,0 +1,10 @@
+#ifndef ROSE_OPTIMIZE_H
+#define ROSE_OPTIMIZE_H
+#include "chunk.h"
+
+// Thread jumps, drop unreachable code and the pops the compiler pairs
+// with conditions, then lay the chunk out again. Leaves the chunk as it
+// was if a jump would no longer fit its operand.
+void optimizeChunk(Chunk* chunk);
+
+#endif
@@ -0,0 +1,738 @@
+#include "snapshot.h"
+#include "value.h"
+#include "object.h"
+#include "table.h"
+#include "memory.h"
+#include "vm.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A snapshot is a text file, one record per line:
+//
+//   rose-heap 1
+//   r <address>
+//   o <address> <type> <name> <bytes> <reference count> <address>...
+//
+// 'r' lines are the roots, 'o' lines the objects. The name is the class
+// of an instance or class and the function of a closure or function, '-'
+// for the rest. Bytes are the object's slot and the buffers it owns.
+
+#define SNAPSHOT_VERSION 1
+#define ADDRESS(object) ((unsigned long long)(uintptr_t)(object))
+
+static const char* typeName(ObjType type) {
+	switch (type) {
+	case OBJ_STRING: return "string";
+	case OBJ_NATIVE: return "native";
+	case OBJ_ARRAY: return "array";
+	case OBJ_FUNCTION: return "function";
+	case OBJ_CLOSURE: return "closure";
+	case OBJ_UPVALUE: return "upvalue";
+	case OBJ_CLASS: return "class";
+	case OBJ_INSTANCE: return "instance";
+	case OBJ_BOUND_METHOD: return "method";
+	case OBJ_WEAK_REF: return "weakref";
+	case OBJ_WEAK_MAP: return "weakmap";
+	case OBJ_FOREIGN: return "foreign";
+	}
+	return "unknown";
+}
+
+static const char* functionName(ObjFunction* function) {
+	return function->name == NULL ? "script" : function->name->chars;
+}
+
+static const char* objectName(Obj* object) {
+	switch (object->type) {
+	case OBJ_INSTANCE: return ((ObjInstance*)object)->klass->name->chars;
+	case OBJ_CLASS: return ((ObjClass*)object)->name->chars;
+	case OBJ_CLOSURE: return functionName(((ObjClosure*)object)->function);
+	case OBJ_FUNCTION: return functionName((ObjFunction*)object);
+	case OBJ_FOREIGN: return ((ObjForeign*)object)->tag;
+	default: return "-";
+	}
+}
+
+// buffers the object frees along with itself
+static size_t ownedSize(Obj* object) {
+	switch (object->type) {
+	case OBJ_STRING:
+		return ((ObjString*)object)->length + 1;
+	case OBJ_ARRAY:
+		return sizeof(Value) * ((ObjArray*)object)->values.capacity;
+	case OBJ_FUNCTION: {
+		ObjFunction* function = (ObjFunction*)object;
+		Chunk* chunk = &function->chunk;
+		return function->baselineCapacity + chunk->capacity + sizeof(int) * chunk->lineCapacity +
+			sizeof(Value) * chunk->constants.capacity;
+	}
+	case OBJ_CLOSURE:
+		return sizeof(ObjUpvalue*) * ((ObjClosure*)object)->upvalueCount;
+	case OBJ_CLASS:
+		return tableMemory(&((ObjClass*)object)->methods);
+	case OBJ_INSTANCE:
+		return tableMemory(&((ObjInstance*)object)->fields);
+	case OBJ_WEAK_MAP:
+		return sizeof(WeakEntry) * ((ObjWeakMap*)object)->capacity;
+	case OBJ_FOREIGN:
+		return ((ObjForeign*)object)->externalSize;
+	default:
+		return 0;
+	}
+}
+
+// References are written twice, once to count them and once for real
+typedef struct {
+	FILE* file;
+	int count;
+} RefWriter;
+
+static void writeRef(RefWriter* writer, Obj* object) {
+	if (object == NULL) return;
+	if (writer->file != NULL) fprintf(writer->file, " %llx", ADDRESS(object));
+	writer->count++;
+}
+
+static void writeValueRef(RefWriter* writer, Value value) {
+	if (IS_OBJ(value)) writeRef(writer, AS_OBJ(value));
+}
+
+static void writeTableRefs(RefWriter* writer, Table* table) {
+	int index = 0;
+	for (Entry* entry = tableNext(table, &index); entry != NULL;
+		entry = tableNext(table, &index)) {
+		writeRef(writer, (Obj*)entry->key);
+		writeValueRef(writer, entry->value);
+	}
+}
+
+// the strong references, the ones blackenObject follows
+static void writeRefs(RefWriter* writer, Obj* object) {
+	switch (object->type) {
+	case OBJ_BOUND_METHOD: {
+		ObjBoundMethod* bound = (ObjBoundMethod*)object;
+		writeValueRef(writer, bound->receiver);
+		writeRef(writer, (Obj*)bound->method);
+		break;
+	}
+	case OBJ_CLASS: {
+		ObjClass* klass = (ObjClass*)object;
+		writeRef(writer, (Obj*)klass->name);
+		writeTableRefs(writer, &klass->methods);
+		break;
+	}
+	case OBJ_INSTANCE: {
+		ObjInstance* instance = (ObjInstance*)object;
+		writeRef(writer, (Obj*)instance->klass);
+		writeTableRefs(writer, &instance->fields);
+		break;
+	}
+	case OBJ_CLOSURE: {
+		ObjClosure* closure = (ObjClosure*)object;
+		writeRef(writer, (Obj*)closure->function);
+		for (int i = 0; i < closure->upvalueCount; i++) {
+			writeRef(writer, (Obj*)closure->upvalues[i]);
+		}
+		break;
+	}
+	case OBJ_FUNCTION: {
+		ObjFunction* function = (ObjFunction*)object;
+		writeRef(writer, (Obj*)function->name);
+		for (int i = 0; i < function->chunk.constants.count; i++) {
+			writeValueRef(writer, function->chunk.constants.values[i]);
+		}
+		break;
+	}
+	case OBJ_UPVALUE: {
+		// an open upvalue points into the stack, which is a root anyway
+		ObjUpvalue* upvalue = (ObjUpvalue*)object;
+		if (upvalue->location == &upvalue->closed) writeValueRef(writer, upvalue->closed);
+		break;
+	}
+	case OBJ_ARRAY: {
+		ValueArray* values = &((ObjArray*)object)->values;
+		for (int i = 0; i < values->count; i++) writeValueRef(writer, values->values[i]);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+static void writeObject(Obj* object, size_t size, void* context) {
+	FILE* file = (FILE*)context;
+
+	RefWriter counter = { NULL, 0 };
+	writeRefs(&counter, object);
+
+	fprintf(file, "o %llx %s %s %zu %d", ADDRESS(object), typeName(object->type),
+		objectName(object), size + ownedSize(object), counter.count);
+	RefWriter writer = { file, 0 };
+	writeRefs(&writer, object);
+	fputc('\n', file);
+}
+
+static void writeRoot(FILE* file, Obj* object) {
+	if (object != NULL) fprintf(file, "r %llx\n", ADDRESS(object));
+}
+
+// the roots markRoots marks, outside of compilation
+static void writeRoots(FILE* file) {
+	for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+		if (IS_OBJ(*slot)) writeRoot(file, AS_OBJ(*slot));
+	}
+
+	for (int i = 0; i < vm.frameCount; i++) {
+		writeRoot(file, (Obj*)vm.frames[i].closure);
+	}
+
+	for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+		writeRoot(file, (Obj*)upvalue);
+	}
+
+	int index = 0;
+	for (Entry* entry = tableNext(&vm.globals, &index); entry != NULL;
+		entry = tableNext(&vm.globals, &index)) {
+		writeRoot(file, (Obj*)entry->key);
+		if (IS_OBJ(entry->value)) writeRoot(file, AS_OBJ(entry->value));
+	}
+
+	writeRoot(file, (Obj*)vm.initString);
+	writeRoot(file, (Obj*)vm.destString);
+}
+
+bool writeHeapSnapshot(const char* path) {
+	// opened first, 'path' may be the characters of a young string
+	FILE* file = fopen(path, "w");
+	if (file == NULL) return false;
+
+	// only what is live, all of it in the old space
+	collectYoung();
+	collectGarbage(true);
+
+	fprintf(file, "rose-heap %d\n", SNAPSHOT_VERSION);
+	writeRoots(file);
+	walkHeap(writeObject, file);
+
+	bool written = !ferror(file);
+	if (fclose(file) != 0) written = false;
+	return written;
+}
+
+// Reading snapshots back. Objects are grouped by kind: the class name of
+// instances, the type of everything else.
+
+typedef struct {
+	unsigned long long address;
+	int kind;
+	size_t size;
+	int firstRef;
+	int refCount;
+} Node;
+
+typedef struct {
+	char* name;
+	uint32_t hash;
+} Kind;
+
+typedef struct {
+	Node* nodes;
+	int count;
+	int capacity;
+	// addresses as read, and the node each one is, -1 for none
+	unsigned long long* refs;
+	int* edges;
+	int refCount;
+	int refCapacity;
+	unsigned long long* roots;
+	int rootCount;
+	int rootCapacity;
+
+	Kind* kinds;
+	int kindCount;
+	int kindCapacity;
+	// open addressing over kinds and nodes, -1 for an empty slot
+	int* kindSlots;
+	int kindSlotCount;
+	int* nodeSlots;
+	int nodeSlotCount;
+} Snapshot;
+
+#define GROW(array, count, capacity) \
+	do { \
+		if ((capacity) < (count) + 1) { \
+			(capacity) = (capacity) < 8 ? 8 : (capacity) * 2; \
+			void* grown = realloc((array), sizeof(*(array)) * (capacity)); \
+			if (grown == NULL) exit(1); \
+			(array) = grown; \
+		} \
+	} while (false)
+
+static uint32_t hashName(const char* name) {
+	uint32_t hash = 2166136261u;
+	for (; *name != '\0'; name++) {
+		hash ^= (uint8_t)*name;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+static uint32_t hashAddress(unsigned long long address) {
+	address ^= address >> 33;
+	address *= 0xff51afd7ed558ccdULL;
+	address ^= address >> 33;
+	return (uint32_t)address;
+}
+
+static int* newSlots(int count) {
+	int* slots = (int*)malloc(sizeof(int) * count);
+	if (slots == NULL) exit(1);
+	for (int i = 0; i < count; i++) slots[i] = -1;
+	return slots;
+}
+
+static int internKind(Snapshot* snapshot, const char* name) {
+	if (snapshot->kindCount + 1 > snapshot->kindSlotCount / 2) {
+		free(snapshot->kindSlots);
+		snapshot->kindSlotCount = snapshot->kindSlotCount < 64 ? 64 : snapshot->kindSlotCount * 2;
+		snapshot->kindSlots = newSlots(snapshot->kindSlotCount);
+		for (int i = 0; i < snapshot->kindCount; i++) {
+			uint32_t slot = snapshot->kinds[i].hash & (snapshot->kindSlotCount - 1);
+			while (snapshot->kindSlots[slot] != -1) slot = (slot + 1) & (snapshot->kindSlotCount - 1);
+			snapshot->kindSlots[slot] = i;
+		}
+	}
+
+	uint32_t hash = hashName(name);
+	uint32_t slot = hash & (snapshot->kindSlotCount - 1);
+	for (; snapshot->kindSlots[slot] != -1; slot = (slot + 1) & (snapshot->kindSlotCount - 1)) {
+		Kind* kind = &snapshot->kinds[snapshot->kindSlots[slot]];
+		if (kind->hash == hash && strcmp(kind->name, name) == 0) return snapshot->kindSlots[slot];
+	}
+
+	GROW(snapshot->kinds, snapshot->kindCount, snapshot->kindCapacity);
+	Kind* kind = &snapshot->kinds[snapshot->kindCount];
+	kind->name = (char*)malloc(strlen(name) + 1);
+	if (kind->name == NULL) exit(1);
+	strcpy(kind->name, name);
+	kind->hash = hash;
+	snapshot->kindSlots[slot] = snapshot->kindCount;
+	return snapshot->kindCount++;
+}
+
+static void indexNodes(Snapshot* snapshot) {
+	snapshot->nodeSlotCount = 64;
+	while (snapshot->nodeSlotCount < snapshot->count * 2) snapshot->nodeSlotCount *= 2;
+	snapshot->nodeSlots = newSlots(snapshot->nodeSlotCount);
+
+	for (int i = 0; i < snapshot->count; i++) {
+		uint32_t slot = hashAddress(snapshot->nodes[i].address) & (snapshot->nodeSlotCount - 1);
+		while (snapshot->nodeSlots[slot] != -1) slot = (slot + 1) & (snapshot->nodeSlotCount - 1);
+		snapshot->nodeSlots[slot] = i;
+	}
+}
+
+static int findNode(Snapshot* snapshot, unsigned long long address) {
+	uint32_t slot = hashAddress(address) & (snapshot->nodeSlotCount - 1);
+	for (; snapshot->nodeSlots[slot] != -1; slot = (slot + 1) & (snapshot->nodeSlotCount - 1)) {
+		if (snapshot->nodes[snapshot->nodeSlots[slot]].address == address) {
+			return snapshot->nodeSlots[slot];
+		}
+	}
+	return -1;
+}
+
+static void freeSnapshot(Snapshot* snapshot) {
+	for (int i = 0; i < snapshot->kindCount; i++) free(snapshot->kinds[i].name);
+	free(snapshot->nodes);
+	free(snapshot->refs);
+	free(snapshot->edges);
+	free(snapshot->roots);
+	free(snapshot->kinds);
+	free(snapshot->kindSlots);
+	free(snapshot->nodeSlots);
+}
+
+static bool readSnapshot(const char* path, Snapshot* snapshot) {
+	memset(snapshot, 0, sizeof(Snapshot));
+
+	FILE* file = fopen(path, "r");
+	if (file == NULL) {
+		fprintf(stderr, "Could not open file \"%s\".\n", path);
+		return false;
+	}
+
+	int version = 0;
+	if (fscanf(file, "rose-heap %d", &version) != 1 || version != SNAPSHOT_VERSION) {
+		fprintf(stderr, "\"%s\" is not a heap snapshot.\n", path);
+		fclose(file);
+		return false;
+	}
+
+	char record[2];
+	bool valid = true;
+	while (valid && fscanf(file, "%1s", record) == 1) {
+		if (record[0] == 'r') {
+			GROW(snapshot->roots, snapshot->rootCount, snapshot->rootCapacity);
+			valid = fscanf(file, "%llx", &snapshot->roots[snapshot->rootCount++]) == 1;
+			continue;
+		}
+		if (record[0] != 'o') {
+			valid = false;
+			break;
+		}
+
+		char type[32];
+		char name[256];
+		char kind[300];
+		Node node;
+		if (fscanf(file, "%llx %31s %255s %zu %d", &node.address, type, name,
+			&node.size, &node.refCount) != 5 || node.refCount < 0) {
+			valid = false;
+			break;
+		}
+
+		if (strcmp(type, "instance") == 0) snprintf(kind, sizeof(kind), "%s", name);
+		else snprintf(kind, sizeof(kind), "(%s)", type);
+		node.kind = internKind(snapshot, kind);
+		node.firstRef = snapshot->refCount;
+
+		for (int i = 0; i < node.refCount && valid; i++) {
+			GROW(snapshot->refs, snapshot->refCount, snapshot->refCapacity);
+			valid = fscanf(file, "%llx", &snapshot->refs[snapshot->refCount++]) == 1;
+		}
+
+		GROW(snapshot->nodes, snapshot->count, snapshot->capacity);
+		snapshot->nodes[snapshot->count++] = node;
+	}
+	fclose(file);
+
+	if (!valid) {
+		fprintf(stderr, "Malformed heap snapshot \"%s\".\n", path);
+		freeSnapshot(snapshot);
+		return false;
+	}
+
+	indexNodes(snapshot);
+	snapshot->edges = (int*)malloc(sizeof(int) * (snapshot->refCount + 1));
+	if (snapshot->edges == NULL) exit(1);
+	for (int i = 0; i < snapshot->refCount; i++) {
+		snapshot->edges[i] = findNode(snapshot, snapshot->refs[i]);
+	}
+	return true;
+}
+
+// Retained size: the bytes freed if the object went away, its own and
+// those of every object only reachable through it. Objects are visited
+// depth first from a virtual root pointing at the roots, then their
+// immediate dominators are found with the iterative algorithm of Cooper,
+// Harvey and Kennedy. Objects nothing reaches hang off the root.
+typedef struct {
+	int* order;   // postorder, the virtual root last
+	int* number;  // position in 'order'
+	int* idom;
+	size_t* retained;
+} Dominators;
+
+static void depthFirst(Snapshot* snapshot, int start, Dominators* tree, int* visited,
+	int* count, int* stack, int* cursor) {
+	if (visited[start]) return;
+
+	int depth = 0;
+	stack[depth] = start;
+	cursor[depth] = 0;
+	visited[start] = 1;
+
+	while (depth >= 0) {
+		Node* node = &snapshot->nodes[stack[depth]];
+		if (cursor[depth] < node->refCount) {
+			int next = snapshot->edges[node->firstRef + cursor[depth]++];
+			if (next >= 0 && !visited[next]) {
+				visited[next] = 1;
+				depth++;
+				stack[depth] = next;
+				cursor[depth] = 0;
+			}
+			continue;
+		}
+
+		tree->number[stack[depth]] = *count;
+		tree->order[(*count)++] = stack[depth];
+		depth--;
+	}
+}
+
+static int intersect(Dominators* tree, int a, int b) {
+	while (a != b) {
+		while (tree->number[a] < tree->number[b]) a = tree->idom[a];
+		while (tree->number[b] < tree->number[a]) b = tree->idom[b];
+	}
+	return a;
+}
+
+static void findDominators(Snapshot* snapshot, Dominators* tree) {
+	int count = snapshot->count;
+	int root = count;
+
+	tree->order = (int*)malloc(sizeof(int) * (count + 1));
+	tree->number = (int*)malloc(sizeof(int) * (count + 1));
+	tree->idom = (int*)malloc(sizeof(int) * (count + 1));
+	tree->retained = (size_t*)malloc(sizeof(size_t) * (count + 1));
+	int* visited = (int*)calloc(count + 1, sizeof(int));
+	int* stack = (int*)malloc(sizeof(int) * (count + 1));
+	int* cursor = (int*)malloc(sizeof(int) * (count + 1));
+	// the root's edges: the roots, then whatever they do not reach
+	bool* fromRoot = (bool*)calloc(count + 1, sizeof(bool));
+	if (tree->order == NULL || tree->number == NULL || tree->idom == NULL ||
+		tree->retained == NULL || visited == NULL || stack == NULL ||
+		cursor == NULL || fromRoot == NULL) exit(1);
+
+	int numbered = 0;
+	for (int i = 0; i < snapshot->rootCount; i++) {
+		int node = findNode(snapshot, snapshot->roots[i]);
+		if (node < 0) continue;
+		fromRoot[node] = true;
+		depthFirst(snapshot, node, tree, visited, &numbered, stack, cursor);
+	}
+	for (int i = 0; i < count; i++) {
+		if (visited[i]) continue;
+		fromRoot[i] = true;
+		depthFirst(snapshot, i, tree, visited, &numbered, stack, cursor);
+	}
+	tree->number[root] = numbered;
+	tree->order[numbered] = root;
+
+	// predecessors, in compressed rows
+	int* predStart = (int*)calloc(count + 2, sizeof(int));
+	if (predStart == NULL) exit(1);
+	for (int i = 0; i < snapshot->refCount; i++) {
+		if (snapshot->edges[i] >= 0) predStart[snapshot->edges[i] + 1]++;
+	}
+	for (int i = 0; i < count; i++) predStart[i + 1] += predStart[i];
+
+	int* preds = (int*)malloc(sizeof(int) * (predStart[count] + 1));
+	int* fill = (int*)malloc(sizeof(int) * (count + 1));
+	if (preds == NULL || fill == NULL) exit(1);
+	memcpy(fill, predStart, sizeof(int) * (count + 1));
+	for (int i = 0; i < count; i++) {
+		Node* node = &snapshot->nodes[i];
+		for (int j = 0; j < node->refCount; j++) {
+			int target = snapshot->edges[node->firstRef + j];
+			if (target >= 0) preds[fill[target]++] = i;
+		}
+	}
+
+	for (int i = 0; i < count; i++) tree->idom[i] = -1;
+	tree->idom[root] = root;
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (int i = numbered - 1; i >= 0; i--) {
+			int node = tree->order[i];
+			int idom = fromRoot[node] ? root : -1;
+
+			for (int j = predStart[node]; j < predStart[node + 1]; j++) {
+				int pred = preds[j];
+				if (tree->idom[pred] == -1) continue;
+				idom = idom == -1 ? pred : intersect(tree, pred, idom);
+			}
+
+			if (tree->idom[node] != idom) {
+				tree->idom[node] = idom;
+				changed = true;
+			}
+		}
+	}
+
+	// a dominator comes after what it dominates in postorder
+	for (int i = 0; i < count; i++) tree->retained[i] = snapshot->nodes[i].size;
+	tree->retained[root] = 0;
+	for (int i = 0; i < numbered; i++) {
+		int node = tree->order[i];
+		tree->retained[tree->idom[node]] += tree->retained[node];
+	}
+
+	free(visited);
+	free(stack);
+	free(cursor);
+	free(fromRoot);
+	free(predStart);
+	free(preds);
+	free(fill);
+}
+
+static void freeDominators(Dominators* tree) {
+	free(tree->order);
+	free(tree->number);
+	free(tree->idom);
+	free(tree->retained);
+}
+
+typedef struct {
+	int kind;
+	long long count;
+	long long bytes;
+	long long retained;
+} KindTotal;
+
+// Per kind totals. A kind retains what its objects retain, counting only
+// the outermost of them on any dominator path so nested lists and trees
+// are not counted once per level.
+static KindTotal* totalKinds(Snapshot* snapshot, Dominators* tree) {
+	KindTotal* totals = (KindTotal*)calloc(snapshot->kindCount + 1, sizeof(KindTotal));
+	if (totals == NULL) exit(1);
+	for (int i = 0; i < snapshot->kindCount; i++) totals[i].kind = i;
+
+	for (int i = 0; i < snapshot->count; i++) {
+		totals[snapshot->nodes[i].kind].count++;
+		totals[snapshot->nodes[i].kind].bytes += snapshot->nodes[i].size;
+	}
+	if (tree == NULL) return totals;
+
+	int count = snapshot->count;
+	int* childStart = (int*)calloc(count + 2, sizeof(int));
+	int* children = (int*)malloc(sizeof(int) * (count + 1));
+	int* fill = (int*)malloc(sizeof(int) * (count + 1));
+	int* onPath = (int*)calloc(snapshot->kindCount + 1, sizeof(int));
+	int* stack = (int*)malloc(sizeof(int) * (count + 1));
+	int* cursor = (int*)malloc(sizeof(int) * (count + 1));
+	if (childStart == NULL || children == NULL || fill == NULL || onPath == NULL ||
+		stack == NULL || cursor == NULL) exit(1);
+
+	for (int i = 0; i < count; i++) childStart[tree->idom[i] + 1]++;
+	for (int i = 0; i <= count; i++) childStart[i + 1] += childStart[i];
+	memcpy(fill, childStart, sizeof(int) * (count + 1));
+	for (int i = 0; i < count; i++) children[fill[tree->idom[i]]++] = i;
+
+	int depth = 0;
+	stack[0] = count;
+	cursor[0] = childStart[count];
+	while (depth >= 0) {
+		int node = stack[depth];
+		if (cursor[depth] < childStart[node + 1]) {
+			int child = children[cursor[depth]++];
+			int kind = snapshot->nodes[child].kind;
+			if (onPath[kind]++ == 0) totals[kind].retained += tree->retained[child];
+
+			depth++;
+			stack[depth] = child;
+			cursor[depth] = childStart[child];
+			continue;
+		}
+
+		if (node != count) onPath[snapshot->nodes[node].kind]--;
+		depth--;
+	}
+
+	free(childStart);
+	free(children);
+	free(fill);
+	free(onPath);
+	free(stack);
+	free(cursor);
+	return totals;
+}
+
+static int byRetained(const void* a, const void* b) {
+	const KindTotal* left = (const KindTotal*)a;
+	const KindTotal* right = (const KindTotal*)b;
+	if (left->retained != right->retained) return left->retained < right->retained ? 1 : -1;
+	if (left->bytes != right->bytes) return left->bytes < right->bytes ? 1 : -1;
+	return left->kind - right->kind;
+}
+
+bool summarizeHeapSnapshot(const char* path) {
+	Snapshot snapshot;
+	if (!readSnapshot(path, &snapshot)) return false;
+
+	Dominators tree;
+	findDominators(&snapshot, &tree);
+	KindTotal* totals = totalKinds(&snapshot, &tree);
+	qsort(totals, snapshot.kindCount, sizeof(KindTotal), byRetained);
+
+	long long bytes = 0;
+	for (int i = 0; i < snapshot.count; i++) bytes += snapshot.nodes[i].size;
+	printf("%d objects, %lld bytes, %d roots\n\n", snapshot.count, bytes, snapshot.rootCount);
+	printf("%10s %12s %12s  %s\n", "count", "bytes", "retained", "kind");
+	for (int i = 0; i < snapshot.kindCount; i++) {
+		printf("%10lld %12lld %12lld  %s\n", totals[i].count, totals[i].bytes,
+			totals[i].retained, snapshot.kinds[totals[i].kind].name);
+	}
+
+	free(totals);
+	freeDominators(&tree);
+	freeSnapshot(&snapshot);
+	return true;
+}
+
+typedef struct {
+	const char* name;
+	long long count;
+	long long bytes;
+} KindDelta;
+
+static int byGrowth(const void* a, const void* b) {
+	const KindDelta* left = (const KindDelta*)a;
+	const KindDelta* right = (const KindDelta*)b;
+	long long leftSize = left->bytes < 0 ? -left->bytes : left->bytes;
+	long long rightSize = right->bytes < 0 ? -right->bytes : right->bytes;
+	if (leftSize != rightSize) return leftSize < rightSize ? 1 : -1;
+	return strcmp(left->name, right->name);
+}
+
+// Objects and bytes each kind gained from 'before' to 'after'. Addresses
+// are reused between runs, so kinds are compared, not objects.
+bool diffHeapSnapshots(const char* before, const char* after) {
+	Snapshot older;
+	Snapshot newer;
+	if (!readSnapshot(before, &older)) return false;
+	if (!readSnapshot(after, &newer)) {
+		freeSnapshot(&older);
+		return false;
+	}
+
+	// the kinds only the older snapshot has are added to the newer one
+	int* olderKinds = (int*)malloc(sizeof(int) * (older.kindCount + 1));
+	if (olderKinds == NULL) exit(1);
+	for (int i = 0; i < older.kindCount; i++) {
+		olderKinds[i] = internKind(&newer, older.kinds[i].name);
+	}
+
+	KindTotal* olderTotals = totalKinds(&older, NULL);
+	KindTotal* newerTotals = totalKinds(&newer, NULL);
+	KindDelta* deltas = (KindDelta*)calloc(newer.kindCount + 1, sizeof(KindDelta));
+	if (deltas == NULL) exit(1);
+
+	for (int i = 0; i < newer.kindCount; i++) {
+		deltas[i].name = newer.kinds[i].name;
+		deltas[i].count = newerTotals[i].count;
+		deltas[i].bytes = newerTotals[i].bytes;
+	}
+	for (int i = 0; i < older.kindCount; i++) {
+		deltas[olderKinds[i]].count -= olderTotals[i].count;
+		deltas[olderKinds[i]].bytes -= olderTotals[i].bytes;
+	}
+	qsort(deltas, newer.kindCount, sizeof(KindDelta), byGrowth);
+
+	long long olderBytes = 0;
+	long long newerBytes = 0;
+	for (int i = 0; i < older.count; i++) olderBytes += older.nodes[i].size;
+	for (int i = 0; i < newer.count; i++) newerBytes += newer.nodes[i].size;
+	printf("%+d objects, %+lld bytes\n\n", newer.count - older.count, newerBytes - olderBytes);
+	printf("%10s %12s  %s\n", "count", "bytes", "kind");
+	for (int i = 0; i < newer.kindCount; i++) {
+		if (deltas[i].count == 0 && deltas[i].bytes == 0) continue;
+		printf("%+10lld %+12lld  %s\n", deltas[i].count, deltas[i].bytes, deltas[i].name);
+	}
+
+	free(olderKinds);
+	free(olderTotals);
+	free(newerTotals);
+	free(deltas);
+	freeSnapshot(&older);
+	freeSnapshot(&newer);
+	return true;
+}
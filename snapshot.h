@@ -0,0 +1,12 @@
+#ifndef ROSE_SNAPSHOT_H
+#define ROSE_SNAPSHOT_H
+#include "common.h"
+
+// collect and write every live object with its references to 'path'
+bool writeHeapSnapshot(const char* path);
+
+// --heap-summary and --heap-diff
+bool summarizeHeapSnapshot(const char* path);
+bool diffHeapSnapshots(const char* before, const char* after);
+
+#endif
@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -5,152 +6,613 @@
 #include "object.h"
 #include "table.h"
 #include "value.h"
+#include "vm.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TABLE_SSE2
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static inline int lowestBit(uint32_t mask) {
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+}
+#else
+static inline int lowestBit(uint32_t mask) { return __builtin_ctz(mask); }
+#endif
+
+// Control bytes: a full slot stores the low 7 bits of its key's hash,
+// empty and deleted slots have the high bit set so they never match one.
+#define CTRL_EMPTY    ((uint8_t)0x80)
+#define CTRL_DELETED  ((uint8_t)0xFE)
+#define CTRL_SENTINEL ((uint8_t)0xFF)
+
+#define IS_FULL(ctrl) ((ctrl) < 0x80)
+
+#define HASH_H1(hash) ((hash) >> 7)
+#define HASH_H2(hash) ((uint8_t)((hash) & 0x7F))
+
+// tables smaller than a group still get a whole group of control bytes,
+// the padding is filled with sentinels that are neither empty nor full
+static int controlSize(int capacity) {
+	return capacity < TABLE_GROUP_WIDTH ? TABLE_GROUP_WIDTH : capacity;
+}
+
+static int groupMask(int capacity) {
+	return (capacity <= TABLE_GROUP_WIDTH ? 1 : capacity / TABLE_GROUP_WIDTH) - 1;
+}
+
+static size_t allocationSize(int capacity) {
+	return (size_t)controlSize(capacity) + sizeof(Entry) * capacity;
+}
+
+// bit i is set when control byte i of the group equals 'value'
+static inline uint32_t matchByte(const uint8_t* group, uint8_t value) {
+#ifdef TABLE_SSE2
+	__m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+	return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)value)));
+#else
+	uint32_t mask = 0;
+	for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+		if (group[i] == value) mask |= 1u << i;
+	}
+	return mask;
+#endif
+}
+
+// bit i is set when control byte i is empty or deleted
+static inline uint32_t matchFree(const uint8_t* group) {
+#ifdef TABLE_SSE2
+	__m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+	// as signed bytes empty and deleted are the only values below the sentinel
+	__m128i free = _mm_cmplt_epi8(ctrl, _mm_set1_epi8((char)CTRL_SENTINEL));
+	return (uint32_t)_mm_movemask_epi8(free);
+#else
+	uint32_t mask = 0;
+	for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+		if (group[i] == CTRL_EMPTY || group[i] == CTRL_DELETED) mask |= 1u << i;
+	}
+	return mask;
+#endif
+}
 
 void initTable(Table* table) {
 	table->count = 0;
+	table->tombstones = 0;
 	table->capacity = 0;
+	table->control = NULL;
 	table->entries = NULL;
+	table->oldCount = 0;
+	table->oldCapacity = 0;
+	table->migrated = 0;
+	table->oldControl = NULL;
+	table->oldEntries = NULL;
 }
 
 void freeTable(Table* table) {
-	FREE_ARRAY(Entry, table->entries, table->capacity);
+	if (table->control != NULL) {
+		reallocate(table->control, allocationSize(table->capacity), 0);
+	}
+	if (table->oldControl != NULL) {
+		reallocate(table->oldControl, allocationSize(table->oldCapacity), 0);
+	}
 	initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-	uint32_t index = key->hash % capacity;
-	Entry* tombstone = NULL;
+// slot holding 'key' in one slot array, or -1 when it is not there
+static int findIn(const uint8_t* control, const Entry* entries, int capacity, ObjString* key) {
+	if (capacity == 0) return -1;
 
-	for (;;) {
-		Entry* entry = &entries[index];
-		if (entry->key == NULL) {
-			if (IS_NIL(entry->value)) {
-				// Empty entry.
-				return tombstone != NULL ? tombstone : entry;
-			}
-			else {
-				// We found a tombstone.
-				if (tombstone == NULL) tombstone = entry;
-			}
-		}
-		else if (entry->key == key) {
-			// We found the key.
-			return entry;
+	int mask = groupMask(capacity);
+	int group = HASH_H1(key->hash) & mask;
+	uint8_t h2 = HASH_H2(key->hash);
+
+	for (int step = 1;; step++) {
+		const uint8_t* ctrl = control + group * TABLE_GROUP_WIDTH;
+		uint32_t candidates = matchByte(ctrl, h2);
+		while (candidates != 0) {
+			int slot = group * TABLE_GROUP_WIDTH + lowestBit(candidates);
+			if (entries[slot].key == key) return slot;
+			candidates &= candidates - 1;
 		}
 
-		index = (index + 1) % capacity;
+		// a group with an empty slot ends every probe sequence through it
+		if (matchByte(ctrl, CTRL_EMPTY) != 0) return -1;
+		group = (group + step) & mask;
+	}
+}
+
+static int findSlot(Table* table, ObjString* key) {
+	return findIn(table->control, table->entries, table->capacity, key);
+}
+
+static int findOldSlot(Table* table, ObjString* key) {
+	return findIn(table->oldControl, table->oldEntries, table->oldCapacity, key);
+}
+
+// first empty or deleted slot on the probe sequence of 'hash'
+static int findFreeSlot(uint8_t* control, int capacity, uint32_t hash) {
+	int mask = groupMask(capacity);
+	int group = HASH_H1(hash) & mask;
+
+	for (int step = 1;; step++) {
+		uint32_t free = matchFree(control + group * TABLE_GROUP_WIDTH);
+		if (free != 0) return group * TABLE_GROUP_WIDTH + lowestBit(free);
+		group = (group + step) & mask;
 	}
 }
 
+static void freeOldSlots(Table* table) {
+	reallocate(table->oldControl, allocationSize(table->oldCapacity), 0);
+	table->oldCount = 0;
+	table->oldCapacity = 0;
+	table->migrated = 0;
+	table->oldControl = NULL;
+	table->oldEntries = NULL;
+}
+
+// Move up to 'budget' slots of the previous array into the current one.
+// Moved slots become tombstones so probes through them still continue.
+static void migrateSlots(Table* table, int budget) {
+	while (budget-- > 0 && table->migrated < table->oldCapacity && table->oldCount > 0) {
+		int i = table->migrated++;
+		if (!IS_FULL(table->oldControl[i])) continue;
+
+		Entry* entry = &table->oldEntries[i];
+		int slot = findFreeSlot(table->control, table->capacity, entry->key->hash);
+		if (table->control[slot] == CTRL_DELETED) table->tombstones--;
+		table->control[slot] = table->oldControl[i];
+		table->entries[slot] = *entry;
+
+		table->oldControl[i] = CTRL_DELETED;
+		entry->key = NULL;
+		entry->value = NIL_VAL;
+		table->oldCount--;
+	}
+
+	if (table->oldCount == 0) freeOldSlots(table);
+}
+
+static void finishMigration(Table* table) {
+	if (table->oldControl != NULL) migrateSlots(table, table->oldCapacity);
+}
+
+static void deleteOldSlot(Table* table, int slot) {
+	table->oldEntries[slot].key = NULL;
+	table->oldEntries[slot].value = NIL_VAL;
+	table->oldControl[slot] = CTRL_DELETED;
+	table->oldCount--;
+	table->count--;
+	if (table->oldCount == 0) freeOldSlots(table);
+}
+
 bool tableGet(Table* table, ObjString* key, Value* value) {
 	if (table->count == 0) return false;
+	if (table->oldControl != NULL) migrateSlots(table, TABLE_MIGRATE_STEP);
 
-	Entry* entry = findEntry(table->entries, table->capacity, key);
-	if (entry->key == NULL) return false;
+	int slot = findSlot(table, key);
+	if (slot >= 0) {
+		*value = table->entries[slot].value;
+		return true;
+	}
 
-	*value = entry->value;
-	return true;
+	if (table->oldControl != NULL) {
+		slot = findOldSlot(table, key);
+		if (slot >= 0) {
+			*value = table->oldEntries[slot].value;
+			return true;
+		}
+	}
+	return false;
 }
 
-bool tableDelete(Table* table, ObjString* key) {
-	if (table->count == 0) return false;
+static void deleteSlot(Table* table, int slot) {
+	table->entries[slot].key = NULL;
+	table->entries[slot].value = NIL_VAL;
+	table->count--;
 
-	// Find the entry.
-	Entry* entry = findEntry(table->entries, table->capacity, key);
-	if (entry->key == NULL) return false;
+	// if the group still has an empty slot no probe ever continued past it,
+	// so the slot can be freed outright instead of leaving a tombstone
+	uint8_t* group = table->control + (slot & ~(TABLE_GROUP_WIDTH - 1));
+	if (matchByte(group, CTRL_EMPTY) != 0) {
+		table->control[slot] = CTRL_EMPTY;
+	}
+	else {
+		table->control[slot] = CTRL_DELETED;
+		table->tombstones++;
+	}
+}
 
-	// Place a tombstone in the entry 'mark as removed for the garbage collector'. we can reuse it later
-	entry->key = NULL;
-	entry->value = BOOL_VAL(true);
-	return true;
+// Drop every tombstone without allocating: live entries are flagged as
+// pending, then each one is moved to the first free slot of its probe
+// sequence, swapping with a pending entry that still sits there.
+static void rehashInPlace(Table* table) {
+	uint8_t* control = table->control;
+	for (int i = 0; i < table->capacity; i++) {
+		if (IS_FULL(control[i])) control[i] = CTRL_DELETED;
+		else if (control[i] == CTRL_DELETED) control[i] = CTRL_EMPTY;
+	}
+
+	for (int i = 0; i < table->capacity; i++) {
+		if (control[i] != CTRL_DELETED) continue;
+
+		uint32_t hash = table->entries[i].key->hash;
+		int target = findFreeSlot(control, table->capacity, hash);
+
+		// already in the first group its probe reaches
+		if (target / TABLE_GROUP_WIDTH == i / TABLE_GROUP_WIDTH) {
+			control[i] = HASH_H2(hash);
+			continue;
+		}
+
+		if (control[target] == CTRL_EMPTY) {
+			table->entries[target] = table->entries[i];
+			control[target] = HASH_H2(hash);
+			control[i] = CTRL_EMPTY;
+			table->entries[i].key = NULL;
+			table->entries[i].value = NIL_VAL;
+		}
+		else {
+			// target holds another pending entry, swap and place that one next
+			Entry pending = table->entries[target];
+			table->entries[target] = table->entries[i];
+			table->entries[i] = pending;
+			control[target] = HASH_H2(hash);
+			i--;
+		}
+	}
+
+	table->tombstones = 0;
 }
 
-static void adjustCapacity(Table* table, int capacity) {
-	//allocate new array of entries for the table
-	Entry* entries = ALLOCATE(Entry, capacity);
+// allocate an empty slot array of 'capacity' slots
+static uint8_t* newSlots(int capacity) {
+	//allocate control bytes and entries in one block
+	uint8_t* control = (uint8_t*)reallocate(NULL, 0, allocationSize(capacity));
+	Entry* entries = (Entry*)(control + controlSize(capacity));
+	memset(control, CTRL_EMPTY, capacity);
+	memset(control + capacity, CTRL_SENTINEL, controlSize(capacity) - capacity);
 	for (int i = 0; i < capacity; i++) {
 		entries[i].key = NULL;
 		entries[i].value = NIL_VAL;
 	}
+	return control;
+}
 
-	//refill new buckets with old ones
-	table->count = 0;
+static void adjustCapacity(Table* table, int capacity) {
+	uint8_t* control = newSlots(capacity);
+	Entry* entries = (Entry*)(control + controlSize(capacity));
+
+	//refill new buckets with old ones, tombstones are dropped
 	for (int i = 0; i < table->capacity; i++) {
+		if (!IS_FULL(table->control[i])) continue;
 		Entry* entry = &table->entries[i];
-		if (entry->key == NULL) continue;
 
-		Entry* dest = findEntry(entries, capacity, entry->key);
-		dest->key = entry->key;
-		dest->value = entry->value;
-		table->count++;
+		int slot = findFreeSlot(control, capacity, entry->key->hash);
+		control[slot] = table->control[i];
+		entries[slot] = *entry;
 	}
+	table->tombstones = 0;
 
-	//free old array of entries
-	FREE_ARRAY(Entry, table->entries, table->capacity);
+	//free old block
+	if (table->control != NULL) {
+		reallocate(table->control, allocationSize(table->capacity), 0);
+	}
 	//set new one
+	table->control = control;
 	table->entries = entries;
 	table->capacity = capacity;
 }
 
+// Large tables keep their current array as the migration source and move a
+// few slots per operation, so no single insert pays for the whole rehash.
+static void beginResize(Table* table, int capacity) {
+	uint8_t* control = newSlots(capacity);
+
+	table->oldCount = table->count;
+	table->oldCapacity = table->capacity;
+	table->migrated = 0;
+	table->oldControl = table->control;
+	table->oldEntries = table->entries;
+
+	table->tombstones = 0;
+	table->capacity = capacity;
+	table->control = control;
+	table->entries = (Entry*)(control + controlSize(capacity));
+
+	migrateSlots(table, TABLE_MIGRATE_STEP);
+}
+
+// smallest capacity that keeps 'count' entries at most half of the load limit
+static int fittingCapacity(int count) {
+	int capacity = GROW_CAPACITY(0);
+	while (count > capacity * TABLE_MAX_LOAD / 2) capacity *= 2;
+	return capacity;
+}
+
+// give memory back once a table is mostly empty, or clear out tombstones
+static void compactTable(Table* table) {
+	// wait for a resize in progress to finish first
+	if (table->oldControl != NULL) return;
+
+	if (table->capacity > GROW_CAPACITY(0) &&
+		table->count < table->capacity * TABLE_MIN_LOAD) {
+		if (table->count == 0) {
+			freeTable(table);
+			return;
+		}
+		adjustCapacity(table, fittingCapacity(table->count));
+	}
+	else if (table->tombstones > table->capacity * TABLE_MAX_TOMBSTONES) {
+		rehashInPlace(table);
+	}
+}
+
+bool tableDelete(Table* table, ObjString* key) {
+	if (table->count == 0) return false;
+	if (table->oldControl != NULL) migrateSlots(table, TABLE_MIGRATE_STEP);
+
+	// Find the entry.
+	int slot = findSlot(table, key);
+	if (slot >= 0) {
+		deleteSlot(table, slot);
+		compactTable(table);
+		return true;
+	}
+
+	if (table->oldControl != NULL) {
+		slot = findOldSlot(table, key);
+		if (slot >= 0) {
+			deleteOldSlot(table, slot);
+			return true;
+		}
+	}
+	return false;
+}
+
 bool tableSet(Table* table, ObjString* key, Value value) {
-	// Check for capacity
-	if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-		int capacity = GROW_CAPACITY(table->capacity);
-		adjustCapacity(table, capacity);
+	if (table->oldControl != NULL) migrateSlots(table, TABLE_MIGRATE_STEP);
+
+	if (table->count > 0) {
+		int slot = findSlot(table, key);
+		if (slot >= 0) {
+			table->entries[slot].value = value;
+			return false;
+		}
+
+		// not migrated yet, update it where it is
+		if (table->oldControl != NULL) {
+			slot = findOldSlot(table, key);
+			if (slot >= 0) {
+				table->oldEntries[slot].value = value;
+				return false;
+			}
+		}
 	}
 
-	Entry* entry = findEntry(table->entries, table->capacity, key);
-	bool isNewKey = entry->key == NULL;
-	if (isNewKey && IS_NIL(entry->value)) table->count++;
+	// Check for capacity, tombstones take up probe length like live keys
+	int used = table->count - table->oldCount + table->tombstones;
+	if (used + 1 > table->capacity * TABLE_MAX_LOAD) {
+		finishMigration(table);
 
-	entry->key = key;
-	entry->value = value;
-	return isNewKey;
+		if (table->count + 1 <= table->capacity * TABLE_MAX_LOAD / 2) {
+			// mostly tombstones, a rehash frees enough room without growing
+			rehashInPlace(table);
+		}
+		else {
+			int capacity = GROW_CAPACITY(table->capacity);
+			if (capacity >= TABLE_INCREMENTAL_MIN) {
+				beginResize(table, capacity);
+			}
+			else {
+				adjustCapacity(table, capacity);
+			}
+		}
+	}
+
+	int slot = findFreeSlot(table->control, table->capacity, key->hash);
+	if (table->control[slot] == CTRL_DELETED) table->tombstones--;
+	table->count++;
+
+	table->control[slot] = HASH_H2(key->hash);
+	table->entries[slot].key = key;
+	table->entries[slot].value = value;
+	return true;
 }
 
 void tableAddAll(Table* from, Table* to) {
 	for (int i = 0; i < from->capacity; i++) {
-		Entry* entry = &from->entries[i];
-		if (entry->key != NULL) {
+		if (IS_FULL(from->control[i])) {
+			Entry* entry = &from->entries[i];
 			tableSet(to, entry->key, entry->value);
 		}
 	}
+	for (int i = 0; i < from->oldCapacity; i++) {
+		if (IS_FULL(from->oldControl[i])) {
+			Entry* entry = &from->oldEntries[i];
+			tableSet(to, entry->key, entry->value);
+		}
+	}
+}
+
+static ObjString* findStringIn(const uint8_t* control, const Entry* entries, int capacity,
+	const char* chars, int length, uint32_t hash) {
+	if (capacity == 0) return NULL;
+
+	int mask = groupMask(capacity);
+	int group = HASH_H1(hash) & mask;
+	uint8_t h2 = HASH_H2(hash);
+
+	for (int step = 1;; step++) {
+		const uint8_t* ctrl = control + group * TABLE_GROUP_WIDTH;
+		uint32_t candidates = matchByte(ctrl, h2);
+		while (candidates != 0) {
+			ObjString* key = entries[group * TABLE_GROUP_WIDTH + lowestBit(candidates)].key;
+			if (key->length == length &&
+				key->hash == hash &&
+				memcmp(key->chars, chars, length) == 0) {
+				// We found it.
+				return key;
+			}
+			candidates &= candidates - 1;
+		}
+
+		// Stop if the group has an empty slot.
+		if (matchByte(ctrl, CTRL_EMPTY) != 0) return NULL;
+		group = (group + step) & mask;
+	}
 }
 
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
 	if (table->count == 0) return NULL;
+	if (table->oldControl != NULL) migrateSlots(table, TABLE_MIGRATE_STEP);
+
+	ObjString* key = findStringIn(table->control, table->entries, table->capacity,
+		chars, length, hash);
+	if (key == NULL && table->oldControl != NULL) {
+		key = findStringIn(table->oldControl, table->oldEntries, table->oldCapacity,
+			chars, length, hash);
+	}
+	return key;
+}
+
+void tableRemoveWhite(Table* table) {
+	for (int i = 0; i < table->capacity; i++) {
+		if (!IS_FULL(table->control[i])) continue;
+		Entry* entry = &table->entries[i];
+		if (!IS_MARKED((Obj*)entry->key)) {
+			deleteSlot(table, i);
+		}
+	}
+	// deleting the last old entry releases the old array
+	for (int i = 0; i < table->oldCapacity; i++) {
+		if (!IS_FULL(table->oldControl[i])) continue;
+		Entry* entry = &table->oldEntries[i];
+		if (!IS_MARKED((Obj*)entry->key)) {
+			deleteOldSlot(table, i);
+		}
+	}
+	compactTable(table);
+}
 
-	uint32_t index = hash % table->capacity;
-	for (;;) {
-		Entry* entry = &table->entries[index];
-		if (entry->key == NULL) {
-			// Stop if we find an empty non-tombstone entry.
-			if (IS_NIL(entry->value)) return NULL;
+// Point the entry of 'key' at 'newKey', a copy with the same hash, or
+// remove it when 'newKey' is NULL
+void tableReplaceKey(Table* table, ObjString* key, ObjString* newKey) {
+	int slot = findSlot(table, key);
+	if (slot >= 0) {
+		if (newKey != NULL) {
+			table->entries[slot].key = newKey;
 		}
-		else if (entry->key->length == length &&
-			entry->key->hash == hash &&
-			memcmp(entry->key->chars, chars, length) == 0) {
-			// We found it.
-			return entry->key;
+		else {
+			deleteSlot(table, slot);
+			compactTable(table);
 		}
+		return;
+	}
 
-		index = (index + 1) % table->capacity;
+	slot = findOldSlot(table, key);
+	if (slot >= 0) {
+		if (newKey != NULL) table->oldEntries[slot].key = newKey;
+		else deleteOldSlot(table, slot);
 	}
 }
 
-void tableRemoveWhite(Table* table) {
+void forwardTable(Table* table) {
 	for (int i = 0; i < table->capacity; i++) {
+		if (!IS_FULL(table->control[i])) continue;
 		Entry* entry = &table->entries[i];
-		if (entry->key != NULL && !entry->key->obj.isMarked) {
-			tableDelete(table, entry->key);
+		entry->key = (ObjString*)forwardObject((Obj*)entry->key);
+		forwardValue(&entry->value);
+	}
+	for (int i = 0; i < table->oldCapacity; i++) {
+		if (!IS_FULL(table->oldControl[i])) continue;
+		Entry* entry = &table->oldEntries[i];
+		entry->key = (ObjString*)forwardObject((Obj*)entry->key);
+		forwardValue(&entry->value);
+	}
+}
+
+// Live entries one by one for code outside the collector: start with
+// '*index' at 0, NULL once there are no more. The old slots of an
+// incremental resize come after the new ones.
+Entry* tableNext(Table* table, int* index) {
+	for (; *index < table->capacity + table->oldCapacity; (*index)++) {
+		int i = *index;
+		if (i < table->capacity) {
+			if (!IS_FULL(table->control[i])) continue;
+			(*index)++;
+			return &table->entries[i];
 		}
+		i -= table->capacity;
+		if (!IS_FULL(table->oldControl[i])) continue;
+		(*index)++;
+		return &table->oldEntries[i];
 	}
+	return NULL;
+}
+
+// bytes held by the slot arrays
+size_t tableMemory(Table* table) {
+	size_t bytes = 0;
+	if (table->control != NULL) bytes += allocationSize(table->capacity);
+	if (table->oldControl != NULL) bytes += allocationSize(table->oldCapacity);
+	return bytes;
 }
 
 void markTable(Table* table) {
 	for (int i = 0; i < table->capacity; i++) {
+		if (!IS_FULL(table->control[i])) continue;
 		Entry* entry = &table->entries[i];
 		markObject((Obj*)entry->key);
 		markValue(entry->value);
 	}
-}
\ No newline at end of file
+	for (int i = 0; i < table->oldCapacity; i++) {
+		if (!IS_FULL(table->oldControl[i])) continue;
+		Entry* entry = &table->oldEntries[i];
+		markObject((Obj*)entry->key);
+		markValue(entry->value);
+	}
+}
+
+// groups visited per live key and how many live keys left their home group
+void tableStats(Table* table, const char* name) {
+	int live = 0;
+	int tombstones = 0;
+	int displaced = 0;
+	long long totalProbe = 0;
+	int maxProbe = 0;
+
+	for (int i = 0; i < table->capacity; i++) {
+		if (table->control[i] == CTRL_DELETED) tombstones++;
+		if (!IS_FULL(table->control[i])) continue;
+
+		// replay the probe sequence until it reaches the key's group
+		int mask = groupMask(table->capacity);
+		int group = HASH_H1(table->entries[i].key->hash) & mask;
+		int probe = 1;
+		for (int step = 1; group != i / TABLE_GROUP_WIDTH; step++) {
+			group = (group + step) & mask;
+			probe++;
+		}
+
+		live++;
+		if (probe != 1) displaced++;
+		totalProbe += probe;
+		if (probe > maxProbe) maxProbe = probe;
+	}
+
+	printf("-- table %s --\n", name);
+	if (table->oldControl != NULL) {
+		printf("   resizing, %d keys left in the old %d slots\n",
+			table->oldCount, table->oldCapacity);
+	}
+	printf("   %d keys, %d tombstones, capacity %d (load %.2f)\n",
+		live, tombstones, table->capacity,
+		table->capacity == 0 ? 0.0 : (double)(live + tombstones) / table->capacity);
+	printf("   group probes avg %.3f max %d, displaced %d (%.1f%%)\n",
+		live == 0 ? 0.0 : (double)totalProbe / live, maxProbe,
+		displaced, live == 0 ? 0.0 : 100.0 * displaced / live);
+}
@@ -4,17 +4,37 @@
 #include "common.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+#define TABLE_MAX_LOAD 0.875
+// shrink below this load, rehash once tombstones pass this share of slots
+#define TABLE_MIN_LOAD 0.125
+#define TABLE_MAX_TOMBSTONES 0.25
+// tables growing to this many slots resize incrementally, moving
+// TABLE_MIGRATE_STEP old slots on each get, set, delete or lookup
+#define TABLE_INCREMENTAL_MIN (1 << 16)
+#define TABLE_MIGRATE_STEP 32
+// slots probed together, one control byte each
+#define TABLE_GROUP_WIDTH 16
 
 typedef struct {
 	ObjString* key;
 	Value value;
 } Entry;
 
+// Swiss table: 'control' holds one metadata byte per slot followed by the
+// entries in the same allocation, lookups scan a group of control bytes
+// and only touch entries whose cached hash fragment matches
 typedef struct {
 	int count;
+	int tombstones;
 	int capacity;
+	// previous array while an incremental resize is under way
+	int oldCount;
+	int oldCapacity;
+	int migrated;
+	uint8_t* control;
 	Entry* entries;
+	uint8_t* oldControl;
+	Entry* oldEntries;
 } Table;
 
 void initTable(Table* table);
@@ -26,5 +46,11 @@ void tableAddAll(Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 void tableRemoveWhite(Table* table);
 void markTable(Table* table);
+void tableReplaceKey(Table* table, ObjString* key, ObjString* newKey);
+void forwardTable(Table* table);
+Entry* tableNext(Table* table, int* index);
+size_t tableMemory(Table* table);
+// probe lengths, for DEBUG_TABLE_STATS and --hash-bench
+void tableStats(Table* table, const char* name);
 
 #endif
\ No newline at end of file
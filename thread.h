@@ -0,0 +1,50 @@
+#ifndef ROSE_THREAD_H
+#define ROSE_THREAD_H
+
+// Threads, locks and atomic flags for the collector's helper threads
+
+#ifdef _WIN32
+#include <windows.h>
+#define THREAD_HANDLE HANDLE
+#define THREAD_FUNCTION(name) DWORD WINAPI name(LPVOID arg)
+#define THREAD_RETURN 0
+#define START_THREAD(handle, function, arg) \
+	(((handle) = CreateThread(NULL, 0, function, arg, 0, NULL)) != NULL)
+#define JOIN_THREAD(handle) \
+	(WaitForSingleObject(handle, INFINITE), CloseHandle(handle))
+#define MUTEX CRITICAL_SECTION
+#define INIT_MUTEX(mutex) InitializeCriticalSection(mutex)
+#define LOCK_MUTEX(mutex) EnterCriticalSection(mutex)
+#define UNLOCK_MUTEX(mutex) LeaveCriticalSection(mutex)
+#define FREE_MUTEX(mutex) DeleteCriticalSection(mutex)
+// flags are longs
+#define ATOMIC_LOAD(pointer) InterlockedCompareExchange((volatile LONG*)(pointer), 0, 0)
+#define ATOMIC_STORE(pointer, value) InterlockedExchange((volatile LONG*)(pointer), value)
+#define ATOMIC_ADD(pointer, value) InterlockedExchangeAdd((volatile LONG*)(pointer), value)
+// sets bits of a byte, returning what it was
+#define ATOMIC_OR8(pointer, value) InterlockedOr8((volatile char*)(pointer), (char)(value))
+#define THREAD_LOCAL __declspec(thread)
+#define YIELD_THREAD() SwitchToThread()
+#else
+#include <pthread.h>
+#include <sched.h>
+#define THREAD_HANDLE pthread_t
+#define THREAD_FUNCTION(name) void* name(void* arg)
+#define THREAD_RETURN NULL
+#define START_THREAD(handle, function, arg) \
+	(pthread_create(&(handle), NULL, function, arg) == 0)
+#define JOIN_THREAD(handle) pthread_join(handle, NULL)
+#define MUTEX pthread_mutex_t
+#define INIT_MUTEX(mutex) pthread_mutex_init(mutex, NULL)
+#define LOCK_MUTEX(mutex) pthread_mutex_lock(mutex)
+#define UNLOCK_MUTEX(mutex) pthread_mutex_unlock(mutex)
+#define FREE_MUTEX(mutex) pthread_mutex_destroy(mutex)
+#define ATOMIC_LOAD(pointer) __atomic_load_n(pointer, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(pointer, value) __atomic_store_n(pointer, value, __ATOMIC_RELEASE)
+#define ATOMIC_ADD(pointer, value) __atomic_fetch_add(pointer, value, __ATOMIC_ACQ_REL)
+#define ATOMIC_OR8(pointer, value) __atomic_fetch_or(pointer, value, __ATOMIC_ACQ_REL)
+#define THREAD_LOCAL __thread
+#define YIELD_THREAD() sched_yield()
+#endif
+
+#endif
@@ -0,0 +1,1572 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tier.h"
+#include "chunk.h"
+#include "memory.h"
+#include "vm.h"
+
+#ifdef DEBUG_PRINT_CODE
+#include "debug.h"
+#endif
+
+// Locals and temporaries are both stack positions, so the IR follows the
+// stack: every position holds an SSA node, GET_LOCAL copies one and
+// SET_LOCAL rebinds one, and a block with several predecessors starts
+// with a phi per position. The new code is the old code with some
+// subtrees swapped for a GET_LOCAL of a slot already holding their value.
+// The registers that takes are pushed below the first local, as nils.
+
+#define MAX_REGISTERS 32
+
+typedef enum {
+    NODE_PARAM,
+    NODE_PHI,
+    NODE_CONSTANT,
+    // worked out from its arguments alone
+    NODE_PURE,
+    // a global, the same until something writes globals
+    NODE_LOAD,
+    // anything else that pushes a value
+    NODE_EFFECT,
+} NodeKind;
+
+// what a node holds if it got pushed at all
+typedef enum {
+    KNOWN_NOTHING,
+    KNOWN_ANY,
+    KNOWN_NUMBER,
+    KNOWN_BOOL,
+    KNOWN_NIL,
+    KNOWN_STRING,
+} Known;
+
+typedef struct {
+    NodeKind kind;
+    uint8_t op;
+    // constant or name index, or the position of a param or phi
+    int operand;
+    int args[2];
+    int block;
+    int instruction;
+    // union-find over nodes found to be equal
+    int same;
+    Known known;
+    // phis take one argument per predecessor from 'phiArgs'
+    int phiArgs;
+    int phiArgCount;
+    // loads are only equal between the same writes to globals
+    int epoch;
+    int reg;
+    // loop whose preheader computes it into 'reg'
+    int hoistedTo;
+    bool pending;
+} Node;
+
+typedef struct {
+    int offset;
+    int length;
+    uint8_t op;
+    int block;
+    int target;
+    int node;
+    // the stack before it, 'depth' nodes from 'state'
+    int depth;
+    int state;
+    // first instruction of the expression it pushes, -1 when that began
+    // in another block
+    int treeStart;
+    int replacePosition;
+    int replaceRegister;
+    int storeRegister;
+    bool removed;
+    // the hoist that removed it, -1 for good
+    int owner;
+    // runs before anything visible once the preheader of the loop
+    // being hoisted from has
+    bool guarded;
+} Instruction;
+
+typedef struct {
+    int first;
+    int end;
+    int preds;
+    int predCount;
+    int succs[2];
+    int succCount;
+    int entryDepth;
+    int entryState;
+    int exitState;
+    int order;
+    int idom;
+    // where its preheader and its own code start in the new code
+    int entry;
+    int label;
+} Block;
+
+typedef struct {
+    int header;
+    // A header that tests and leaves the loop is run once more before
+    // the preheader, which then jumps to 'body'. The preheader only runs
+    // when the loop does, -1 when it sits before the header instead.
+    int body;
+    int size;
+    bool* blocks;
+    // its entry edges can go through a preheader
+    bool hoists;
+} Loop;
+
+// a jump in the new code, the distance at 'at' and the block it lands on
+typedef struct {
+    int op;
+    int at;
+    int block;
+    bool back;
+} Patch;
+
+typedef struct {
+    ObjFunction* function;
+    Chunk* chunk;
+    int params;
+    // the call that made it hot, and which of its arguments the new
+    // code counts on being numbers
+    Value* args;
+    uint32_t numberArgs;
+
+    Instruction* code;
+    int count;
+
+    Block* blocks;
+    int blockCount;
+    int* preds;
+    int predCapacity;
+    int* order;
+
+    Node* nodes;
+    int nodeCount;
+    int nodeCapacity;
+    int* states;
+    int stateCount;
+    int stateCapacity;
+    int* phiArgs;
+    int phiArgCount;
+    int phiArgCapacity;
+    int maxDepth;
+
+    Loop* loops;
+    int loopCount;
+    bool* loopBlocks;
+    int* invariant;
+
+    int registers;
+    int* hoists;
+    int hoistCount;
+    int* pending;
+    int pendingCount;
+
+    Patch* patches;
+    int patchCount;
+    int patchCapacity;
+
+    uint8_t* out;
+    int outCount;
+    int outCapacity;
+} Tier;
+
+static int readIndex(uint8_t* operand) {
+    return operand[0] | (operand[1] << 8) | (operand[2] << 16) | (operand[3] << 24);
+}
+
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_LOOP || op == OP_JUMP_IF_FALSE || op == OP_POP_JUMP_IF_FALSE ||
+        op == OP_FOR_PREP || op == OP_FOR_LOOP;
+}
+
+static bool isCountedLoop(uint8_t op) {
+    return op == OP_FOR_PREP || op == OP_FOR_LOOP;
+}
+
+static bool fallsThrough(uint8_t op) {
+    return op != OP_JUMP && op != OP_LOOP && op != OP_RETURN;
+}
+
+// instructions that may run code or write globals
+static bool writesGlobals(uint8_t op) {
+    return op == OP_CALL || op == OP_CALL_NATIVE || op == OP_INVOKE || op == OP_SUPER_INVOKE ||
+        op == OP_SET_GLOBAL || op == OP_DEFINE_GLOBAL;
+}
+
+// Closures could capture the stack positions the tier renumbers, and
+// classes and imports only run once anyway.
+static bool supported(uint8_t op) {
+    switch (op) {
+    case OP_CLOSURE:
+    case OP_CLOSE_UPVALUE:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_INHERIT:
+    case OP_IMPORT:
+    case OP_INCLUDE:
+        return false;
+    default:
+        return op <= OP_RETURN;
+    }
+}
+
+static bool decode(Tier* tier) {
+    Chunk* chunk = tier->chunk;
+    int count = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (!supported(chunk->code[offset])) return false;
+        count++;
+    }
+    if (count == 0) return false;
+
+    tier->code = ALLOCATE(Instruction, count);
+    tier->count = count;
+    int* entryAt = ALLOCATE(int, chunk->count + 1);
+    for (int offset = 0; offset <= chunk->count; offset++) entryAt[offset] = -1;
+
+    for (int offset = 0, i = 0; offset < chunk->count; i++) {
+        Instruction* ins = &tier->code[i];
+        ins->offset = offset;
+        ins->length = instructionLength(chunk, offset);
+        ins->op = chunk->code[offset];
+        ins->target = -1;
+        ins->node = -1;
+        ins->treeStart = -1;
+        ins->replacePosition = -1;
+        ins->replaceRegister = -1;
+        ins->storeRegister = -1;
+        ins->removed = false;
+        ins->owner = -1;
+        ins->guarded = false;
+        entryAt[offset] = i;
+        offset += ins->length;
+    }
+
+    bool valid = true;
+    for (int i = 0; i < count && valid; i++) {
+        Instruction* ins = &tier->code[i];
+        if (!isJump(ins->op)) continue;
+
+        // the distance is the last two bytes, from the next instruction
+        int end = ins->offset + ins->length;
+        int distance = (chunk->code[end - 2] << 8) | chunk->code[end - 1];
+        int destination = end + (ins->op == OP_LOOP || ins->op == OP_FOR_LOOP ? -distance : distance);
+        valid = destination >= 0 && destination < chunk->count && entryAt[destination] != -1;
+        if (valid) ins->target = entryAt[destination];
+    }
+    FREE_ARRAY(int, entryAt, chunk->count + 1);
+    return valid;
+}
+
+static bool findBlocks(Tier* tier) {
+    bool* leader = ALLOCATE(bool, tier->count);
+    for (int i = 0; i < tier->count; i++) leader[i] = i == 0;
+    for (int i = 0; i < tier->count; i++) {
+        Instruction* ins = &tier->code[i];
+        if (isJump(ins->op)) leader[ins->target] = true;
+        if ((isJump(ins->op) || ins->op == OP_RETURN) && i + 1 < tier->count) leader[i + 1] = true;
+    }
+
+    int blockCount = 0;
+    for (int i = 0; i < tier->count; i++) {
+        if (leader[i]) blockCount++;
+    }
+    tier->blocks = ALLOCATE(Block, blockCount);
+    tier->blockCount = blockCount;
+
+    for (int i = 0, b = -1; i < tier->count; i++) {
+        if (leader[i]) {
+            b++;
+            tier->blocks[b].first = i;
+            if (b > 0) tier->blocks[b - 1].end = i;
+        }
+        tier->code[i].block = b;
+    }
+    tier->blocks[blockCount - 1].end = tier->count;
+    FREE_ARRAY(bool, leader, tier->count);
+
+    int edges = 0;
+    for (int b = 0; b < blockCount; b++) {
+        Block* block = &tier->blocks[b];
+        Instruction* last = &tier->code[block->end - 1];
+        block->succCount = 0;
+        block->predCount = 0;
+        block->entryDepth = -1;
+        block->order = -1;
+
+        if (fallsThrough(last->op)) {
+            // nothing may run off the end of the code
+            if (b + 1 == blockCount) return false;
+            block->succs[block->succCount++] = b + 1;
+        }
+        if (isJump(last->op)) block->succs[block->succCount++] = tier->code[last->target].block;
+        edges += block->succCount;
+    }
+
+    tier->preds = ALLOCATE(int, edges);
+    tier->predCapacity = edges;
+    for (int b = 0; b < blockCount; b++) {
+        for (int s = 0; s < tier->blocks[b].succCount; s++) tier->blocks[tier->blocks[b].succs[s]].predCount++;
+    }
+    for (int b = 0, at = 0; b < blockCount; b++) {
+        tier->blocks[b].preds = at;
+        at += tier->blocks[b].predCount;
+        tier->blocks[b].predCount = 0;
+    }
+    for (int b = 0; b < blockCount; b++) {
+        for (int s = 0; s < tier->blocks[b].succCount; s++) {
+            Block* succ = &tier->blocks[tier->blocks[b].succs[s]];
+            tier->preds[succ->preds + succ->predCount++] = b;
+        }
+    }
+    return true;
+}
+
+static int intersect(Tier* tier, int a, int b) {
+    while (a != b) {
+        while (tier->blocks[a].order > tier->blocks[b].order) a = tier->blocks[a].idom;
+        while (tier->blocks[b].order > tier->blocks[a].order) b = tier->blocks[b].idom;
+    }
+    return a;
+}
+
+// reverse postorder and dominators, failing on unreachable blocks
+static bool orderBlocks(Tier* tier) {
+    int blockCount = tier->blockCount;
+    int* stack = ALLOCATE(int, blockCount);
+    int* next = ALLOCATE(int, blockCount);
+    tier->order = ALLOCATE(int, blockCount);
+
+    int top = 0;
+    int post = blockCount;
+    for (int b = 0; b < blockCount; b++) next[b] = 0;
+    stack[top++] = 0;
+    tier->blocks[0].order = 0;
+    while (top > 0) {
+        Block* block = &tier->blocks[stack[top - 1]];
+        if (next[stack[top - 1]] < block->succCount) {
+            int succ = block->succs[next[stack[top - 1]]++];
+            if (tier->blocks[succ].order == -1) {
+                tier->blocks[succ].order = 0;
+                stack[top++] = succ;
+            }
+        }
+        else {
+            tier->order[--post] = stack[--top];
+        }
+    }
+    FREE_ARRAY(int, stack, blockCount);
+    FREE_ARRAY(int, next, blockCount);
+    if (post != 0) return false;
+
+    for (int i = 0; i < blockCount; i++) {
+        tier->blocks[tier->order[i]].order = i;
+        tier->blocks[tier->order[i]].idom = -1;
+    }
+
+    tier->blocks[0].idom = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 1; i < blockCount; i++) {
+            Block* block = &tier->blocks[tier->order[i]];
+            int idom = -1;
+            for (int p = 0; p < block->predCount; p++) {
+                int pred = tier->preds[block->preds + p];
+                if (tier->blocks[pred].idom == -1) continue;
+                idom = idom == -1 ? pred : intersect(tier, pred, idom);
+            }
+            if (idom != block->idom) {
+                block->idom = idom;
+                changed = true;
+            }
+        }
+    }
+    return true;
+}
+
+static bool dominates(Tier* tier, int a, int b) {
+    while (b != a && b != 0) b = tier->blocks[b].idom;
+    return b == a;
+}
+
+// values the instruction at 'index' pops and pushes
+static bool stackEffect(Tier* tier, int index, int* pops, int* pushes) {
+    Instruction* ins = &tier->code[index];
+    uint8_t* operand = &tier->chunk->code[ins->offset + 1];
+    *pops = 0;
+    *pushes = 0;
+
+    switch (ins->op) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_CONSTANT_LONG:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+        *pushes = 1;
+        return true;
+    case OP_SET_LOCAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_JUMP_IF_FALSE:
+    case OP_FOR_PREP:
+    case OP_FOR_LOOP:
+        return true;
+    case OP_POP:
+    case OP_PRINT:
+    case OP_DEFINE_GLOBAL:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_RETURN:
+        *pops = 1;
+        return true;
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_GET_PROPERTY:
+        *pops = 1;
+        *pushes = 1;
+        return true;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+        *pops = 2;
+        *pushes = 1;
+        return true;
+    case OP_CALL:
+        *pops = operand[0] + 1;
+        *pushes = 1;
+        return true;
+    case OP_CALL_NATIVE:
+        *pops = operand[sizeof(int) + 1];
+        *pushes = 1;
+        return true;
+    case OP_INVOKE:
+        *pops = operand[sizeof(int)] + 1;
+        *pushes = 1;
+        return true;
+    case OP_SUPER_INVOKE:
+        *pops = operand[sizeof(int)] + 2;
+        *pushes = 1;
+        return true;
+    case OP_ARRAY: {
+        // the element count is the constant pushed right before it
+        Instruction* count = &tier->code[index - 1];
+        if (index == 0 || count->block != ins->block || count->op != OP_CONSTANT_LONG) return false;
+        Value value = tier->chunk->constants.values[readIndex(&tier->chunk->code[count->offset + 1])];
+        if (!IS_NUMBER(value) || AS_NUMBER(value) < 0 || AS_NUMBER(value) > UINT8_COUNT) return false;
+        *pops = (int)AS_NUMBER(value) + 1;
+        *pushes = 1;
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+static bool needsPhis(Tier* tier, int block) {
+    return tier->blocks[block].predCount + (block == 0 ? 1 : 0) > 1;
+}
+
+// the stack depth before every instruction, the same on every path
+static bool measureDepths(Tier* tier) {
+    tier->blocks[0].entryDepth = tier->params;
+    tier->maxDepth = tier->params;
+
+    for (int i = 0; i < tier->blockCount; i++) {
+        Block* block = &tier->blocks[tier->order[i]];
+        int depth = block->entryDepth;
+
+        for (int index = block->first; index < block->end; index++) {
+            Instruction* ins = &tier->code[index];
+            int pops, pushes;
+            if (!stackEffect(tier, index, &pops, &pushes) || pops > depth) return false;
+            if ((ins->op == OP_GET_LOCAL || ins->op == OP_SET_LOCAL || isCountedLoop(ins->op)) &&
+                tier->chunk->code[ins->offset + 1] >= depth) return false;
+            if (isCountedLoop(ins->op) && tier->chunk->code[ins->offset + 2] >= depth) return false;
+
+            ins->depth = depth;
+            depth += pushes - pops;
+            if (depth > tier->maxDepth) tier->maxDepth = depth;
+        }
+
+        for (int s = 0; s < block->succCount; s++) {
+            Block* succ = &tier->blocks[block->succs[s]];
+            if (succ->entryDepth == -1) succ->entryDepth = depth;
+            else if (succ->entryDepth != depth) return false;
+        }
+    }
+    return tier->maxDepth < UINT8_COUNT;
+}
+
+static int find(Tier* tier, int node) {
+    while (tier->nodes[node].same != node) {
+        tier->nodes[node].same = tier->nodes[tier->nodes[node].same].same;
+        node = tier->nodes[node].same;
+    }
+    return node;
+}
+
+static int newNode(Tier* tier, NodeKind kind, uint8_t op, int block, int instruction) {
+    Node* node = &tier->nodes[tier->nodeCount];
+    node->kind = kind;
+    node->op = op;
+    node->operand = -1;
+    node->args[0] = -1;
+    node->args[1] = -1;
+    node->block = block;
+    node->instruction = instruction;
+    node->same = tier->nodeCount;
+    node->known = KNOWN_NOTHING;
+    node->phiArgs = -1;
+    node->phiArgCount = 0;
+    node->epoch = 0;
+    node->reg = -1;
+    node->hoistedTo = -1;
+    node->pending = false;
+    return tier->nodeCount++;
+}
+
+static int saveState(Tier* tier, int* stack, int depth) {
+    int state = tier->stateCount;
+    memcpy(&tier->states[state], stack, sizeof(int) * depth);
+    tier->stateCount += depth;
+    return state;
+}
+
+static void buildGraph(Tier* tier) {
+    tier->nodeCapacity = tier->params + tier->count;
+    tier->stateCapacity = 0;
+    tier->phiArgCapacity = 0;
+    for (int b = 0; b < tier->blockCount; b++) {
+        Block* block = &tier->blocks[b];
+        if (needsPhis(tier, b)) {
+            tier->nodeCapacity += block->entryDepth;
+            tier->phiArgCapacity += block->entryDepth * (block->predCount + (b == 0 ? 1 : 0));
+        }
+        // the block's entry and exit, and the exit is no deeper than the max
+        tier->stateCapacity += block->entryDepth + tier->maxDepth;
+        for (int i = block->first; i < block->end; i++) tier->stateCapacity += tier->code[i].depth;
+    }
+    tier->nodes = ALLOCATE(Node, tier->nodeCapacity);
+    tier->states = ALLOCATE(int, tier->stateCapacity);
+    tier->phiArgs = ALLOCATE(int, tier->phiArgCapacity);
+
+    for (int slot = 0; slot < tier->params; slot++) {
+        int node = newNode(tier, NODE_PARAM, 0, -1, -1);
+        tier->nodes[node].operand = slot;
+    }
+
+    int* stack = ALLOCATE(int, tier->maxDepth + 1);
+    int* starts = ALLOCATE(int, tier->maxDepth + 1);
+    int* exitDepth = ALLOCATE(int, tier->blockCount);
+
+    for (int i = 0; i < tier->blockCount; i++) {
+        int b = tier->order[i];
+        Block* block = &tier->blocks[b];
+        int depth = block->entryDepth;
+
+        for (int slot = 0; slot < depth; slot++) {
+            if (needsPhis(tier, b)) {
+                stack[slot] = newNode(tier, NODE_PHI, 0, b, -1);
+                tier->nodes[stack[slot]].operand = slot;
+            }
+            else if (b == 0) {
+                stack[slot] = slot;
+            }
+            else {
+                stack[slot] = tier->states[tier->blocks[tier->preds[block->preds]].exitState + slot];
+            }
+            starts[slot] = -1;
+        }
+        block->entryState = saveState(tier, stack, depth);
+
+        for (int index = block->first; index < block->end; index++) {
+            Instruction* ins = &tier->code[index];
+            uint8_t* operand = &tier->chunk->code[ins->offset + 1];
+            int pops, pushes;
+            stackEffect(tier, index, &pops, &pushes);
+            ins->state = saveState(tier, stack, depth);
+
+            int start = index;
+            for (int slot = depth - pops; slot < depth; slot++) {
+                if (slot == depth - pops) start = starts[slot];
+                if (starts[slot] == -1) start = -1;
+            }
+
+            int node = -1;
+            switch (ins->op) {
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                node = newNode(tier, NODE_CONSTANT, ins->op, b, index);
+                break;
+            case OP_CONSTANT_LONG:
+                node = newNode(tier, NODE_CONSTANT, ins->op, b, index);
+                tier->nodes[node].operand = readIndex(operand);
+                break;
+            case OP_NOT:
+            case OP_NEGATE:
+                node = newNode(tier, NODE_PURE, ins->op, b, index);
+                tier->nodes[node].args[0] = stack[depth - 1];
+                break;
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+                node = newNode(tier, NODE_PURE, ins->op, b, index);
+                tier->nodes[node].args[0] = stack[depth - 2];
+                tier->nodes[node].args[1] = stack[depth - 1];
+                break;
+            case OP_GET_GLOBAL:
+                node = newNode(tier, NODE_LOAD, ins->op, b, index);
+                tier->nodes[node].operand = readIndex(operand);
+                break;
+            case OP_SET_LOCAL:
+                stack[operand[0]] = stack[depth - 1];
+                break;
+            case OP_FOR_LOOP:
+                // the counter it steps is a new value every time round
+                node = newNode(tier, NODE_EFFECT, ins->op, b, index);
+                stack[operand[0]] = node;
+                break;
+            default:
+                if (pushes > 0 && ins->op != OP_GET_LOCAL) node = newNode(tier, NODE_EFFECT, ins->op, b, index);
+                break;
+            }
+
+            int pushed = ins->op == OP_GET_LOCAL ? stack[operand[0]] : node;
+            depth -= pops;
+            if (pushes > 0) {
+                stack[depth] = pushed;
+                starts[depth] = start;
+                depth++;
+                ins->treeStart = start;
+            }
+            ins->node = node;
+        }
+
+        block->exitState = saveState(tier, stack, depth);
+        exitDepth[b] = depth;
+    }
+
+    for (int n = 0; n < tier->nodeCount; n++) {
+        Node* node = &tier->nodes[n];
+        if (node->kind != NODE_PHI) continue;
+
+        Block* block = &tier->blocks[node->block];
+        node->phiArgs = tier->phiArgCount;
+        if (node->block == 0) tier->phiArgs[tier->phiArgCount++] = node->operand;
+        for (int p = 0; p < block->predCount; p++) {
+            int pred = tier->preds[block->preds + p];
+            tier->phiArgs[tier->phiArgCount++] = tier->states[tier->blocks[pred].exitState + node->operand];
+        }
+        node->phiArgCount = tier->phiArgCount - node->phiArgs;
+    }
+
+    FREE_ARRAY(int, stack, tier->maxDepth + 1);
+    FREE_ARRAY(int, starts, tier->maxDepth + 1);
+    FREE_ARRAY(int, exitDepth, tier->blockCount);
+}
+
+// A phi whose arguments are all one node, or itself, is that node. This
+// is also what propagates copies: a local that is never reassigned in a
+// loop reads the value it had before it.
+static void removeTrivialPhis(Tier* tier) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int n = 0; n < tier->nodeCount; n++) {
+            Node* node = &tier->nodes[n];
+            if (node->kind != NODE_PHI || find(tier, n) != n) continue;
+
+            int value = -1;
+            bool trivial = true;
+            for (int a = 0; a < node->phiArgCount && trivial; a++) {
+                int arg = find(tier, tier->phiArgs[node->phiArgs + a]);
+                if (arg == n) continue;
+                if (value == -1) value = arg;
+                else if (arg != value) trivial = false;
+            }
+
+            if (trivial && value != -1) {
+                node->same = value;
+                changed = true;
+            }
+        }
+    }
+}
+
+// Params that were numbers on the call that made the function hot and
+// that it does arithmetic on are taken to be numbers from then on; a
+// call that passes something else runs the code the function had.
+static void speculate(Tier* tier) {
+    for (int n = 0; n < tier->nodeCount; n++) {
+        Node* node = &tier->nodes[n];
+        if (node->kind != NODE_PURE || node->op == OP_NOT || node->op == OP_EQUAL) continue;
+
+        for (int a = 0; a < 2; a++) {
+            if (node->args[a] == -1) continue;
+            Node* arg = &tier->nodes[find(tier, node->args[a])];
+            int slot = arg->operand;
+            if (arg->kind == NODE_PARAM && slot > 0 && slot <= 32 && IS_NUMBER(tier->args[slot - 1])) {
+                tier->numberArgs |= 1u << (slot - 1);
+            }
+        }
+    }
+}
+
+static Known knownArg(Tier* tier, Node* node, int arg) {
+    return tier->nodes[find(tier, node->args[arg])].known;
+}
+
+static Known knownConstant(Tier* tier, Node* node) {
+    if (node->op == OP_NIL) return KNOWN_NIL;
+    if (node->op != OP_CONSTANT_LONG) return KNOWN_BOOL;
+
+    Value value = tier->chunk->constants.values[node->operand];
+    if (IS_NUMBER(value)) return KNOWN_NUMBER;
+    if (IS_STRING(value)) return KNOWN_STRING;
+    return KNOWN_ANY;
+}
+
+// An instruction that traps on the wrong operands leaves the rest of
+// the code assuming it did not, so that is what its result holds.
+static void inferKnown(Tier* tier) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int n = 0; n < tier->nodeCount; n++) {
+            Node* node = &tier->nodes[n];
+            if (find(tier, n) != n) continue;
+
+            Known known = KNOWN_ANY;
+            switch (node->kind) {
+            case NODE_PARAM:
+                if (node->operand > 0 && (tier->numberArgs & (1u << (node->operand - 1)))) known = KNOWN_NUMBER;
+                break;
+            case NODE_CONSTANT:
+                known = knownConstant(tier, node);
+                break;
+            case NODE_PHI:
+                known = KNOWN_NOTHING;
+                for (int a = 0; a < node->phiArgCount; a++) {
+                    Known arg = tier->nodes[find(tier, tier->phiArgs[node->phiArgs + a])].known;
+                    if (arg == KNOWN_NOTHING) continue;
+                    known = known == KNOWN_NOTHING || known == arg ? arg : KNOWN_ANY;
+                }
+                break;
+            case NODE_PURE:
+                switch (node->op) {
+                case OP_NOT:
+                case OP_EQUAL:
+                case OP_GREATER:
+                case OP_LESS:
+                    known = KNOWN_BOOL;
+                    break;
+                case OP_ADD: {
+                    Known a = knownArg(tier, node, 0);
+                    Known b = knownArg(tier, node, 1);
+                    if (a == KNOWN_NOTHING || b == KNOWN_NOTHING) known = KNOWN_NOTHING;
+                    else if (a == KNOWN_NUMBER || b == KNOWN_NUMBER) known = KNOWN_NUMBER;
+                    else if (a == KNOWN_STRING || b == KNOWN_STRING) known = KNOWN_STRING;
+                    break;
+                }
+                default:
+                    known = KNOWN_NUMBER;
+                    break;
+                }
+                break;
+            default:
+                break;
+            }
+
+            if (known != node->known) {
+                node->known = known;
+                changed = true;
+            }
+        }
+    }
+}
+
+static bool canTrap(Tier* tier, Node* node) {
+    if (node->kind == NODE_CONSTANT) return false;
+    if (node->kind != NODE_PURE) return true;
+
+    switch (node->op) {
+    case OP_NOT:
+    case OP_EQUAL:
+        return false;
+    case OP_NEGATE:
+        return knownArg(tier, node, 0) != KNOWN_NUMBER;
+    case OP_ADD: {
+        Known a = knownArg(tier, node, 0);
+        Known b = knownArg(tier, node, 1);
+        return !((a == KNOWN_NUMBER && b == KNOWN_NUMBER) || (a == KNOWN_STRING && b == KNOWN_STRING));
+    }
+    default:
+        return knownArg(tier, node, 0) != KNOWN_NUMBER || knownArg(tier, node, 1) != KNOWN_NUMBER;
+    }
+}
+
+static uint32_t hashNode(Tier* tier, Node* node) {
+    uint32_t hash = node->op * 31u + (uint32_t)node->operand;
+    for (int a = 0; a < 2; a++) {
+        int arg = node->args[a] == -1 ? -1 : find(tier, node->args[a]);
+        hash = hash * 31u + (uint32_t)arg;
+    }
+    return hash * 31u + (uint32_t)node->epoch;
+}
+
+static bool sameValue(Tier* tier, Node* a, Node* b) {
+    if (a->kind != b->kind || a->op != b->op || a->operand != b->operand || a->epoch != b->epoch) return false;
+    for (int arg = 0; arg < 2; arg++) {
+        if ((a->args[arg] == -1) != (b->args[arg] == -1)) return false;
+        if (a->args[arg] != -1 && find(tier, a->args[arg]) != find(tier, b->args[arg])) return false;
+    }
+    return true;
+}
+
+// Global value numbering in dominator order. Constants are equal
+// wherever they are; a computation is only replaced by one that
+// dominates it, and a global load only by one in the same block with no
+// call or global write between them.
+static void numberValues(Tier* tier) {
+    int capacity = 16;
+    while (capacity < tier->nodeCount * 2) capacity *= 2;
+    int* table = ALLOCATE(int, capacity);
+    for (int i = 0; i < capacity; i++) table[i] = -1;
+
+    int epoch = 0;
+    for (int i = 0; i < tier->blockCount; i++) {
+        Block* block = &tier->blocks[tier->order[i]];
+        epoch++;
+
+        for (int index = block->first; index < block->end; index++) {
+            Instruction* ins = &tier->code[index];
+            if (writesGlobals(ins->op)) epoch++;
+            if (ins->node == -1) continue;
+
+            Node* node = &tier->nodes[ins->node];
+            if (node->kind != NODE_CONSTANT && node->kind != NODE_PURE && node->kind != NODE_LOAD) continue;
+            if (node->kind == NODE_LOAD) node->epoch = epoch;
+
+            uint32_t slot = hashNode(tier, node) & (capacity - 1);
+            for (; table[slot] != -1; slot = (slot + 1) & (capacity - 1)) {
+                Node* other = &tier->nodes[table[slot]];
+                if (!sameValue(tier, node, other)) continue;
+                if (node->kind == NODE_CONSTANT || dominates(tier, other->block, node->block)) {
+                    node->same = table[slot];
+                    break;
+                }
+            }
+            if (table[slot] == -1) table[slot] = ins->node;
+        }
+    }
+    FREE_ARRAY(int, table, capacity);
+}
+
+static bool inLoop(Tier* tier, int loop, int node) {
+    Node* n = &tier->nodes[node];
+    return n->block != -1 && tier->loops[loop].blocks[n->block];
+}
+
+// the block a loop's preheader runs right before
+static int siteOf(Tier* tier, int loop) {
+    Loop* l = &tier->loops[loop];
+    return l->body != -1 ? l->body : l->header;
+}
+
+static void findLoops(Tier* tier) {
+    int blockCount = tier->blockCount;
+    tier->loops = ALLOCATE(Loop, blockCount);
+    tier->loopBlocks = ALLOCATE(bool, blockCount * blockCount);
+    tier->loopCount = 0;
+    int* work = ALLOCATE(int, blockCount);
+
+    for (int i = 0; i < blockCount; i++) {
+        int header = tier->order[i];
+        Block* block = &tier->blocks[header];
+        Loop* loop = NULL;
+
+        for (int p = 0; p < block->predCount; p++) {
+            int latch = tier->preds[block->preds + p];
+            if (!dominates(tier, header, latch)) continue;
+
+            if (loop == NULL) {
+                loop = &tier->loops[tier->loopCount];
+                loop->header = header;
+                loop->blocks = &tier->loopBlocks[tier->loopCount * blockCount];
+                loop->size = 1;
+                loop->hoists = true;
+                for (int b = 0; b < blockCount; b++) loop->blocks[b] = b == header;
+                tier->loopCount++;
+            }
+
+            // everything that reaches the latch without the header
+            int top = 0;
+            if (!loop->blocks[latch]) {
+                loop->blocks[latch] = true;
+                loop->size++;
+                work[top++] = latch;
+            }
+            while (top > 0) {
+                Block* member = &tier->blocks[work[--top]];
+                for (int q = 0; q < member->predCount; q++) {
+                    int pred = tier->preds[member->preds + q];
+                    if (loop->blocks[pred]) continue;
+                    loop->blocks[pred] = true;
+                    loop->size++;
+                    work[top++] = pred;
+                }
+            }
+
+            // a preheader sits right before the header, which a latch
+            // falling into it would run every time round
+            if (latch == header - 1 && fallsThrough(tier->code[tier->blocks[latch].end - 1].op)) {
+                loop->hoists = false;
+            }
+        }
+        if (loop == NULL) continue;
+
+        Instruction* test = &tier->code[block->end - 1];
+        loop->body = -1;
+        if ((test->op == OP_JUMP_IF_FALSE || test->op == OP_POP_JUMP_IF_FALSE) && header + 1 < blockCount &&
+            loop->blocks[header + 1] && tier->blocks[header + 1].predCount == 1 &&
+            !loop->blocks[tier->code[test->target].block]) {
+            loop->body = header + 1;
+        }
+    }
+    FREE_ARRAY(int, work, blockCount);
+
+    // outer loops first, so invariants move as far out as they can
+    for (int i = 1; i < tier->loopCount; i++) {
+        Loop loop = tier->loops[i];
+        int j = i;
+        for (; j > 0 && tier->loops[j - 1].size < loop.size; j--) tier->loops[j] = tier->loops[j - 1];
+        tier->loops[j] = loop;
+    }
+}
+
+// nothing outside can tell it ran
+static bool silent(Tier* tier, int index) {
+    Instruction* ins = &tier->code[index];
+    switch (ins->op) {
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_POP:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_CONSTANT_LONG:
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+        return true;
+    default: {
+        if (ins->node == -1) return false;
+        Node* node = &tier->nodes[ins->node];
+        if (node->kind != NODE_PURE && node->kind != NODE_LOAD) return false;
+        // what it would trap on was computed without trapping already
+        return find(tier, ins->node) != ins->node || !canTrap(tier, node);
+    }
+    }
+}
+
+static bool loopWritesGlobal(Tier* tier, int loop, int name) {
+    Value global = tier->chunk->constants.values[name];
+    for (int b = 0; b < tier->blockCount; b++) {
+        if (!tier->loops[loop].blocks[b]) continue;
+        for (int index = tier->blocks[b].first; index < tier->blocks[b].end; index++) {
+            Instruction* ins = &tier->code[index];
+            if (ins->op == OP_CALL || ins->op == OP_CALL_NATIVE || ins->op == OP_INVOKE ||
+                ins->op == OP_SUPER_INVOKE) return true;
+            if ((ins->op == OP_SET_GLOBAL || ins->op == OP_DEFINE_GLOBAL) &&
+                valuesEqual(tier->chunk->constants.values[readIndex(&tier->chunk->code[ins->offset + 1])], global)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// A value that can trap is only the same every time round if the
+// preheader can compute it in its place, guarded.
+static bool isInvariant(Tier* tier, int loop, int n) {
+    n = find(tier, n);
+    if (tier->invariant[n] != 0) return tier->invariant[n] == 1;
+
+    Node* node = &tier->nodes[n];
+    bool invariant;
+    if (node->kind == NODE_CONSTANT || !inLoop(tier, loop, n)) {
+        invariant = true;
+    }
+    else if (node->kind == NODE_PURE) {
+        invariant = isInvariant(tier, loop, node->args[0]) &&
+            (node->args[1] == -1 || isInvariant(tier, loop, node->args[1])) &&
+            (!canTrap(tier, node) || tier->code[node->instruction].guarded);
+    }
+    else if (node->kind == NODE_LOAD) {
+        invariant = tier->code[node->instruction].guarded;
+    }
+    else {
+        invariant = false;
+    }
+
+    tier->invariant[n] = invariant ? 1 : 2;
+    return invariant;
+}
+
+// computes a value that stays the same round the loop, trapping or not
+static bool hoistable(Tier* tier, int loop, int index) {
+    Instruction* ins = &tier->code[index];
+    if (ins->node == -1 || find(tier, ins->node) != ins->node || !inLoop(tier, loop, ins->node)) return false;
+
+    Node* node = &tier->nodes[ins->node];
+    if (node->kind == NODE_LOAD) return !loopWritesGlobal(tier, loop, node->operand);
+    return node->kind == NODE_PURE && isInvariant(tier, loop, node->args[0]) &&
+        (node->args[1] == -1 || isInvariant(tier, loop, node->args[1]));
+}
+
+// The instructions that run first once the preheader has, up to the
+// first one that might be seen and does not compute an invariant. A
+// rotated loop has run its whole header by then.
+static int nextGuarded(Tier* tier, int loop, int block) {
+    Block* b = &tier->blocks[block];
+    if (b->succCount != 1) return -1;
+    int next = b->succs[0];
+    return next > block && tier->loops[loop].blocks[next] && next != tier->loops[loop].header ? next : -1;
+}
+
+static void guardPath(Tier* tier, int loop) {
+    Loop* l = &tier->loops[loop];
+    for (int i = 0; i < tier->count; i++) tier->code[i].guarded = false;
+    for (int n = 0; n < tier->nodeCount; n++) tier->invariant[n] = 0;
+
+    if (l->body != -1) {
+        Block* header = &tier->blocks[l->header];
+        for (int i = header->first; i < header->end; i++) {
+            if (hoistable(tier, loop, i)) tier->code[i].guarded = true;
+        }
+    }
+
+    for (int b = siteOf(tier, loop); b != -1; b = nextGuarded(tier, loop, b)) {
+        for (int i = tier->blocks[b].first; i < tier->blocks[b].end; i++) {
+            if (hoistable(tier, loop, i)) tier->code[i].guarded = true;
+            else if (!silent(tier, i)) return;
+        }
+    }
+}
+
+// the first guarded instruction that still runs in the loop and might
+// be seen, after which nothing that traps may be hoisted
+static int firstVisible(Tier* tier, int loop) {
+    for (int b = siteOf(tier, loop); b != -1; b = nextGuarded(tier, loop, b)) {
+        for (int i = tier->blocks[b].first; i < tier->blocks[b].end; i++) {
+            Instruction* ins = &tier->code[i];
+            if (!ins->removed && ins->replaceRegister == -1 && !silent(tier, i)) return i;
+        }
+    }
+    return tier->count;
+}
+
+static bool hoistTraps(Tier* tier, int n) {
+    Node* node = &tier->nodes[find(tier, n)];
+    // anything else is read, not computed again
+    if (node->kind != NODE_PURE && node->kind != NODE_LOAD) return false;
+    if (canTrap(tier, node)) return true;
+    for (int a = 0; a < 2; a++) {
+        if (node->args[a] != -1 && hoistTraps(tier, node->args[a])) return true;
+    }
+    return false;
+}
+
+// the position holding 'node' in a saved state, or -1
+static int positionOf(Tier* tier, int state, int depth, int node) {
+    for (int slot = depth - 1; slot >= 0; slot--) {
+        if (find(tier, tier->states[state + slot]) == node) return slot;
+    }
+    return -1;
+}
+
+static int sitePosition(Tier* tier, int loop, int node) {
+    Block* site = &tier->blocks[siteOf(tier, loop)];
+    return positionOf(tier, site->entryState, site->entryDepth, node);
+}
+
+// a register another preheader filled before this one runs
+static bool hoistedBefore(Tier* tier, int loop, Node* node) {
+    return node->hoistedTo != -1 && node->hoistedTo != loop &&
+        dominates(tier, siteOf(tier, node->hoistedTo), siteOf(tier, loop));
+}
+
+// Whether the preheader of 'loop' can compute 'node': from constants,
+// the stack it runs on and registers filled before it, or by working
+// it out again.
+static bool materializable(Tier* tier, int loop, int n) {
+    n = find(tier, n);
+    Node* node = &tier->nodes[n];
+
+    if (node->kind == NODE_CONSTANT || hoistedBefore(tier, loop, node)) return true;
+    if (sitePosition(tier, loop, n) != -1) return true;
+
+    // a load outside the loop may have been written since
+    if (node->kind != NODE_PURE && !(node->kind == NODE_LOAD && inLoop(tier, loop, n))) return false;
+    for (int a = 0; a < 2; a++) {
+        if (node->args[a] != -1 && !materializable(tier, loop, node->args[a])) return false;
+    }
+    return true;
+}
+
+// The instructions from 'start' to 'index' compute what 'index' pushes
+// and nothing else, within a block. 'merged' asks that every value in
+// them is computed somewhere else as well.
+static bool removableTree(Tier* tier, int start, int index, bool merged) {
+    if (start == -1) return false;
+    for (int i = start; i <= index; i++) {
+        Instruction* ins = &tier->code[i];
+        if (ins->block != tier->code[index].block || ins->storeRegister != -1) return false;
+
+        switch (ins->op) {
+        case OP_GET_LOCAL:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_CONSTANT_LONG:
+            continue;
+        default:
+            if (ins->node == -1) return false;
+            if (tier->nodes[ins->node].kind != NODE_PURE && tier->nodes[ins->node].kind != NODE_LOAD) return false;
+            if (merged && find(tier, ins->node) == ins->node) return false;
+            break;
+        }
+    }
+    return true;
+}
+
+static void removeTree(Tier* tier, int start, int index, int owner) {
+    for (int i = start; i < index; i++) {
+        if (tier->code[i].removed) continue;
+        tier->code[i].removed = true;
+        tier->code[i].owner = owner;
+    }
+}
+
+static int newRegister(Tier* tier) {
+    if (tier->registers == MAX_REGISTERS || tier->maxDepth + tier->registers + 1 >= UINT8_COUNT) return -1;
+    return tier->registers++;
+}
+
+#define PENDING_REGISTER -2
+
+// put back what hoisting 'n' took out of the loop
+static void cancelHoist(Tier* tier, int n) {
+    for (int i = 0; i < tier->count; i++) {
+        Instruction* ins = &tier->code[i];
+        if (ins->replaceRegister != PENDING_REGISTER || find(tier, ins->node) != n) continue;
+
+        ins->replaceRegister = -1;
+        for (int k = ins->treeStart; k < i; k++) {
+            if (tier->code[k].owner == n) {
+                tier->code[k].removed = false;
+                tier->code[k].owner = -1;
+            }
+        }
+    }
+    tier->nodes[n].pending = false;
+}
+
+static void hoistFrom(Tier* tier, int loop) {
+    guardPath(tier, loop);
+    tier->pendingCount = 0;
+
+    // outermost expressions first, they take their operands along
+    for (int b = tier->blockCount - 1; b >= 0; b--) {
+        if (!tier->loops[loop].blocks[b]) continue;
+
+        for (int index = tier->blocks[b].end - 1; index >= tier->blocks[b].first; index--) {
+            Instruction* ins = &tier->code[index];
+            if (ins->removed || ins->node == -1 || ins->replaceRegister != -1) continue;
+
+            int n = find(tier, ins->node);
+            Node* node = &tier->nodes[n];
+            if (node->kind != NODE_PURE && node->kind != NODE_LOAD) continue;
+            if (!inLoop(tier, loop, n) || !isInvariant(tier, loop, n)) continue;
+            if (!removableTree(tier, ins->treeStart, index, false) || !materializable(tier, loop, n)) continue;
+
+            if (!node->pending) {
+                node->pending = true;
+                tier->pending[tier->pendingCount++] = n;
+            }
+            removeTree(tier, ins->treeStart, index, n);
+            ins->replaceRegister = PENDING_REGISTER;
+        }
+    }
+
+    // Whatever traps has to trap in the order it did. Putting one back
+    // can uncover an instruction before others, so go until none move.
+    Loop* l = &tier->loops[loop];
+    bool cancelled = true;
+    while (cancelled) {
+        cancelled = false;
+        int visible = firstVisible(tier, loop);
+        for (int p = 0; p < tier->pendingCount; p++) {
+            int n = tier->pending[p];
+            Node* node = &tier->nodes[n];
+            bool ranHeader = l->body != -1 && node->block == l->header;
+            if (node->pending && node->instruction > visible && !ranHeader && hoistTraps(tier, n)) {
+                cancelHoist(tier, n);
+                cancelled = true;
+            }
+        }
+    }
+
+    // in program order, so running out of registers drops the later ones
+    for (int p = 1; p < tier->pendingCount; p++) {
+        int n = tier->pending[p];
+        int q = p;
+        for (; q > 0 && tier->nodes[tier->pending[q - 1]].instruction > tier->nodes[n].instruction; q--) {
+            tier->pending[q] = tier->pending[q - 1];
+        }
+        tier->pending[q] = n;
+    }
+
+    bool full = false;
+    for (int p = 0; p < tier->pendingCount; p++) {
+        int n = tier->pending[p];
+        Node* node = &tier->nodes[n];
+        if (!node->pending) continue;
+
+        if (!full) node->reg = newRegister(tier);
+        full = full || node->reg == -1;
+        if (full) {
+            cancelHoist(tier, n);
+            continue;
+        }
+
+        node->pending = false;
+        node->hoistedTo = loop;
+        tier->hoists[tier->hoistCount++] = n;
+        for (int i = 0; i < tier->count; i++) {
+            Instruction* ins = &tier->code[i];
+            if (ins->replaceRegister == PENDING_REGISTER && find(tier, ins->node) == n) ins->replaceRegister = node->reg;
+        }
+        for (int i = 0; i < tier->count; i++) {
+            if (tier->code[i].owner == n) tier->code[i].owner = -1;
+        }
+    }
+}
+
+static void hoistInvariants(Tier* tier) {
+    tier->hoists = ALLOCATE(int, tier->nodeCapacity);
+    tier->pending = ALLOCATE(int, tier->nodeCapacity);
+    tier->invariant = ALLOCATE(int, tier->nodeCapacity);
+
+    for (int loop = 0; loop < tier->loopCount; loop++) {
+        if (tier->loops[loop].hoists) hoistFrom(tier, loop);
+    }
+}
+
+// instructions left between 'start' and 'index'
+static int treeSize(Tier* tier, int start, int index) {
+    int size = 0;
+    for (int i = start; i <= index; i++) {
+        if (!tier->code[i].removed) size++;
+    }
+    return size;
+}
+
+// Swap computations of a value already worked out for a read of where
+// it is: a register a preheader filled, a stack position still holding
+// it, or a register stored right after the first computation.
+static void eliminateCommon(Tier* tier) {
+    for (int index = 0; index < tier->count; index++) {
+        Instruction* ins = &tier->code[index];
+        if (ins->removed || ins->node == -1 || ins->replaceRegister != -1) continue;
+
+        int n = find(tier, ins->node);
+        Node* node = &tier->nodes[n];
+        if (n == ins->node || (node->kind != NODE_PURE && node->kind != NODE_LOAD)) continue;
+        if (!removableTree(tier, ins->treeStart, index, true)) continue;
+
+        Instruction* start = &tier->code[ins->treeStart];
+        int size = treeSize(tier, ins->treeStart, index);
+        int position = positionOf(tier, start->state, start->depth, n);
+
+        if (node->hoistedTo != -1 && (tier->loops[node->hoistedTo].blocks[ins->block] ||
+            dominates(tier, siteOf(tier, node->hoistedTo), ins->block))) {
+            ins->replaceRegister = node->reg;
+        }
+        else if (position != -1 && size >= 2) {
+            ins->replacePosition = position;
+        }
+        else if (size >= 4 && node->instruction != -1 && !tier->code[node->instruction].removed &&
+            tier->code[node->instruction].replaceRegister == -1) {
+            if (node->reg == -1) {
+                node->reg = newRegister(tier);
+                if (node->reg == -1) continue;
+                tier->code[node->instruction].storeRegister = node->reg;
+            }
+            ins->replaceRegister = node->reg;
+        }
+        else {
+            continue;
+        }
+        removeTree(tier, ins->treeStart, index, -1);
+    }
+}
+
+static void emitByte(Tier* tier, uint8_t byte) {
+    if (tier->outCapacity < tier->outCount + 1) {
+        int oldCapacity = tier->outCapacity;
+        tier->outCapacity = GROW_CAPACITY(oldCapacity);
+        tier->out = GROW_ARRAY(uint8_t, tier->out, oldCapacity, tier->outCapacity);
+    }
+    tier->out[tier->outCount++] = byte;
+}
+
+static void emitIndex(Tier* tier, int index) {
+    for (int i = 0; i < (int)sizeof(int); i++) emitByte(tier, (index >> (8 * i)) & 0xff);
+}
+
+// The distance is filled in once every block has been laid out. 'op'
+// is where the jump's opcode went, its other operands coming before.
+static void emitDistance(Tier* tier, int op, int block, bool back) {
+    if (tier->patchCapacity < tier->patchCount + 1) {
+        int oldCapacity = tier->patchCapacity;
+        tier->patchCapacity = GROW_CAPACITY(oldCapacity);
+        tier->patches = GROW_ARRAY(Patch, tier->patches, oldCapacity, tier->patchCapacity);
+    }
+    tier->patches[tier->patchCount++] = (Patch){ op, tier->outCount, block, back };
+    emitByte(tier, 0xff);
+    emitByte(tier, 0xff);
+}
+
+static void emitJump(Tier* tier, uint8_t op, int block, bool back) {
+    emitByte(tier, op);
+    emitDistance(tier, tier->outCount - 1, block, back);
+}
+
+// registers sit right above the params, locals move up past them
+static int slotOf(Tier* tier, int position) {
+    return position < tier->params ? position : position + tier->registers;
+}
+
+static int registerSlot(Tier* tier, int reg) {
+    return tier->params + reg;
+}
+
+static void emitMaterialized(Tier* tier, int loop, int n) {
+    n = find(tier, n);
+    Node* node = &tier->nodes[n];
+    int position;
+
+    if (node->kind == NODE_CONSTANT) {
+        emitByte(tier, node->op);
+        if (node->op == OP_CONSTANT_LONG) emitIndex(tier, node->operand);
+    }
+    else if (hoistedBefore(tier, loop, node)) {
+        emitByte(tier, OP_GET_LOCAL);
+        emitByte(tier, registerSlot(tier, node->reg));
+    }
+    else if ((position = sitePosition(tier, loop, n)) != -1) {
+        emitByte(tier, OP_GET_LOCAL);
+        emitByte(tier, slotOf(tier, position));
+    }
+    else {
+        for (int a = 0; a < 2; a++) {
+            if (node->args[a] != -1) emitMaterialized(tier, loop, node->args[a]);
+        }
+        emitByte(tier, node->op);
+        if (node->kind == NODE_LOAD) emitIndex(tier, node->operand);
+    }
+}
+
+static void emitPreheader(Tier* tier, int loop) {
+    // in the order the loop computed them, so traps keep their order
+    for (;;) {
+        int next = -1;
+        for (int h = 0; h < tier->hoistCount; h++) {
+            Node* node = &tier->nodes[tier->hoists[h]];
+            if (node->hoistedTo != loop) continue;
+            if (next == -1 || node->instruction < tier->nodes[tier->hoists[next]].instruction) next = h;
+        }
+        if (next == -1) return;
+
+        Node* node = &tier->nodes[tier->hoists[next]];
+        emitMaterialized(tier, loop, tier->hoists[next]);
+        emitByte(tier, OP_SET_LOCAL);
+        emitByte(tier, registerSlot(tier, node->reg));
+        emitByte(tier, OP_POP);
+        tier->hoists[next] = tier->hoists[--tier->hoistCount];
+    }
+}
+
+// 'original' writes the instruction as it was, for a header run again
+// before its preheader has filled the registers it reads
+static void emitInstruction(Tier* tier, int index, bool original) {
+    Instruction* ins = &tier->code[index];
+    uint8_t* operand = &tier->chunk->code[ins->offset + 1];
+
+    if (!original && ins->removed) return;
+    if (!original && ins->replaceRegister != -1) {
+        emitByte(tier, OP_GET_LOCAL);
+        emitByte(tier, registerSlot(tier, ins->replaceRegister));
+    }
+    else if (!original && ins->replacePosition != -1) {
+        emitByte(tier, OP_GET_LOCAL);
+        emitByte(tier, slotOf(tier, ins->replacePosition));
+    }
+    else if (ins->op == OP_GET_LOCAL || ins->op == OP_SET_LOCAL) {
+        emitByte(tier, ins->op);
+        emitByte(tier, slotOf(tier, operand[0]));
+    }
+    else if (isCountedLoop(ins->op)) {
+        int at = tier->outCount;
+        emitByte(tier, ins->op);
+        emitByte(tier, slotOf(tier, operand[0]));
+        emitByte(tier, slotOf(tier, operand[1]));
+        for (int i = 2; i < ins->length - 3; i++) emitByte(tier, operand[i]);
+        int target = tier->code[ins->target].block;
+        emitDistance(tier, at, target, dominates(tier, target, ins->block));
+    }
+    else if (isJump(ins->op)) {
+        // a back edge skips the loop's preheader
+        int target = tier->code[ins->target].block;
+        emitJump(tier, ins->op, target, dominates(tier, target, ins->block));
+    }
+    else {
+        emitByte(tier, ins->op);
+        for (int i = 0; i < ins->length - 1; i++) emitByte(tier, operand[i]);
+    }
+
+    if (ins->storeRegister != -1) {
+        emitByte(tier, OP_SET_LOCAL);
+        emitByte(tier, registerSlot(tier, ins->storeRegister));
+    }
+}
+
+static bool layOut(Tier* tier) {
+    for (int reg = 0; reg < tier->registers; reg++) emitByte(tier, OP_NIL);
+
+    for (int b = 0; b < tier->blockCount; b++) {
+        Block* block = &tier->blocks[b];
+        block->entry = tier->outCount;
+
+        for (int loop = 0; loop < tier->loopCount; loop++) {
+            Loop* l = &tier->loops[loop];
+            if (l->header != b || !l->hoists) continue;
+
+            if (l->body != -1) {
+                for (int index = block->first; index < block->end; index++) emitInstruction(tier, index, true);
+                emitPreheader(tier, loop);
+                emitJump(tier, OP_JUMP, l->body, false);
+            }
+            else {
+                emitPreheader(tier, loop);
+            }
+        }
+
+        block->label = tier->outCount;
+        for (int index = block->first; index < block->end; index++) emitInstruction(tier, index, false);
+    }
+
+    for (int p = 0; p < tier->patchCount; p++) {
+        Patch* patch = &tier->patches[p];
+        Block* target = &tier->blocks[patch->block];
+        int distance = (patch->back ? target->label : target->entry) - (patch->at + 2);
+
+        uint8_t* op = &tier->out[patch->op];
+        if (isCountedLoop(*op)) {
+            // these only go the one way
+            if ((distance < 0) != (*op == OP_FOR_LOOP)) return false;
+            if (distance < 0) distance = -distance;
+        }
+        else if (distance < 0) {
+            if (*op != OP_JUMP && *op != OP_LOOP) return false;
+            *op = OP_LOOP;
+            distance = -distance;
+        }
+        else if (*op == OP_LOOP) {
+            *op = OP_JUMP;
+        }
+        if (distance > UINT16_MAX) return false;
+        tier->out[patch->at] = (distance >> 8) & 0xff;
+        tier->out[patch->at + 1] = distance & 0xff;
+    }
+    return true;
+}
+
+static void freeTier(Tier* tier) {
+    // each array goes as far as the passes got
+    if (tier->code != NULL) FREE_ARRAY(Instruction, tier->code, tier->count);
+    if (tier->blocks != NULL) FREE_ARRAY(Block, tier->blocks, tier->blockCount);
+    if (tier->preds != NULL) FREE_ARRAY(int, tier->preds, tier->predCapacity);
+    if (tier->order != NULL) FREE_ARRAY(int, tier->order, tier->blockCount);
+    if (tier->nodes != NULL) FREE_ARRAY(Node, tier->nodes, tier->nodeCapacity);
+    if (tier->states != NULL) FREE_ARRAY(int, tier->states, tier->stateCapacity);
+    if (tier->phiArgs != NULL) FREE_ARRAY(int, tier->phiArgs, tier->phiArgCapacity);
+    if (tier->loops != NULL) FREE_ARRAY(Loop, tier->loops, tier->blockCount);
+    if (tier->loopBlocks != NULL) FREE_ARRAY(bool, tier->loopBlocks, tier->blockCount * tier->blockCount);
+    if (tier->invariant != NULL) FREE_ARRAY(int, tier->invariant, tier->nodeCapacity);
+    if (tier->hoists != NULL) FREE_ARRAY(int, tier->hoists, tier->nodeCapacity);
+    if (tier->pending != NULL) FREE_ARRAY(int, tier->pending, tier->nodeCapacity);
+    FREE_ARRAY(Patch, tier->patches, tier->patchCapacity);
+    FREE_ARRAY(uint8_t, tier->out, tier->outCapacity);
+}
+
+void tierUp(ObjFunction* function, Value* args) {
+    // scripts run once, and their last return leaves the stack to the caller
+    if (function->name == NULL || function->baselineCode != NULL) return;
+
+    Tier tier;
+    memset(&tier, 0, sizeof(Tier));
+    tier.function = function;
+    tier.chunk = &function->chunk;
+    tier.params = function->arity + 1;
+    tier.args = args;
+
+    if (decode(&tier) && findBlocks(&tier) && orderBlocks(&tier) && measureDepths(&tier)) {
+        buildGraph(&tier);
+        removeTrivialPhis(&tier);
+        speculate(&tier);
+        inferKnown(&tier);
+        numberValues(&tier);
+        findLoops(&tier);
+        hoistInvariants(&tier);
+        eliminateCommon(&tier);
+
+        if (tier.registers > 0 && layOut(&tier)) {
+            Chunk* chunk = tier.chunk;
+            function->baselineCode = chunk->code;
+            function->baselineCapacity = chunk->capacity;
+            function->numberArgs = tier.numberArgs;
+            chunk->code = tier.out;
+            chunk->count = tier.outCount;
+            chunk->capacity = tier.outCapacity;
+            tier.out = NULL;
+            tier.outCapacity = 0;
+
+#ifdef DEBUG_PRINT_CODE
+            disassembleChunk(chunk, function->name->chars);
+#endif
+        }
+    }
+    freeTier(&tier);
+}
@@ -0,0 +1,23 @@
+#ifndef ROSE_TIER_H
+#define ROSE_TIER_H
+#include "object.h"
+
+// calls before --tier rebuilds a function
+#define TIER_CALLS 1000
+
+// Rebuild a hot function's code through SSA: copy propagation, common
+// subexpressions and loop-invariant code motion, 'args' being the
+// arguments of the call that made it hot. Frames already running the
+// old code keep it. Functions it can't handle are left alone.
+void tierUp(ObjFunction* function, Value* args);
+
+// whether a call with 'args' can run the rebuilt code
+static inline bool tierAccepts(ObjFunction* function, Value* args) {
+    uint32_t bits = function->numberArgs;
+    for (int arg = 0; bits != 0; arg++, bits >>= 1) {
+        if ((bits & 1) && !IS_NUMBER(args[arg])) return false;
+    }
+    return true;
+}
+
+#endif
@@ -24,13 +24,6 @@ void writeValueArray(ValueArray* array, Value value) {
 }
 
 void freeValueArray(ValueArray* array) {
-    // delete natives first
-    for (int i = 0; i < array->count; i++) {
-        if (IS_NATIVE_VAL(array->values[i])) {
-            free(AS_NATIVE_VAL(array->values[i]));
-        }
-    }
-    ///////////////////////
   FREE_ARRAY(Value, array->values, array->capacity);
   initValueArray(array);
 }
@@ -42,7 +35,6 @@ void printValue(Value value) {
         break;
     case VAL_NIL: printf("nil"); break;
     case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
-    case VAL_NATIVE: printf("<native value>"); break;
     case VAL_OBJ: printObject(value); break;
     }
 }
@@ -64,7 +56,6 @@ bool valuesEqual(Value a, Value b) {
         case VAL_NIL:    return true;
         case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
-        case VAL_NATIVE: return AS_NATIVE_VAL(a) == AS_NATIVE_VAL(b);
         default:         return false; // Unreachable.
     }
 }
\ No newline at end of file
@@ -10,8 +10,7 @@ typedef enum {
 	VAL_BOOL,
 	VAL_NIL,
 	VAL_NUMBER,
-	VAL_OBJ,
-	VAL_NATIVE
+	VAL_OBJ
 } ValueType;
 
 typedef struct {
@@ -20,30 +19,22 @@ typedef struct {
 		bool boolean;
 		double number;
 		Obj* obj;
-		void* native;
 	} as;
-	int nativeSize;
 } Value;
 
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
-#define IS_NATIVE_VAL(value)     ((value).type == VAL_NATIVE)
 
 #define AS_BOOL(value)    ((value).as.boolean)
 #define AS_NUMBER(value)  ((value).as.number)
 #define AS_OBJ(value)     ((value).as.obj)
-#define AS_NATIVE_VAL(value)     ((value).as.native)
-
-#define NATIVE_VAL_SIZE(value)     ((value).nativeSize)
 
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
-#define NATIVE_VAL(object, size)   \
-	((Value){VAL_NATIVE, {.native = (void*)object}, .nativeSize = (int)size})
 
 typedef struct {
   int capacity;
@@ -8,6 +8,9 @@
 #include "object.h"
 #include "memory.h"
 #include "natives.h"
+#include "tier.h"
+#include "inline.h"
+#include "bytecode.h"
 
 #ifdef _WIN32
 #include <windows.h>
@@ -51,17 +54,54 @@ static void runtimeError(const char* format, ...) {
     resetStack();
 }
 
+// Writing the global of a native sends the OP_CALL_NATIVE compiled for
+// it back through the global. Most names miss the filter and skip the search.
+static inline void shadowNative(ObjString* name) {
+    uint32_t bit = name->hash % NATIVE_FILTER_BITS;
+    if ((vm.nativeNames[bit / 32] & (1u << (bit % 32))) == 0) return;
+    for (int i = 0; i < vm.nativeCount; i++) {
+        if (vm.natives[i].name == name) vm.natives[i].shadowed = true;
+    }
+}
+
 void defineNative(const char* name, NativeFn function) {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
     push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    ObjString* string = AS_STRING(vm.stack[0]);
+    shadowNative(string);
+    tableSet(&vm.globals, string, vm.stack[1]);
+
+    if (vm.nativeCount + 1 > vm.nativeCapacity) {
+        int oldCapacity = vm.nativeCapacity;
+        vm.nativeCapacity = GROW_CAPACITY(oldCapacity);
+        vm.natives = GROW_ARRAY(NativeSlot, vm.natives, oldCapacity, vm.nativeCapacity);
+    }
+    NativeSlot* native = &vm.natives[vm.nativeCount++];
+    native->name = string;
+    native->function = function;
+    native->shadowed = false;
+    uint32_t bit = string->hash % NATIVE_FILTER_BITS;
+    vm.nativeNames[bit / 32] |= 1u << (bit % 32);
     pop();
     pop();
 }
 
+// the index in vm.natives of the native 'name' holds, -1 if it holds
+// anything else
+int nativeIndex(ObjString* name) {
+    Value value;
+    if (!tableGet(&vm.globals, name, &value) || !IS_NATIVE(value)) return -1;
+    for (int i = 0; i < vm.nativeCount; i++) {
+        NativeSlot* native = &vm.natives[i];
+        if (native->name == name && !native->shadowed && native->function == AS_NATIVE(value)) return i;
+    }
+    return -1;
+}
+
 void defineGlobalVar(const char* name, Value val) {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
     push(val);
+    shadowNative(AS_STRING(vm.stack[0]));
     tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
     pop();
     pop();
@@ -69,14 +109,65 @@ void defineGlobalVar(const char* name, Value val) {
 
 void initVM() {
     resetStack();
-    vm.objects = NULL;
 
     // gc
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
     vm.bytesAllocated = 0;
+    vm.bytesFreed = 0;
+    // most garbage dies in the nursery, so the old space alone is small and
+    // would otherwise be collected every few kilobytes of promotion
     vm.nextGC = 1024 * 1024;
+    vm.gcGrowFactor = 2;
+    vm.gcHeapMin = vm.nextGC;
+    vm.gcHeapLimit = 0;
+    vm.gcLog = false;
+    vm.largeBytes = 0;
+    vm.nextLarge = 16 * 1024 * 1024;
+    vm.gcPhase = GC_IDLE;
+    vm.gcStepAt = vm.nextGC;
+    vm.gcStats = false;
+    vm.gcConcurrent = false;
+    vm.gcThreads = 1;
+    vm.gcCycles = 0;
+    vm.minorPauses.count = vm.minorPauses.capacity = 0;
+    vm.minorPauses.total = vm.minorPauses.longest = 0;
+    vm.minorPauses.times = NULL;
+    vm.majorPauses.count = vm.majorPauses.capacity = 0;
+    vm.majorPauses.total = vm.majorPauses.longest = 0;
+    vm.majorPauses.times = NULL;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.remembered = NULL;
+    vm.satbCount = vm.satbCapacity = 0;
+    vm.satbLog = NULL;
+    vm.deferredCount = vm.deferredCapacity = 0;
+    vm.deferred = NULL;
+    vm.tierCalls = 0;
+    vm.inlining = true;
+    vm.caching = true;
+    vm.natives = NULL;
+    vm.nativeCount = vm.nativeCapacity = 0;
+    memset(vm.nativeNames, 0, sizeof(vm.nativeNames));
+    initNursery();
+
+    // the environment sets the collector up, the command line then overrides it
+    static const char* gcVariables[][2] = {
+        { "ROSE_GC_GROWTH", "growth" },
+        { "ROSE_GC_HEAP_MIN", "heap-min" },
+        { "ROSE_GC_HEAP_LIMIT", "heap-limit" },
+        { "ROSE_GC_THREADS", "threads" },
+        { "ROSE_GC_LOG", "log" },
+    };
+    for (int i = 0; i < (int)(sizeof(gcVariables) / sizeof(gcVariables[0])); i++) {
+        const char* value = getenv(gcVariables[i][0]);
+        const char* name = gcVariables[i][1];
+
+        if (value != NULL && !setGCOption(name, (int)strlen(name), value)) {
+            fprintf(stderr, "Ignoring %s=%s.\n", gcVariables[i][0], value);
+        }
+    }
 
     initTable(&vm.strings);
     initTable(&vm.globals);
@@ -92,8 +183,16 @@ void initVM() {
 }
 
 void freeVM() {
+#ifdef DEBUG_TABLE_STATS
+    tableStats(&vm.strings, "strings");
+    tableStats(&vm.globals, "globals");
+#endif
+    if (vm.gcStats) printGCStats();
     freeTable(&vm.globals);
     freeTable(&vm.strings);
+    FREE_ARRAY(NativeSlot, vm.natives, vm.nativeCapacity);
+    vm.natives = NULL;
+    vm.nativeCount = vm.nativeCapacity = 0;
     vm.initString = NULL;
     vm.destString = NULL;
     freeObjects();
@@ -114,6 +213,36 @@ static Value peek(int distance) {
     return vm.stackTop[-1 - distance];
 }
 
+// While the marker thread runs, a table it may read is only changed with
+// the heap locked, and a lookup that moves entries of a resizing table
+// counts as a change
+static bool getField(Table* table, ObjString* name, Value* value) {
+    if (vm.gcPhase != GC_CONCURRENT_MARK || table->oldControl == NULL) {
+        return tableGet(table, name, value);
+    }
+
+    lockHeap();
+    bool found = tableGet(table, name, value);
+    unlockHeap();
+    return found;
+}
+
+static void setField(Obj* owner, Table* table, ObjString* name, Value value) {
+    if (vm.gcPhase != GC_CONCURRENT_MARK) {
+        tableSet(table, name, value);
+    }
+    else {
+        lockHeap();
+        Value old;
+        if (tableGet(table, name, &old)) SATB_BARRIER(old);
+        tableSet(table, name, value);
+        unlockHeap();
+    }
+
+    WRITE_BARRIER(owner, OBJ_VAL(name));
+    WRITE_BARRIER(owner, value);
+}
+
 static bool call(ObjClosure* closure, int argCount) {
 
     if (argCount != closure->function->arity) {
@@ -127,9 +256,16 @@ static bool call(ObjClosure* closure, int argCount) {
         return false;
     }
 
+    ObjFunction* function = closure->function;
+    Value* args = vm.stackTop - argCount;
+    if (vm.tierCalls > 0 && function->calls < vm.tierCalls && ++function->calls == vm.tierCalls) {
+        tierUp(function, args);
+    }
+
     CallFrame* frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
+    frame->ip = function->chunk.code;
+    if (function->numberArgs != 0 && !tierAccepts(function, args)) frame->ip = function->baselineCode;
     frame->slots = vm.stackTop - argCount - 1;
     return true;
 }
@@ -148,7 +284,7 @@ static bool callValue(Value callee, int argCount) {
 
             // call init
             Value initializer;
-            if (tableGet(&klass->methods, vm.initString, &initializer)) {
+            if (getField(&klass->methods, vm.initString, &initializer)) {
                 return call(AS_CLOSURE(initializer), argCount);
             }
             else if (argCount != 0) {
@@ -176,7 +312,7 @@ static bool callValue(Value callee, int argCount) {
 
 static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
     Value method;
-    if (!tableGet(&klass->methods, name, &method)) {
+    if (!getField(&klass->methods, name, &method)) {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
@@ -194,7 +330,7 @@ static bool invoke(ObjString* name, int argCount) {
     ObjInstance* instance = AS_INSTANCE(receiver);
 
     Value value;
-    if (tableGet(&instance->fields, name, &value)) {
+    if (getField(&instance->fields, name, &value)) {
         vm.stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
     }
@@ -204,7 +340,7 @@ static bool invoke(ObjString* name, int argCount) {
 
 static bool bindMethod(ObjClass* klass, ObjString* name) {
     Value method;
-    if (!tableGet(&klass->methods, name, &method)) {
+    if (!getField(&klass->methods, name, &method)) {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
@@ -243,19 +379,25 @@ static ObjUpvalue* captureUpvalue(Value* local) {
 }
 
 static void closeUpvalues(Value* last) {
+    bool concurrent = vm.gcPhase == GC_CONCURRENT_MARK;
+    if (concurrent) lockHeap();
+
     while (vm.openUpvalues != NULL &&
         vm.openUpvalues->location >= last) {
         ObjUpvalue* upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        WRITE_BARRIER(upvalue, upvalue->closed);
         vm.openUpvalues = upvalue->next;
     }
+
+    if (concurrent) unlockHeap();
 }
 
 static void defineMethod(ObjString* name) {
     Value method = peek(0);
     ObjClass* klass = AS_CLASS(peek(1));
-    tableSet(&klass->methods, name, method);
+    setField((Obj*)klass, &klass->methods, name, method);
     pop();
 }
 
@@ -263,6 +405,17 @@ static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// a counted loop's condition, compared the way OP_LESS and OP_GREATER
+// and the OP_NOT after them would
+static inline bool forContinues(double counter, double limit, uint8_t flags) {
+    switch (flags & FOR_TEST) {
+    case FOR_LESS:       return counter < limit;
+    case FOR_LESS_EQUAL: return !(counter > limit);
+    case FOR_GREATER:    return counter > limit;
+    default:             return !(counter < limit);
+    }
+}
+
 static void concatenate() {
     // peaking to protect from garbage collection
     ObjString* b = AS_STRING(peek(0));
@@ -282,13 +435,12 @@ static void concatenate() {
 
 int ReadInt(CallFrame* frame) {
     int constant = 0;
-    int pos = frame->ip - frame->closure->function->chunk.code;
+    // read through ip, which may be in code the function has since replaced
+    constant |= ((int)frame->ip[0]);
+    constant |= ((int)frame->ip[1]) << 8;
+    constant |= ((int)frame->ip[2]) << 16;
+    constant |= ((int)frame->ip[3]) << 24;
 
-    constant |= ((int)(frame->closure->function->chunk.code[pos++]));
-    constant |= ((int)(frame->closure->function->chunk.code[pos++])) << 8;
-    constant |= ((int)(frame->closure->function->chunk.code[pos++])) << 16;
-    constant |= ((int)(frame->closure->function->chunk.code[pos++])) << 24;
-    
     return constant;
 }
 
@@ -305,7 +457,7 @@ static bool callDestructor(ObjInstance* instance) {
     ObjClass* klass = instance->klass;
     Value destructor;
 
-    if (tableGet(&klass->methods, vm.destString, &destructor)) {
+    if (getField(&klass->methods, vm.destString, &destructor)) {
         push(OBJ_VAL(instance));
 
         ObjClosure* closure = AS_CLOSURE(destructor);
@@ -331,6 +483,16 @@ static InterpretResult run() {
     (frame->ip += 2, \
     (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 
+// collections only run here, between instructions
+#ifdef DEBUG_STRESS_GC
+#define SAFE_POINT() gcSafePoint()
+#else
+#define SAFE_POINT() \
+    do { \
+      if (vm.minorPending || vm.bytesAllocated > vm.gcStepAt) gcSafePoint(); \
+    } while (false)
+#endif
+
 #define BINARY_OP(valueType, op) \
     do { \
       if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
@@ -414,6 +576,7 @@ static InterpretResult run() {
             // GLobal variables
             case OP_DEFINE_GLOBAL: { // Set
                 ObjString* name = READ_STRING();
+                shadowNative(name);
                 tableSet(&vm.globals, name, peek(0));
                 pop();
                 break;
@@ -430,6 +593,7 @@ static InterpretResult run() {
             }
             case OP_SET_GLOBAL: {
                 ObjString* name = READ_STRING();
+                shadowNative(name);
                 if (tableSet(&vm.globals, name, peek(0))) {
                     tableDelete(&vm.globals, name);
                     runtimeError("Undefined global variable '%s'.", name->chars);
@@ -452,6 +616,11 @@ static InterpretResult run() {
                 if (isFalsey(peek(0))) frame->ip += offset;
                 break;
             }
+            case OP_POP_JUMP_IF_FALSE: {
+                uint16_t offset = READ_SHORT();
+                if (isFalsey(pop())) frame->ip += offset;
+                break;
+            }
             case OP_JUMP: {
                 uint16_t offset = READ_SHORT();
                 frame->ip += offset;
@@ -460,25 +629,93 @@ static InterpretResult run() {
             case OP_LOOP: {
                 uint16_t offset = READ_SHORT();
                 frame->ip -= offset;
+                SAFE_POINT();
+                break;
+            }
+            case OP_FOR_PREP: {
+                Value* counter = &frame->slots[READ_BYTE()];
+                Value* limit = &frame->slots[READ_BYTE()];
+                uint8_t flags = READ_BYTE();
+                uint16_t offset = READ_SHORT();
+                if (!IS_NUMBER(*counter) || !IS_NUMBER(*limit)) {
+                    runtimeError("Operands must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (!forContinues(AS_NUMBER(*counter), AS_NUMBER(*limit), flags)) frame->ip += offset;
+                break;
+            }
+            case OP_FOR_LOOP: {
+                Value* counter = &frame->slots[READ_BYTE()];
+                Value* limit = &frame->slots[READ_BYTE()];
+                uint8_t flags = READ_BYTE();
+                double step = AS_NUMBER(READ_CONSTANT());
+                uint16_t offset = READ_SHORT();
+                if (!IS_NUMBER(*counter)) {
+                    runtimeError((flags & FOR_SUBTRACT) ? "Operands must be numbers." :
+                        "Operands must be two numbers or two strings.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                // the slot already holds a number, only its payload changes
+                double next = (flags & FOR_SUBTRACT) ? AS_NUMBER(*counter) - step : AS_NUMBER(*counter) + step;
+                counter->as.number = next;
+                if (!IS_NUMBER(*limit)) {
+                    runtimeError("Operands must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (forContinues(next, AS_NUMBER(*limit), flags)) {
+                    frame->ip -= offset;
+                    SAFE_POINT();
+                }
                 break;
             }
             case OP_CALL: {
                 int argCount = READ_BYTE();
+                SAFE_POINT();
                 if (!callValue(peek(argCount), argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 frame = &vm.frames[vm.frameCount - 1];
                 break;
             }
+            case OP_CALL_NATIVE: {
+                ObjString* name = READ_STRING();
+                NativeSlot* native = &vm.natives[READ_BYTE()];
+                int argCount = READ_BYTE();
+                SAFE_POINT();
+                if (native->shadowed) {
+                    // the function goes under the arguments, where OP_CALL has it
+                    Value callee;
+                    if (!tableGet(&vm.globals, name, &callee)) {
+                        runtimeError("Undefined global variable '%s'.", name->chars);
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    Value* args = vm.stackTop - argCount;
+                    memmove(args + 1, args, argCount * sizeof(Value));
+                    *args = callee;
+                    vm.stackTop++;
+                    if (!callValue(callee, argCount)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    frame = &vm.frames[vm.frameCount - 1];
+                    break;
+                }
+                Value result = native->function(argCount, vm.stackTop - argCount);
+                vm.stackTop -= argCount;
+                push(result);
+                break;
+            }
             case OP_ARRAY: {
-                Value array_count = pop();
-                ValueArray* array_entries = (ValueArray*)malloc(sizeof(ValueArray));
-                initValueArray(array_entries);
-                for (int i = 0; i < (int)array_count.as.number; i++) {
-                    Value val = pop();
-                    writeValueArray(array_entries, val);
+                int count = (int)AS_NUMBER(pop());
+                ObjArray* array = newArray();
+                push(OBJ_VAL(array));
+                // elements stay on the stack until the array holds them,
+                // stored last to first
+                for (int i = 1; i <= count; i++) {
+                    writeValueArray(&array->values, peek(i));
                 }
-                push(NATIVE_VAL(array_entries, sizeof(ValueArray)));
+                vm.stackTop -= count + 1;
+                push(OBJ_VAL(array));
                 break;
             }
             case OP_CLOSURE: {
@@ -505,7 +742,18 @@ static InterpretResult run() {
             }
             case OP_SET_UPVALUE: {
                 uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
+                ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+                if (vm.gcPhase == GC_CONCURRENT_MARK &&
+                    upvalue->location == &upvalue->closed) {
+                    lockHeap();
+                    SATB_BARRIER(upvalue->closed);
+                    upvalue->closed = peek(0);
+                    unlockHeap();
+                }
+                else {
+                    *upvalue->location = peek(0);
+                }
+                WRITE_BARRIER(upvalue, peek(0));
                 break;
             }
             case OP_CLOSE_UPVALUE:
@@ -525,7 +773,7 @@ static InterpretResult run() {
                 ObjString* name = READ_STRING();
 
                 Value value;
-                if (tableGet(&instance->fields, name, &value)) {
+                if (getField(&instance->fields, name, &value)) {
                     pop(); // Instance.
                     push(value);
                     break;
@@ -543,7 +791,8 @@ static InterpretResult run() {
                 }
 
                 ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
+                ObjString* name = READ_STRING();
+                setField((Obj*)instance, &instance->fields, name, peek(0));
                 Value value = pop();
                 pop();
                 push(value);
@@ -554,6 +803,8 @@ static InterpretResult run() {
                 break;
             }
             case OP_INVOKE: {
+                // a minor collection can move the name
+                SAFE_POINT();
                 ObjString* method = READ_STRING();
                 int argCount = READ_BYTE();
                 if (!invoke(method, argCount)) {
@@ -571,7 +822,10 @@ static InterpretResult run() {
                 }
 
                 ObjClass* subclass = AS_CLASS(peek(0));
+                if (vm.gcPhase == GC_CONCURRENT_MARK) lockHeap();
                 tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+                if (vm.gcPhase == GC_CONCURRENT_MARK) unlockHeap();
+                rescanObject((Obj*)subclass);
                 pop(); // Subclass.
                 break;
             }
@@ -665,7 +919,7 @@ static InterpretResult run() {
 
                 // Call the document
                 // pass directory to compile
-                ObjFunction* function = compile(file, exe_path, dir_path, isPackage);
+                ObjFunction* function = compileCached(file, path, exe_path, dir_path, isPackage);
                 if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
                 push(OBJ_VAL(function));
@@ -708,7 +962,7 @@ static InterpretResult run() {
                 const char* file = readFile(packageMain);
 
                 // Call the document
-                ObjFunction* function = compile(file, AS_CSTRING(ExePath), packagePath, true);
+                ObjFunction* function = compileCached(file, packageMain, AS_CSTRING(ExePath), packagePath, true);
                 if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
                 push(OBJ_VAL(function));
@@ -730,11 +984,13 @@ static InterpretResult run() {
 #undef READ_SHORT
 #undef READ_STRING
 #undef BINARY_OP
+#undef SAFE_POINT
 }
 
-InterpretResult interpret(const char* source) {
+// the executable's directory and the working directory, which compile()
+// keeps in a script for OP_IMPORT and OP_INCLUDE
+static void scriptDirectories(char* dir, char* curDir) {
     char buff[FILENAME_MAX];
-    char curDir[FILENAME_MAX];
 
     GetCurrentDir(curDir, FILENAME_MAX);
 
@@ -743,7 +999,6 @@ InterpretResult interpret(const char* source) {
 
     char* ptr = strrchr(buff, '\\');
 
-    char dir[FILENAME_MAX + 1];
     int last_index = ptr - buff;
     
     //memcpy(dir, buff, last_index);
@@ -751,11 +1006,11 @@ InterpretResult interpret(const char* source) {
         dir[i] = buff[i];
     }
     dir[last_index] = '\0';
+}
 
-    ObjFunction* function = compile(source, dir, curDir, false);
-    if (function == NULL) return INTERPRET_COMPILE_ERROR;
-
+static InterpretResult runScript(ObjFunction* function) {
     push(OBJ_VAL(function));
+    if (vm.inlining) inlineCalls(function);
     ObjClosure* closure = newClosure(function);
     pop();
     push(OBJ_VAL(closure));
@@ -764,6 +1019,37 @@ InterpretResult interpret(const char* source) {
     return run();
 }
 
+InterpretResult interpret(const char* source, const char* path) {
+    char dir[FILENAME_MAX + 1];
+    char curDir[FILENAME_MAX];
+    scriptDirectories(dir, curDir);
+
+    ObjFunction* function = path == NULL ? compile(source, dir, curDir, false) :
+        compileCached(source, path, dir, curDir, false);
+    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    return runScript(function);
+}
+
+InterpretResult interpretBytecode(const char* path) {
+    char dir[FILENAME_MAX + 1];
+    char curDir[FILENAME_MAX];
+    scriptDirectories(dir, curDir);
+
+    ObjFunction* function = loadBytecode(path, dir, curDir);
+    if (function == NULL) {
+        fprintf(stderr, "Could not load \"%s\".\n", path);
+        return INTERPRET_COMPILE_ERROR;
+    }
+    return runScript(function);
+}
+
+bool compileFile(const char* source, const char* path) {
+    char dir[FILENAME_MAX + 1];
+    char curDir[FILENAME_MAX];
+    scriptDirectories(dir, curDir);
+    return compileBytecode(source, path, dir, curDir);
+}
+
 static char* readFile(const char* path) {
     FILE* file = fopen(path, "rb");
 
@@ -9,6 +9,8 @@
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// bits in the filter of native names global writes check, see shadowNative
+#define NATIVE_FILTER_BITS 1024
 
 typedef struct {
 	ObjClosure* closure;
@@ -16,12 +18,36 @@ typedef struct {
 	Value* slots;
 } CallFrame;
 
+// a native OP_CALL_NATIVE calls by its index in vm.natives
+typedef struct {
+	ObjString* name;
+	NativeFn function;
+	// its global was written since, calls look the global up again
+	bool shadowed;
+} NativeSlot;
+
 typedef enum {
 	INTERPRET_OK,
 	INTERPRET_COMPILE_ERROR,
 	INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
+typedef enum {
+	GC_IDLE,
+	GC_MARK,
+	GC_CONCURRENT_MARK,
+	GC_SWEEP
+} GCPhase;
+
+// pause lengths in microseconds, each one is kept for --gc-stats
+typedef struct {
+	int count;
+	double total;
+	double longest;
+	int capacity;
+	double* times;
+} GCPauses;
+
 typedef struct {
 	CallFrame frames[FRAMES_MAX];
 	int frameCount;
@@ -30,7 +56,6 @@ typedef struct {
 	Value* stackTop;
 	// objects
 	ObjUpvalue* openUpvalues;
-	Obj* objects;
 	Table strings;
 	Table globals;
 	// garbage collection
@@ -38,7 +63,52 @@ typedef struct {
 	int grayCapacity;
 	Obj** grayStack;
 	size_t bytesAllocated;
+	size_t bytesFreed;
 	size_t nextGC;
+	// policy, see setGCOption
+	double gcGrowFactor;
+	size_t gcHeapMin;
+	size_t gcHeapLimit;
+	bool gcLog;
+	// large object space
+	size_t largeBytes;
+	size_t nextLarge;
+	// incremental cycle
+	GCPhase gcPhase;
+	size_t gcStepAt;
+	bool gcStats;
+	bool gcConcurrent;
+	int gcThreads;
+	GCPauses minorPauses;
+	GCPauses majorPauses;
+	int gcCycles;
+	// young generation
+	uint8_t* nurseryStart;
+	uint8_t* nurseryTop;
+	uint8_t* nurseryEnd;
+	bool minorPending;
+	int rememberedCount;
+	int rememberedCapacity;
+	Obj** remembered;
+	// concurrent marking
+	int satbCount;
+	int satbCapacity;
+	Obj** satbLog;
+	int deferredCount;
+	int deferredCapacity;
+	Obj** deferred;
+	// calls before a function is rebuilt by the tier, 0 for never
+	int tierCalls;
+	// calls to small global functions take their bodies, see inlineCalls
+	bool inlining;
+	// scripts read from files go through .rosec files, see compileCached
+	bool caching;
+	// natives in the order defineNative made them, with a bit set in
+	// 'nativeNames' for the hash of each name
+	NativeSlot* natives;
+	int nativeCount;
+	int nativeCapacity;
+	uint32_t nativeNames[NATIVE_FILTER_BITS / 32];
 	// OOP
 	ObjString* initString;
 	ObjString* destString;
@@ -46,10 +116,14 @@ typedef struct {
 
 extern VM vm;
 
-InterpretResult interpret(const char* source);
+// 'path' is the file 'source' was read from, NULL for the REPL
+InterpretResult interpret(const char* source, const char* path);
+InterpretResult interpretBytecode(const char* path);
+bool compileFile(const char* source, const char* path);
 void initVM();
 void freeVM();
 void defineNative(const char* name, NativeFn function);
+int nativeIndex(ObjString* name);
 void push(Value value);
 Value pop();
 bool callDestructor(ObjInstance* instance);
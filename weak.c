@@ -0,0 +1,174 @@
+#include "weak.h"
+#include "value.h"
+#include "vm.h"
+#include "object.h"
+#include "memory.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+#define WEAK_MAP_MAX_LOAD 0.75
+
+// Keys are hashed on their address. A minor collection moves young keys,
+// the collector rehashes the maps it moved keys of.
+static uint32_t hashKey(Obj* key) {
+	uint64_t bits = (uint64_t)(uintptr_t)key >> 3;
+	uint32_t hash = (uint32_t)(bits ^ (bits >> 32));
+	hash ^= hash >> 16;
+	hash *= 0x7feb352d;
+	hash ^= hash >> 15;
+	hash *= 0x846ca68b;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+static WeakEntry* findEntry(WeakEntry* entries, int capacity, Obj* key) {
+	uint32_t index = hashKey(key) & (capacity - 1);
+	WeakEntry* tombstone = NULL;
+
+	for (;;) {
+		WeakEntry* entry = &entries[index];
+		if (entry->key == NULL) {
+			if (IS_NIL(entry->value)) return tombstone != NULL ? tombstone : entry;
+			if (tombstone == NULL) tombstone = entry;
+		}
+		else if (entry->key == key) {
+			return entry;
+		}
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+// rebuild the entries at 'capacity', dropping the deleted ones
+static void adjustCapacity(ObjWeakMap* map, int capacity) {
+	WeakEntry* entries = ALLOCATE(WeakEntry, capacity);
+	for (int i = 0; i < capacity; i++) {
+		entries[i].key = NULL;
+		entries[i].value = NIL_VAL;
+	}
+
+	for (int i = 0; i < map->capacity; i++) {
+		WeakEntry* entry = &map->entries[i];
+		if (entry->key == NULL) continue;
+
+		WeakEntry* dest = findEntry(entries, capacity, entry->key);
+		dest->key = entry->key;
+		dest->value = entry->value;
+	}
+
+	FREE_ARRAY(WeakEntry, map->entries, map->capacity);
+	map->entries = entries;
+	map->capacity = capacity;
+	map->tombstones = 0;
+}
+
+void clearWeakEntry(ObjWeakMap* map, WeakEntry* entry) {
+	entry->key = NULL;
+	entry->value = BOOL_VAL(true);
+	map->count--;
+	map->tombstones++;
+}
+
+void rehashWeakMap(ObjWeakMap* map) {
+	if (map->capacity > 0) adjustCapacity(map, map->capacity);
+}
+
+static WeakEntry* lookup(ObjWeakMap* map, Obj* key) {
+	if (map->count == 0) return NULL;
+	WeakEntry* entry = findEntry(map->entries, map->capacity, key);
+	return entry->key == NULL ? NULL : entry;
+}
+
+// Handing out an object only a weak reference reaches makes it strong
+// again, so a cycle under way has to keep it
+static Value keepAlive(Value value) {
+	if (!IS_OBJ(value)) return value;
+
+	if (vm.gcPhase == GC_MARK) {
+		markObject(AS_OBJ(value));
+	}
+	else if (vm.gcPhase == GC_CONCURRENT_MARK) {
+		lockHeap();
+		logOverwrite(AS_OBJ(value));
+		unlockHeap();
+	}
+	return value;
+}
+
+static Value WeakRefNew(int argCount, Value* args) {
+	if (argCount != 1 || !IS_OBJ(args[0])) return NIL_VAL;
+	return OBJ_VAL(newWeakRef(AS_OBJ(args[0])));
+}
+
+// the target, or nil once it was collected
+static Value WeakRefGet(int argCount, Value* args) {
+	if (argCount != 1 || !IS_WEAK_REF(args[0])) return NIL_VAL;
+	Obj* target = AS_WEAK_REF(args[0])->target;
+	return target == NULL ? NIL_VAL : keepAlive(OBJ_VAL(target));
+}
+
+static Value WeakMapNew(int argCount, Value* args) {
+	if (argCount != 0) return NIL_VAL;
+	return OBJ_VAL(newWeakMap());
+}
+
+static Value WeakMapSet(int argCount, Value* args) {
+	if (argCount != 3 || !IS_WEAK_MAP(args[0]) || !IS_OBJ(args[1])) return NIL_VAL;
+	ObjWeakMap* map = AS_WEAK_MAP(args[0]);
+
+	if (map->count + map->tombstones + 1 > map->capacity * WEAK_MAP_MAX_LOAD) {
+		// only grow when the live entries need it
+		int capacity = map->count + 1 > map->capacity * WEAK_MAP_MAX_LOAD / 2 ?
+			GROW_CAPACITY(map->capacity) : map->capacity;
+		adjustCapacity(map, capacity);
+	}
+
+	WeakEntry* entry = findEntry(map->entries, map->capacity, AS_OBJ(args[1]));
+	if (entry->key == NULL) {
+		if (!IS_NIL(entry->value)) map->tombstones--;
+		map->count++;
+	}
+	entry->key = AS_OBJ(args[1]);
+	entry->value = args[2];
+
+	WRITE_BARRIER(AS_OBJ(args[0]), args[1]);
+	WRITE_BARRIER(AS_OBJ(args[0]), args[2]);
+	return NIL_VAL;
+}
+
+static Value WeakMapGet(int argCount, Value* args) {
+	if (argCount != 2 || !IS_WEAK_MAP(args[0]) || !IS_OBJ(args[1])) return NIL_VAL;
+	WeakEntry* entry = lookup(AS_WEAK_MAP(args[0]), AS_OBJ(args[1]));
+	return entry == NULL ? NIL_VAL : keepAlive(entry->value);
+}
+
+static Value WeakMapHas(int argCount, Value* args) {
+	if (argCount != 2 || !IS_WEAK_MAP(args[0]) || !IS_OBJ(args[1])) return NIL_VAL;
+	return BOOL_VAL(lookup(AS_WEAK_MAP(args[0]), AS_OBJ(args[1])) != NULL);
+}
+
+static Value WeakMapDelete(int argCount, Value* args) {
+	if (argCount != 2 || !IS_WEAK_MAP(args[0]) || !IS_OBJ(args[1])) return NIL_VAL;
+	ObjWeakMap* map = AS_WEAK_MAP(args[0]);
+	WeakEntry* entry = lookup(map, AS_OBJ(args[1]));
+	if (entry == NULL) return BOOL_VAL(false);
+
+	clearWeakEntry(map, entry);
+	return BOOL_VAL(true);
+}
+
+// entries whose keys were alive at the last collection
+static Value WeakMapLength(int argCount, Value* args) {
+	if (argCount != 1 || !IS_WEAK_MAP(args[0])) return NIL_VAL;
+	return NUMBER_VAL(AS_WEAK_MAP(args[0])->count);
+}
+
+void LoadWeak() {
+	defineNative("weakref", WeakRefNew);
+	defineNative("weakref_get", WeakRefGet);
+	defineNative("weakmap", WeakMapNew);
+	defineNative("weakmap_set", WeakMapSet);
+	defineNative("weakmap_get", WeakMapGet);
+	defineNative("weakmap_has", WeakMapHas);
+	defineNative("weakmap_delete", WeakMapDelete);
+	defineNative("weakmap_len", WeakMapLength);
+}
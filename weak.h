@@ -0,0 +1,11 @@
+#ifndef ROSE_WEAK_H
+#define ROSE_WEAK_H
+#include "object.h"
+
+void LoadWeak();
+
+// for the collector
+void clearWeakEntry(ObjWeakMap* map, WeakEntry* entry);
+void rehashWeakMap(ObjWeakMap* map);
+
+#endif